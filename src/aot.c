@@ -0,0 +1,725 @@
+// Needed for popen() with -std=c11.
+#define _DEFAULT_SOURCE
+
+#include "aot.h"
+#include "parser.h"
+#include "utils.h"
+#include "vm.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+// Ahead of time compilation, the program is translated into a C
+// translation unit with a label per instruction that's then handed
+// to the system C compiler. The accumulator, stack pointer and flags
+// are locals of main(), so the optimizer gets to keep them in
+// registers and fold constants across instructions.
+//
+// Operands are baked in as constants, unless the program can store
+// into them, then they're read from data[] like the VM does.
+
+// Everything the generated code needs besides the instructions. The
+// input and output routines and error messages must match those of
+// vm.c and output.c.
+static const char *prelude =
+    "#include <stdio.h>\n"
+    "#include <stdlib.h>\n"
+    "#include <string.h>\n"
+    "#include <stdbool.h>\n"
+    "#include <stdint.h>\n"
+    "#include <inttypes.h>\n"
+    "\n"
+    "#include <unistd.h>\n"
+    "\n"
+    "#define MEMORY_CAP %zu\n"
+    "#define STACK_CAP %zu\n"
+    "#define OUTPUT_CAP %zu\n"
+    "\n"
+    "static char output[OUTPUT_CAP + 20];\n"
+    "static size_t output_len;\n"
+    "static bool output_line;\n"
+    "\n"
+    "static void flush_output() {\n"
+    "    fwrite(output, 1, output_len, stdout);\n"
+    "    fflush(stdout);\n"
+    "    output_len = 0;\n"
+    "}\n"
+    "\n"
+    "static inline void print_char(char c) {\n"
+    "    output[output_len++] = c;\n"
+    "\n"
+    "    if (output_len >= OUTPUT_CAP || (output_line && c == '\\n'))\n"
+    "        flush_output();\n"
+    "}\n"
+    "\n"
+    "static void print_int(int64_t value) {\n"
+    "    char digits[20];\n"
+    "    char *p = digits + sizeof(digits);\n"
+    "    uint64_t n = value < 0 ? -(uint64_t)value : (uint64_t)value;\n"
+    "\n"
+    "    do {\n"
+    "        *--p = '0' + n %% 10;\n"
+    "        n /= 10;\n"
+    "    } while (n != 0);\n"
+    "\n"
+    "    if (value < 0)\n"
+    "        *--p = '-';\n"
+    "\n"
+    "    memcpy(output + output_len, p, digits + sizeof(digits) - p);\n"
+    "    output_len += digits + sizeof(digits) - p;\n"
+    "\n"
+    "    if (output_len >= OUTPUT_CAP)\n"
+    "        flush_output();\n"
+    "}\n"
+    "\n"
+    "__attribute__((noreturn)) static void die(const char *message) {\n"
+    "    flush_output();\n"
+    "    fprintf(stderr, \"vm: error: %%s\\n\", message);\n"
+    "    fprintf(stderr, \"aborting...\\n\");\n"
+    "    exit(EXIT_FAILURE);\n"
+    "}\n"
+    "\n"
+    "__attribute__((noreturn)) static void undefined_instruction(uint64_t opcode) {\n"
+    "    flush_output();\n"
+    "    fprintf(stderr, \"vm: error: undefined instruction %%\" PRIu64 \"\\n\", opcode);\n"
+    "    fprintf(stderr, \"aborting...\\n\");\n"
+    "    exit(EXIT_FAILURE);\n"
+    "}\n"
+    "\n"
+    "static int next_char() {\n"
+    "    return getchar_unlocked();\n"
+    "}\n"
+    "\n"
+    "static void skip_line(int c) {\n"
+    "    while (c != '\\n' && c != EOF)\n"
+    "        c = next_char();\n"
+    "}\n"
+    "\n"
+    "static char read_char() {\n"
+    "    flush_output();\n"
+    "    const int c = next_char();\n"
+    "    skip_line(c);\n"
+    "    return c == '\\n' || c == EOF ? 0 : c;\n"
+    "}\n"
+    "\n"
+    "static int64_t read_int() {\n"
+    "    flush_output();\n"
+    "    int c = next_char();\n"
+    "\n"
+    "    while (c == ' ' || c == '\\t')\n"
+    "        c = next_char();\n"
+    "\n"
+    "    const bool negative = c == '-';\n"
+    "\n"
+    "    if (c == '-' || c == '+')\n"
+    "        c = next_char();\n"
+    "\n"
+    "    const uint64_t limit = negative ? (uint64_t)INT64_MAX + 1 : (uint64_t)INT64_MAX;\n"
+    "    uint64_t n = 0;\n"
+    "\n"
+    "    while (c >= '0' && c <= '9') {\n"
+    "        const uint64_t digit = c - '0';\n"
+    "\n"
+    "        if (n > (limit - digit) / 10)\n"
+    "            die(\"integer input out of range\");\n"
+    "\n"
+    "        n = n * 10 + digit;\n"
+    "        c = next_char();\n"
+    "    }\n"
+    "\n"
+    "    skip_line(c);\n"
+    "    return negative ? (int64_t)-n : (int64_t)n;\n"
+    "}\n"
+    "\n"
+    "static void read_string(int64_t *data, int64_t address) {\n"
+    "    flush_output();\n"
+    "    size_t len = 0;\n"
+    "    int c = next_char();\n"
+    "\n"
+    "    while (c != '\\n' && c != EOF) {\n"
+    "        if (len < 126)\n"
+    "            data[address + len++] = (char)c;\n"
+    "\n"
+    "        c = next_char();\n"
+    "    }\n"
+    "\n"
+    "    data[address + len] = '\\0';\n"
+    "}\n"
+    "\n";
+
+// Printing strings and blocks of memory, after the prelude since
+// they need die() and print_char().
+static const char *block_routines =
+    "static void print_string(const int64_t *data, int64_t address, int64_t length) {\n"
+    "    if (length <= 0)\n"
+    "        return;\n"
+    "\n"
+    "    if (address < 0 || (uint64_t)address > MEMORY_CAP || (uint64_t)length > MEMORY_CAP - address)\n"
+    "        die(\"string out of bounds\");\n"
+    "\n"
+    "    for (int64_t i = 0; i < length; i++)\n"
+    "        print_char((char)data[address + i]);\n"
+    "}\n"
+    "\n"
+    "static void print_terminated(const int64_t *data, int64_t address) {\n"
+    "    if (address < 0 || (uint64_t)address >= MEMORY_CAP)\n"
+    "        die(\"string out of bounds\");\n"
+    "\n"
+    "    for (uint64_t i = address; i < MEMORY_CAP && data[i] != 0; i++)\n"
+    "        print_char((char)data[i]);\n"
+    "}\n"
+    "\n"
+    "static bool check_block(int64_t address, int64_t count) {\n"
+    "    if (count <= 0)\n"
+    "        return false;\n"
+    "\n"
+    "    if (address < 0 || (uint64_t)address > MEMORY_CAP || (uint64_t)count > MEMORY_CAP - address)\n"
+    "        die(\"block out of bounds\");\n"
+    "\n"
+    "    return true;\n"
+    "}\n"
+    "\n"
+    "static void copy_block(int64_t *data, int64_t dst, int64_t src, int64_t count) {\n"
+    "    if (check_block(dst, count) && check_block(src, count))\n"
+    "        memmove(data + dst, data + src, count * sizeof(int64_t));\n"
+    "}\n"
+    "\n"
+    "static void fill_block(int64_t *data, int64_t dst, int64_t value, int64_t count) {\n"
+    "    if (check_block(dst, count)) {\n"
+    "        for (int64_t i = 0; i < count; i++)\n"
+    "            data[dst + i] = value;\n"
+    "    }\n"
+    "}\n"
+    "\n"
+    "static int64_t compare_blocks(const int64_t *data, int64_t a, int64_t b, int64_t count) {\n"
+    "    if (!check_block(a, count) || !check_block(b, count))\n"
+    "        return 0;\n"
+    "\n"
+    "    for (int64_t i = 0; i < count; i++) {\n"
+    "        if (data[a + i] != data[b + i])\n"
+    "            return data[a + i] > data[b + i] ? 1 : -1;\n"
+    "    }\n"
+    "\n"
+    "    return 0;\n"
+    "}\n";
+
+// What each instruction does, written in the generated C with:
+//   $O  the operand
+//   $M  the memory slot the operand points to, only
+//       assigned to by instructions that mark_stores() knows
+//   $S  the top of the stack
+//   $J  a jump to the operand
+//   $F  setting the flags from the accumulator
+//   $V  the stack overflow check
+//   $U  the stack underflow check
+// These mirror opcodes.def, which is the reference.
+static const char *templates[OPCODE_COUNT] = {
+    [NOP] = "",
+    [DAT] = "",
+    [HLT] = "flush_output(); return EXIT_SUCCESS;",
+    [LDI] = "acc = $O;",
+    [LDM] = "acc = $M;",
+    [LDAS] = "acc = $S;",
+    [STM] = "$M = acc;",
+    [STAS] = "$S = acc;",
+    [PRCI] = "print_char((char)$O);",
+    [PRCM] = "print_char((char)$M);",
+    [PRCA] = "print_char((char)acc);",
+    [PRCS] = "print_char((char)$S);",
+    [PRII] = "print_int((int64_t)$O);",
+    [PRIM] = "print_int((int64_t)$M);",
+    [PRIA] = "print_int(acc);",
+    [PRIS] = "print_int($S);",
+    [ADDI] = "acc += $O;",
+    [ADDM] = "acc += $M;",
+    [ADDS] = "acc += $S;",
+    [SUBI] = "acc -= $O;",
+    [SUBM] = "acc -= $M;",
+    [SUBS] = "acc -= $S;",
+    [MULI] = "acc *= $O;",
+    [MULM] = "acc *= $M;",
+    [MULS] = "acc *= $S;",
+    [DIVI] = "acc /= $O;",
+    [DIVM] = "acc /= $M;",
+    [DIVS] = "acc /= $S;",
+    [MODI] = "acc %= $O;",
+    [MODM] = "acc %= $M;",
+    [MODS] = "acc %= $S;",
+    [SHLI] = "acc <<= $O;",
+    [SHLM] = "acc <<= $M;",
+    [SHLS] = "acc <<= $S;",
+    [SHRI] = "acc >>= $O;",
+    [SHRM] = "acc >>= $M;",
+    [SHRS] = "acc >>= $S;",
+    [ANDI] = "acc &= $O;",
+    [ANDM] = "acc &= $M;",
+    [ANDS] = "acc &= $S;",
+    [ORI] = "acc |= $O;",
+    [ORM] = "acc |= $M;",
+    [ORS] = "acc |= $S;",
+    [XORI] = "acc ^= $O;",
+    [XORM] = "acc ^= $M;",
+    [XORS] = "acc ^= $S;",
+    [NOT] = "acc = !acc;",
+    [NOTM] = "$M = !$M;",
+    [NOTS] = "$S = !$S;",
+    [NEG] = "acc = -acc;",
+    [NEGM] = "$M = -$M;",
+    [NEGS] = "$S = -$S;",
+    [BRA] = "$J",
+    [CSR] = "$J",
+    [BRAA] = "pc = acc; goto dispatch;",
+    [BRZ] = "if (acc == 0) $J",
+    [BRP] = "if (acc >= 0) $J",
+    [BRN] = "if (acc < 0) $J",
+    [RDCA] = "acc = read_char();",
+    [RDCM] = "$M = read_char();",
+    [RDCS] = "$S = read_char();",
+    [RDIA] = "acc = read_int();",
+    [RDIM] = "$M = read_int();",
+    [RDIS] = "$S = read_int();",
+    [REFM] = "acc = $O;",
+    [REFS] = "acc = $S;",
+    [LDDA] = "acc = data[acc];",
+    [LDDM] = "acc = data[$M];",
+    [LDDS] = "acc = stack[$S];",
+    [STDM] = "data[$M] = acc;",
+    [STDS] = "stack[$S] = acc;",
+    [CMPI] = "acc = llabs(acc) - llabs($O); $F",
+    [CMPM] = "acc = llabs(acc) - llabs($M); $F",
+    [CMPS] = "acc = llabs(acc) - llabs($S); $F",
+    [BEQ] = "if (zf) $J",
+    [BNE] = "if (!zf) $J",
+    [BLT] = "if (nf) $J",
+    [BLE] = "if (nf || zf) $J",
+    [BGT] = "if (cf) $J",
+    [BGE] = "if (cf || zf) $J",
+    [INCA] = "acc++;",
+    [INCM] = "$M = $M + 1;",
+    [INCS] = "$S += 1;",
+    [DECA] = "acc--;",
+    [DECM] = "$M = $M - 1;",
+    [DECS] = "$S -= 1;",
+    [PSHA] = "$V stack[sp++] = acc;",
+    [PSHI] = "$V stack[sp++] = $O;",
+    [PSHM] = "$V stack[sp++] = $M;",
+    [PSHS] = "$V stack[sp] = $S; sp++;",
+    [POPA] = "$U acc = stack[--sp];",
+    [POPM] = "$U $M = stack[--sp];",
+    [DRP] = "sp--;",
+    [SWPM] = "{ const int64_t temp = acc; acc = $M; $M = temp; }",
+    [SWPS] = "{ const int64_t temp = acc; acc = $S; $S = temp; }",
+    [SEZA] = "acc = zf ? 1 : 0;",
+    [SEZM] = "$M = zf ? 1 : 0;",
+    [SEZS] = "$S = zf ? 1 : 0;",
+    [SEQA] = "acc = zf ? 1 : 0;",
+    [SEQM] = "$M = zf ? 1 : 0;",
+    [SEQS] = "$S = zf ? 1 : 0;",
+    [SNEA] = "acc = zf ? 0 : 1;",
+    [SNEM] = "$M = zf ? 0 : 1;",
+    [SNES] = "$S = zf ? 0 : 1;",
+    [SEPA] = "acc = cf ? 1 : 0;",
+    [SEPM] = "$M = cf ? 1 : 0;",
+    [SEPS] = "$S = cf ? 1 : 0;",
+    [SLTA] = "acc = cf ? 1 : 0;",
+    [SLTM] = "$M = cf ? 1 : 0;",
+    [SLTS] = "$S = cf ? 1 : 0;",
+    [SENA] = "acc = nf ? 1 : 0;",
+    [SENM] = "$M = nf ? 1 : 0;",
+    [SENS] = "$S = nf ? 1 : 0;",
+    [SGTA] = "acc = nf ? 1 : 0;",
+    [SGTM] = "$M = nf ? 1 : 0;",
+    [SGTS] = "$S = nf ? 1 : 0;",
+    [SLEA] = "acc = cf || zf ? 1 : 0;",
+    [SLEM] = "$M = cf || zf ? 1 : 0;",
+    [SLES] = "$S = cf || zf ? 1 : 0;",
+    [SGEA] = "acc = nf || zf ? 1 : 0;",
+    [SGEM] = "$M = nf || zf ? 1 : 0;",
+    [SGES] = "$S = nf || zf ? 1 : 0;",
+    [IPS] = "read_string(data, $O);",
+    [PRSI] = "print_string(data, acc, $O);",
+    [PRSM] = "print_string(data, acc, $M);",
+    [PRSA] = "print_terminated(data, acc);",
+    [CPYI] = "copy_block(data, acc, $S, $O);",
+    [CPYM] = "copy_block(data, acc, $S, $M);",
+    [FILI] = "fill_block(data, acc, $S, $O);",
+    [FILM] = "fill_block(data, acc, $S, $M);",
+    [CMBI] = "acc = compare_blocks(data, acc, $S, $O); $F",
+    [CMBM] = "acc = compare_blocks(data, acc, $S, $M); $F"
+};
+
+// The most memory and stack, in bytes, that are
+// put in static arrays.
+#define MAX_STATIC ((size_t)256 << 20)
+
+typedef struct {
+    FILE *out;
+    Root *root;
+    size_t memory_cap;
+    size_t stack_cap;
+
+    // Operands that can change at runtime, everything
+    // else is written into the code as a constant.
+    bool *dynamic;
+
+    // How many slots are marked dynamic.
+    size_t marked;
+
+    // Set when there are stores through pointers, which
+    // could change any of them.
+    bool pointers;
+
+    // Whether anything jumps to a computed address.
+    bool dispatch;
+} Aot;
+
+// Mark the slots that the op at address stores into when they're
+// known up front, returns false if they can't be.
+static bool mark_stores(Aot *aot, size_t address) {
+    const Op op = aot->root->ops[address];
+    i64 length = 1;
+
+    switch (op.opcode) {
+        case STM:
+        case NOTM:
+        case NEGM:
+        case RDCM:
+        case RDIM:
+        case INCM:
+        case DECM:
+        case POPM:
+        case SWPM:
+        case SEZM:
+        case SEPM:
+        case SENM:
+        case SEQM:
+        case SNEM:
+        case SLTM:
+        case SLEM:
+        case SGTM:
+        case SGEM:
+            break;
+        case IPS:
+            length = 128;
+            break;
+        case STDM:
+        case CPYI:
+        case CPYM:
+        case FILI:
+        case FILM:
+            return false;
+        default:
+            return true;
+    }
+
+    // An operand that can change makes it a store through a pointer.
+    if (aot->dynamic[address])
+        return false;
+
+    for (i64 i = op.operand; i < op.operand + length; i++) {
+        if (i >= 0 && (u64)i < aot->memory_cap && !aot->dynamic[i]) {
+            aot->dynamic[i] = true;
+            aot->marked++;
+        }
+    }
+
+    return true;
+}
+
+static bool is_dynamic(Aot *aot, size_t slot) {
+    return aot->pointers || aot->dynamic[slot];
+}
+
+static void emit_constant(Aot *aot, i64 value) {
+    if (value == INT64_MIN)
+        fputs("INT64_MIN", aot->out);
+    else if (value < 0)
+        fprintf(aot->out, "(%" PRId64 ")", value);
+    else
+        fprintf(aot->out, "%" PRId64, value);
+}
+
+static void emit_operand(Aot *aot, size_t address) {
+    if (is_dynamic(aot, address))
+        fprintf(aot->out, "data[%zu]", address);
+    else
+        emit_constant(aot, aot->root->ops[address].operand);
+}
+
+// Slots that are never stored to hold their initial value for the
+// whole run, past the program that's zero.
+static void emit_memory(Aot *aot, size_t address) {
+    const i64 slot = aot->root->ops[address].operand;
+
+    if (!is_dynamic(aot, address) && slot >= 0 && (u64)slot < aot->memory_cap && !is_dynamic(aot, slot)) {
+        emit_constant(aot, (u64)slot < aot->root->op_count ? aot->root->ops[slot].operand : 0);
+        return;
+    }
+
+    fputs("data[", aot->out);
+    emit_operand(aot, address);
+    fputc(']', aot->out);
+}
+
+static void emit_jump(Aot *aot, size_t address) {
+    const i64 target = aot->root->ops[address].operand;
+
+    if (is_dynamic(aot, address)) {
+        fprintf(aot->out, "{ pc = data[%zu]; goto dispatch; }", address);
+        aot->dispatch = true;
+    } else if (target >= 0 && (u64)target < aot->root->op_count)
+        fprintf(aot->out, "goto i%" PRId64 ";", target);
+    else {
+        // Past the program there's nothing but NOPs.
+        fputs("goto end;", aot->out);
+    }
+}
+
+static void emit_instruction(Aot *aot, size_t address) {
+    const Opcode opcode = aot->root->ops[address].opcode;
+    FILE *out = aot->out;
+
+    fprintf(out, "i%zu:;\n", address);
+
+    if ((size_t)opcode >= OPCODE_COUNT) {
+        fprintf(out, "    undefined_instruction(%" PRIu64 ");\n", (u64)opcode);
+        return;
+    }
+
+    const char *template = templates[opcode];
+
+    if (template[0] == '\0')
+        return;
+
+    fputs("    ", out);
+
+    for (const char *c = template; *c != '\0'; c++) {
+        if (*c != '$') {
+            fputc(*c, out);
+            continue;
+        }
+
+        switch (*++c) {
+            case 'O':
+                emit_operand(aot, address);
+                break;
+            case 'M':
+                emit_memory(aot, address);
+                break;
+            case 'S':
+                fputs("stack[sp == 0 ? 0 : sp - 1]", out);
+                break;
+            case 'J':
+                emit_jump(aot, address);
+                break;
+            case 'F':
+                fputs("cf = acc > 0; zf = acc == 0; nf = acc < 0;", out);
+                break;
+            case 'V':
+                fputs("if (sp == STACK_CAP) die(\"stack overflow\");", out);
+                break;
+            case 'U':
+                fputs("if (sp == 0) die(\"stack underflow\");", out);
+                break;
+        }
+    }
+
+    fputc('\n', out);
+
+    if (opcode == BRAA)
+        aot->dispatch = true;
+}
+
+static void emit_program(Aot *aot) {
+    Root *root = aot->root;
+    FILE *out = aot->out;
+
+    // Big arrays don't fit in the small code model, those
+    // get allocated when the program starts instead.
+    const bool heap = (aot->memory_cap + aot->stack_cap) * sizeof(i64) > MAX_STATIC;
+
+    fprintf(out, prelude, aot->memory_cap, aot->stack_cap, DEFAULT_OUTPUT_CAP);
+    fputs(block_routines, out);
+
+    if (heap)
+        fputs("static int64_t *stack;\n"
+              "static int64_t *data;\n"
+              "static const int64_t program[] = {", out);
+    else
+        fputs("static int64_t stack[STACK_CAP];\n"
+              "static int64_t data[MEMORY_CAP] = {", out);
+
+    for (size_t i = 0; i < root->op_count; i++) {
+        fputs(i % 8 == 0 ? "\n    " : " ", out);
+        emit_constant(aot, root->ops[i].operand);
+        fputc(',', out);
+    }
+
+    fputs("\n};\n"
+          "\n"
+          "int main(void) {\n"
+          "    int64_t acc = 0;\n"
+          "    int64_t sp = 0;\n"
+          "    int64_t pc = 0;\n"
+          "    bool cf = false;\n"
+          "    bool zf = false;\n"
+          "    bool nf = false;\n"
+          "    (void)pc;\n"
+          "\n"
+          "    output_line = isatty(STDOUT_FILENO);\n"
+          "\n", out);
+
+    if (heap)
+        fputs("    data = calloc(MEMORY_CAP, sizeof(int64_t));\n"
+              "    stack = calloc(STACK_CAP, sizeof(int64_t));\n"
+              "\n"
+              "    if (data == NULL || stack == NULL)\n"
+              "        die(\"failed to allocate memory\");\n"
+              "\n"
+              "    memcpy(data, program, sizeof(program));\n"
+              "\n", out);
+
+    for (size_t i = 0; i < root->op_count; i++)
+        emit_instruction(aot, i);
+
+    fputs("end:\n"
+          "    die(\"reached end of memory\");\n", out);
+
+    if (aot->dispatch) {
+        fputs("dispatch:;\n"
+              "    static void *const labels[] = {", out);
+
+        for (size_t i = 0; i < root->op_count; i++)
+            fprintf(out, "%s&&i%zu,", i % 8 == 0 ? "\n        " : " ", i);
+
+        fprintf(out, "\n    };\n"
+                     "\n"
+                     "    if ((uint64_t)pc >= %zu)\n"
+                     "        goto end;\n"
+                     "\n"
+                     "    goto *labels[pc];\n", root->op_count);
+    }
+
+    fputs("}\n", out);
+}
+
+static bool ends_with(const char *str, const char *suffix) {
+    const size_t len = strlen(str);
+    const size_t suffix_len = strlen(suffix);
+    return len >= suffix_len && strcmp(str + len - suffix_len, suffix) == 0;
+}
+
+// Single quote str for the shell.
+static char *quote(const char *str) {
+    char *quoted = malloc(strlen(str) * 4 + 3);
+    char *c = quoted;
+    *c++ = '\'';
+
+    for (; *str != '\0'; str++) {
+        if (*str == '\'') {
+            strcpy(c, "'\\''");
+            c += 4;
+        } else
+            *c++ = *str;
+    }
+
+    *c++ = '\'';
+    *c = '\0';
+    return quoted;
+}
+
+// Feed the generated code to the C compiler through a pipe.
+static int compile_program(Aot *aot, char *outfile) {
+    const char *cc = getenv("CC");
+
+    if (cc == NULL || cc[0] == '\0')
+        cc = "cc";
+
+    // Warnings would be about the program, not the generated code.
+    char *quoted = quote(outfile);
+    char *command = malloc(strlen(cc) + strlen(quoted) + 32);
+    sprintf(command, "%s -O2 -w -x c -o %s -", cc, quoted);
+    free(quoted);
+
+    aot->out = popen(command, "w");
+    free(command);
+
+    if (aot->out == NULL) {
+        fprintf(stderr, "error: failed to run C compiler '%s'\n", cc);
+        return EXIT_FAILURE;
+    }
+
+    emit_program(aot);
+
+    if (pclose(aot->out) != 0) {
+        fprintf(stderr, "error: failed to compile '%s'\n", outfile);
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+// Sizes given on the command line win over the program's.
+int compile_aot(char *infile, char *outfile, size_t memory_cap, size_t stack_cap) {
+    Root root = parse_root(infile, stderr);
+
+    if (memory_cap == 0)
+        memory_cap = root.memory_cap != 0 ? root.memory_cap : DEFAULT_MEMORY_CAP;
+
+    if (stack_cap == 0)
+        stack_cap = root.stack_cap != 0 ? root.stack_cap : DEFAULT_STACK_CAP;
+
+    if (root.errors > 0) {
+        delete_root(&root);
+        return EXIT_FAILURE;
+    } else if (root.op_count > memory_cap) {
+        fprintf(stderr, "error: program exceeds the memory capacity of %zu\n", memory_cap);
+        delete_root(&root);
+        return EXIT_FAILURE;
+    }
+
+    Aot aot = {
+        .out = NULL,
+        .root = &root,
+        .memory_cap = memory_cap,
+        .stack_cap = stack_cap,
+        .dynamic = calloc(memory_cap, sizeof(bool)),
+        .marked = 0,
+        .pointers = false,
+        .dispatch = false
+    };
+
+    // Marking a store's own operand can turn it into a store through
+    // a pointer, so go round until nothing new is marked.
+    size_t marked;
+
+    do {
+        marked = aot.marked;
+
+        for (size_t i = 0; i < root.op_count && !aot.pointers; i++)
+            aot.pointers = !mark_stores(&aot, i);
+    } while (!aot.pointers && aot.marked != marked);
+
+    int status = EXIT_SUCCESS;
+
+    // Keep the C around instead if that's what was asked for.
+    if (ends_with(outfile, ".c")) {
+        aot.out = fopen(outfile, "w");
+
+        if (aot.out == NULL) {
+            fprintf(stderr, "error: failed to write to file '%s'\n", outfile);
+            status = EXIT_FAILURE;
+        } else {
+            emit_program(&aot);
+            fclose(aot.out);
+        }
+    } else
+        status = compile_program(&aot, outfile);
+
+    free(aot.dynamic);
+    delete_root(&root);
+    return status;
+}
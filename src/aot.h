@@ -0,0 +1,8 @@
+#ifndef AOT_H
+#define AOT_H
+
+#include <stddef.h>
+
+int compile_aot(char *infile, char *outfile, size_t memory_cap, size_t stack_cap);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,106 @@
+#include "arena.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdalign.h>
+
+#define ARENA_BLOCK_SIZE ((size_t)64 << 10)
+
+// Anything bigger than this gets a block of its own.
+#define BIG_ALLOCATION (ARENA_BLOCK_SIZE / 4)
+
+#define ALIGN(size) (((size) + alignof(max_align_t) - 1) & ~(alignof(max_align_t) - 1))
+
+struct ArenaBlock {
+    ArenaBlock *next;
+    size_t cap;
+    size_t used;
+    alignas(max_align_t) unsigned char data[];
+};
+
+static ArenaBlock *create_block(size_t cap) {
+    ArenaBlock *block = malloc(sizeof(ArenaBlock) + cap);
+    block->next = NULL;
+    block->cap = cap;
+    block->used = 0;
+    return block;
+}
+
+Arena *create_arena() {
+    Arena *arena = malloc(sizeof(Arena));
+    arena->block = NULL;
+    arena->big = NULL;
+    arena->last = NULL;
+    return arena;
+}
+
+void *arena_alloc(Arena *arena, size_t size) {
+    size = ALIGN(size);
+
+    if (size > BIG_ALLOCATION) {
+        ArenaBlock *big = create_block(size);
+        big->used = size;
+        big->next = arena->big;
+        arena->big = big;
+        return big->data;
+    }
+
+    if (arena->block == NULL || arena->block->used + size > arena->block->cap) {
+        ArenaBlock *block = create_block(ARENA_BLOCK_SIZE);
+        block->next = arena->block;
+        arena->block = block;
+    }
+
+    void *ptr = arena->block->data + arena->block->used;
+    arena->block->used += size;
+    arena->last = ptr;
+    return ptr;
+}
+
+// Like realloc(), except it doesn't free what it copied from.
+void *arena_grow(Arena *arena, void *ptr, size_t old_size, size_t new_size) {
+    if (ptr == NULL)
+        return arena_alloc(arena, new_size);
+
+    if (ptr == arena->last && new_size <= BIG_ALLOCATION) {
+        ArenaBlock *block = arena->block;
+        const size_t offset = (unsigned char *)ptr - block->data;
+
+        if (offset + ALIGN(new_size) <= block->cap) {
+            block->used = offset + ALIGN(new_size);
+            return ptr;
+        }
+    }
+
+    if (ALIGN(old_size) > BIG_ALLOCATION) {
+        for (ArenaBlock **link = &arena->big; *link != NULL; link = &(*link)->next) {
+            if ((*link)->data != ptr)
+                continue;
+
+            *link = realloc(*link, sizeof(ArenaBlock) + ALIGN(new_size));
+            (*link)->cap = (*link)->used = ALIGN(new_size);
+            return (*link)->data;
+        }
+    }
+
+    void *grown = arena_alloc(arena, new_size);
+    memcpy(grown, ptr, old_size);
+    return grown;
+}
+
+static void delete_blocks(ArenaBlock *block) {
+    while (block != NULL) {
+        ArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+}
+
+void delete_arena(Arena *arena) {
+    if (arena == NULL)
+        return;
+
+    delete_blocks(arena->block);
+    delete_blocks(arena->big);
+    free(arena);
+}
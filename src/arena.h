@@ -0,0 +1,26 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+// Everything one assembly allocates, bumped out of big blocks
+// and all freed together at the end.
+typedef struct ArenaBlock ArenaBlock;
+
+typedef struct {
+    ArenaBlock *block;
+
+    // Allocations too big to share a block get one each, so
+    // they can be grown with realloc() instead of copied.
+    ArenaBlock *big;
+
+    // The latest allocation from block, which can grow in place.
+    void *last;
+} Arena;
+
+Arena *create_arena();
+void *arena_alloc(Arena *arena, size_t size);
+void *arena_grow(Arena *arena, void *ptr, size_t old_size, size_t new_size);
+void delete_arena(Arena *arena);
+
+#endif
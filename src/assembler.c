@@ -1,59 +1,316 @@
+// Needed for open_memstream(), sysconf(), clock_gettime() and open() with -std=c11.
+#define _DEFAULT_SOURCE
+
 #include "assembler.h"
 #include "parser.h"
+#include "bytecode.h"
+#include "output.h"
 #include "utils.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
-#include <inttypes.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+static void write_text(Output *out, const Root *root, bool linebreak_after_ops, bool as_decimal) {
+    // The header is always decimal so it can't be mistaken for code.
+    if (root->memory_cap != 0) {
+        output_string(out, ".memory ", 8);
+        output_int(out, root->memory_cap);
+        output_char(out, '\n');
+    }
+
+    if (root->stack_cap != 0) {
+        output_string(out, ".stack ", 7);
+        output_int(out, root->stack_cap);
+        output_char(out, '\n');
+    }
+
+    const char separator = linebreak_after_ops ? '\n' : ' ';
+
+    for (size_t i = 0; i < root->op_count; i++) {
+        if (i > 0)
+            output_char(out, separator);
+
+        if (as_decimal) {
+            output_int(out, root->ops[i].opcode);
+            output_char(out, ' ');
+            output_int(out, root->ops[i].operand);
+        } else {
+            output_bin(out, root->ops[i].opcode);
+            output_char(out, ' ');
+            output_bin(out, root->ops[i].operand);
+        }
+    }
+}
 
-int assemble(char *infile, char *outfile, bool linebreak_after_ops, bool as_decimal) {
-    Root root = parse_root(infile);
+// Errors go to diag, ops is set to how many were assembled.
+static int assemble_file(char *infile, char *outfile, bool linebreak_after_ops, bool as_decimal, Format format, FILE *diag, size_t *ops) {
+    Root root = parse_root(infile, diag);
+    *ops = root.op_count;
 
-    if (error_count() > 0) {
+    if (root.errors > 0) {
         delete_root(&root);
         return EXIT_FAILURE;
     }
 
-    FILE *f = fopen(outfile, "w");
+    const int fd = open(outfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
 
-    if (f == NULL) {
-        fprintf(stderr, "error: failed to write to file '%s'\n", outfile);
+    if (fd < 0) {
+        fprintf(diag, "error: failed to write to file '%s'\n", outfile);
         delete_root(&root);
         return EXIT_FAILURE;
     }
 
-    char buffer[131];
-    char *code = malloc(root.op_count * 128 + 1);
-    code[0] = '\0';
+    // Streamed out a buffer at a time, so it never has to hold
+    // the whole program as text.
+    Output out = { .cap = 0 };
+    open_output(&out, fd);
 
-    char opcode_binary[65];
-    char operand_binary[65];
+    if (format != FORMAT_TEXT)
+        write_bytecode(&out, &root, format == FORMAT_IMAGE);
+    else
+        write_text(&out, &root, linebreak_after_ops, as_decimal);
 
-    for (size_t i = 0; i < root.op_count; i++) {
-        if (as_decimal)
-            sprintf(buffer, "%u %" PRId64, root.ops[i].opcode, root.ops[i].operand);
-        else {
-            int_to_bin(root.ops[i].opcode, opcode_binary);
-            int_to_bin(root.ops[i].operand, operand_binary);
-            sprintf(buffer, "%s %s", opcode_binary, operand_binary);
-        }
+    delete_root(&root);
+
+    const bool written = close_output(&out);
+
+    if (close(fd) != 0 || !written) {
+        fprintf(diag, "error: failed to write to file '%s'\n", outfile);
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+int assemble(char *infile, char *outfile, bool linebreak_after_ops, bool as_decimal, Format format) {
+    size_t ops;
+    return assemble_file(infile, outfile, linebreak_after_ops, as_decimal, format, stderr, &ops);
+}
+
+typedef struct {
+    char *infile;
+    char *outfile;
+
+    // Which directory the output goes in and its name there, so
+    // two spellings of the same path are seen to be the same.
+    dev_t dir_dev;
+    ino_t dir_ino;
+    const char *name;
+
+    // What it reported, printed once everything's done so the
+    // errors come out in the order the files were given in.
+    char *diag;
+    size_t diag_len;
+
+    size_t ops;
+    int status;
+} Job;
+
+typedef struct {
+    Job *jobs;
+    size_t count;
+    atomic_size_t next;
+    bool linebreak_after_ops;
+    bool as_decimal;
+    Format format;
+} Batch;
+
+static void *assemble_jobs(void *arg) {
+    Batch *batch = arg;
+    size_t i;
+
+    while ((i = atomic_fetch_add(&batch->next, 1)) < batch->count) {
+        Job *job = &batch->jobs[i];
+        FILE *diag = open_memstream(&job->diag, &job->diag_len);
+
+        job->status = assemble_file(job->infile, job->outfile, batch->linebreak_after_ops, batch->as_decimal, batch->format, diag, &job->ops);
+        fclose(diag);
+    }
+
+    return NULL;
+}
+
+// a.min becomes a.out, in dir if it's given.
+static char *output_path(char *infile, char *dir) {
+    char *base = strrchr(infile, '/');
+    base = dir != NULL && base != NULL ? base + 1 : infile;
+
+    char *ext = strrchr(base, '.');
+    const size_t stem_len = ext != NULL && strcmp(ext, ".min") == 0 ? (size_t)(ext - base) : strlen(base);
+    const size_t dir_len = dir != NULL ? strlen(dir) + 1 : 0;
+
+    char *path = malloc(dir_len + stem_len + 5);
+
+    if (dir != NULL)
+        sprintf(path, "%s/", dir);
+
+    memcpy(path + dir_len, base, stem_len);
+    strcpy(path + dir_len + stem_len, ".out");
+    return path;
+}
+
+// A directory that isn't there gets the whole path as the name,
+// it'll fail to open anyway.
+static void locate_output(Job *job) {
+    char *slash = strrchr(job->outfile, '/');
+    struct stat st;
+    bool found;
+
+    if (slash == NULL)
+        found = stat(".", &st) == 0;
+    else {
+        *slash = '\0';
+        found = stat(slash == job->outfile ? "/" : job->outfile, &st) == 0;
+        *slash = '/';
+    }
+
+    job->dir_dev = found ? st.st_dev : 0;
+    job->dir_ino = found ? st.st_ino : 0;
+    job->name = found && slash != NULL ? slash + 1 : job->outfile;
+}
 
-        strcat(code, buffer);
+static int compare_outputs(const void *a, const void *b) {
+    const Job *x = *(const Job *const *)a;
+    const Job *y = *(const Job *const *)b;
 
-        if (linebreak_after_ops)
-            strcat(code, "\n");
+    if (x->dir_dev != y->dir_dev)
+        return x->dir_dev < y->dir_dev ? -1 : 1;
+    else if (x->dir_ino != y->dir_ino)
+        return x->dir_ino < y->dir_ino ? -1 : 1;
+
+    const int order = strcmp(x->name, y->name);
+
+    // Jobs are in the order the files were given.
+    return order != 0 ? order : (x > y) - (x < y);
+}
+
+static bool same_file(const char *a, const char *b) {
+    struct stat x, y;
+
+    if (stat(a, &x) != 0 || stat(b, &y) != 0)
+        return strcmp(a, b) == 0;
+
+    return x.st_dev == y.st_dev && x.st_ino == y.st_ino;
+}
+
+// Files that would be assembled to the same output would overwrite
+// each other, at the same time on different threads, so it's an
+// error before anything's started. Returns how many there were.
+static size_t check_outputs(Job *jobs, size_t count) {
+    Job **sorted = malloc(count * sizeof(Job *));
+    const Job **first = malloc(count * sizeof(Job *));
+    size_t duplicates = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        locate_output(&jobs[i]);
+        sorted[i] = &jobs[i];
+        first[i] = NULL;
+    }
+
+    qsort(sorted, count, sizeof(Job *), compare_outputs);
+
+    for (size_t i = 1; i < count; i++) {
+        const Job *job = sorted[i];
+        const Job *last = sorted[i - 1];
+
+        if (job->dir_dev == last->dir_dev && job->dir_ino == last->dir_ino && strcmp(job->name, last->name) == 0)
+            first[job - jobs] = first[last - jobs] != NULL ? first[last - jobs] : last;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        if (first[i] == NULL)
+            continue;
+        else if (same_file(jobs[i].infile, first[i]->infile))
+            fprintf(stderr, "%s: error: file given more than once\n", jobs[i].infile);
         else
-            strcat(code, " ");
+            fprintf(stderr, "%s: error: output file '%s' is also the output of '%s'\n", jobs[i].infile, jobs[i].outfile, first[i]->infile);
+
+        duplicates++;
     }
 
-    if (code[0] != '\0')
-        code[strlen(code) - 1] = '\0'; // Remove the last space or line break.
+    free(sorted);
+    free(first);
+    return duplicates;
+}
 
-    delete_root(&root);
+int assemble_all(char **infiles, size_t count, char *dir, size_t threads, bool linebreak_after_ops, bool as_decimal, Format format) {
+    Batch batch = {
+        .jobs = calloc(count, sizeof(Job)),
+        .count = count,
+        .linebreak_after_ops = linebreak_after_ops,
+        .as_decimal = as_decimal,
+        .format = format
+    };
 
-    fputs(code, f);
-    fclose(f);
-    free(code);
-    return EXIT_SUCCESS;
-}
\ No newline at end of file
+    atomic_init(&batch.next, 0);
+
+    for (size_t i = 0; i < count; i++) {
+        batch.jobs[i].infile = infiles[i];
+        batch.jobs[i].outfile = output_path(infiles[i], dir);
+    }
+
+    if (check_outputs(batch.jobs, count) > 0) {
+        for (size_t i = 0; i < count; i++)
+            free(batch.jobs[i].outfile);
+
+        free(batch.jobs);
+        return EXIT_FAILURE;
+    }
+
+    if (threads == 0) {
+        const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (size_t)cpus : 1;
+    }
+
+    if (threads > count)
+        threads = count;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // This thread is one of the workers.
+    pthread_t *workers = malloc(threads * sizeof(pthread_t));
+    size_t started = 0;
+
+    while (started < threads - 1 && pthread_create(&workers[started], NULL, assemble_jobs, &batch) == 0)
+        started++;
+
+    assemble_jobs(&batch);
+
+    for (size_t i = 0; i < started; i++)
+        pthread_join(workers[i], NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    free(workers);
+
+    size_t failed = 0;
+    size_t ops = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        Job *job = &batch.jobs[i];
+        fwrite(job->diag, 1, job->diag_len, stderr);
+
+        if (job->status != EXIT_SUCCESS)
+            failed++;
+
+        ops += job->ops;
+        free(job->diag);
+        free(job->outfile);
+    }
+
+    free(batch.jobs);
+
+    const double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(stderr, "assembled %zu of %zu files, %zu ops, on %zu thread%s in %.3fs (%.0f files/s)\n",
+            count - failed, count, ops, started + 1, started > 0 ? "s" : "", seconds, seconds > 0 ? count / seconds : 0.0);
+
+    return failed > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -2,7 +2,17 @@
 #define ASSEMBLER_H
 
 #include <stdbool.h>
+#include <stddef.h>
 
-int assemble(char *infile, char *outfile, bool linebreak_after_ops, bool as_decimal);
+// What machine code is written as: text, bytecode, or bytecode
+// laid out as an image that can be mapped straight into memory.
+typedef enum {
+    FORMAT_TEXT,
+    FORMAT_BYTECODE,
+    FORMAT_IMAGE
+} Format;
+
+int assemble(char *infile, char *outfile, bool linebreak_after_ops, bool as_decimal, Format format);
+int assemble_all(char **infiles, size_t count, char *dir, size_t threads, bool linebreak_after_ops, bool as_decimal, Format format);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,291 @@
+#include "bytecode.h"
+#include <string.h>
+
+static size_t varint_len(u64 n) {
+    size_t len = 1;
+
+    while (n >= 0x80) {
+        n >>= 7;
+        len++;
+    }
+
+    return len;
+}
+
+static u64 zigzag(i64 n) {
+    return ((u64)n << 1) ^ (u64)(n >> 63);
+}
+
+static i64 unzigzag(u64 n) {
+    return (i64)(n >> 1) ^ -(i64)(n & 1);
+}
+
+static void output_varint(Output *out, u64 n) {
+    while (n >= 0x80) {
+        output_char(out, (char)(n | 0x80));
+        n >>= 7;
+    }
+
+    output_char(out, (char)n);
+}
+
+static size_t align_image(size_t n) {
+    return (n + IMAGE_ALIGN - 1) & ~(IMAGE_ALIGN - 1);
+}
+
+static void output_le(Output *out, u64 n, int bytes) {
+    for (int i = 0; i < bytes; i++)
+        output_char(out, (char)(n >> i * 8));
+}
+
+static u64 read_le(const uint8_t *p, int bytes) {
+    u64 n = 0;
+
+    for (int i = 0; i < bytes; i++)
+        n |= (u64)p[i] << i * 8;
+
+    return n;
+}
+
+// False if it runs past end or over 64 bits.
+static bool read_varint(const uint8_t **p, const uint8_t *end, u64 *n) {
+    *n = 0;
+
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (*p == end)
+            return false;
+
+        const uint8_t byte = *(*p)++;
+        *n |= (u64)(byte & 0x7f) << shift;
+
+        if (byte < 0x80)
+            return shift < 63 || byte <= 1;
+    }
+
+    return false;
+}
+
+// The image section is a fixed size, so where the arrays go is
+// known before it's written.
+static void write_image(Output *out, const Root *root) {
+    const size_t end = out->flushed + out->len + varint_len(SECTION_IMAGE) + varint_len(IMAGE_SECTION_SIZE) + IMAGE_SECTION_SIZE + varint_len(SECTION_END);
+    const size_t opcodes_at = align_image(end);
+    const size_t operands_at = opcodes_at + align_image(root->op_count * 4);
+
+    output_varint(out, SECTION_IMAGE);
+    output_varint(out, IMAGE_SECTION_SIZE);
+    output_le(out, root->op_count, 8);
+    output_le(out, opcodes_at, 8);
+    output_le(out, operands_at, 8);
+    output_varint(out, SECTION_END);
+
+    output_fill(out, 0, opcodes_at - end);
+
+    for (size_t i = 0; i < root->op_count; i++)
+        output_le(out, root->ops[i].opcode, 4);
+
+    output_fill(out, 0, operands_at - opcodes_at - root->op_count * 4);
+
+    for (size_t i = 0; i < root->op_count; i++)
+        output_le(out, root->ops[i].operand, 8);
+
+    output_fill(out, 0, align_image(root->op_count * 8) - root->op_count * 8);
+}
+
+// The sizes of the sections come before them, so everything's
+// measured once before it's written.
+void write_bytecode(Output *out, const Root *root, bool image) {
+    size_t code_size = varint_len(root->op_count);
+    size_t data_size = 0;
+    size_t symbols_size = varint_len(root->symbol_count);
+
+    for (size_t i = 0; i < root->op_count; i++) {
+        code_size += varint_len(root->ops[i].opcode);
+        data_size += varint_len(zigzag(root->ops[i].operand));
+    }
+
+    for (size_t i = 0; i < root->symbol_count; i++) {
+        const Symbol *symbol = &root->symbols[i];
+        symbols_size += varint_len(symbol->name_len) + symbol->name_len + varint_len(zigzag(symbol->value));
+    }
+
+    output_string(out, BYTECODE_MAGIC, BYTECODE_MAGIC_LEN);
+    output_varint(out, BYTECODE_VERSION);
+    output_varint(out, root->memory_cap);
+    output_varint(out, root->stack_cap);
+    output_varint(out, 0);
+
+    if (root->symbol_count > 0) {
+        output_varint(out, SECTION_SYMBOLS);
+        output_varint(out, symbols_size);
+        output_varint(out, root->symbol_count);
+
+        for (size_t i = 0; i < root->symbol_count; i++) {
+            const Symbol *symbol = &root->symbols[i];
+            output_varint(out, symbol->name_len);
+            output_string(out, symbol->name, symbol->name_len);
+            output_varint(out, zigzag(symbol->value));
+        }
+    }
+
+    if (image) {
+        write_image(out, root);
+        return;
+    }
+
+    output_varint(out, SECTION_CODE);
+    output_varint(out, code_size);
+    output_varint(out, root->op_count);
+
+    for (size_t i = 0; i < root->op_count; i++)
+        output_varint(out, root->ops[i].opcode);
+
+    output_varint(out, SECTION_DATA);
+    output_varint(out, data_size);
+
+    for (size_t i = 0; i < root->op_count; i++)
+        output_varint(out, zigzag(root->ops[i].operand));
+
+    output_varint(out, SECTION_END);
+}
+
+bool is_bytecode(const void *src, size_t len) {
+    return len >= BYTECODE_MAGIC_LEN && memcmp(src, BYTECODE_MAGIC, BYTECODE_MAGIC_LEN) == 0;
+}
+
+// Reads the header and finds the sections, false if the file's
+// malformed or from a newer version.
+bool open_bytecode(Bytecode *bc, const void *src, size_t len) {
+    if (!is_bytecode(src, len))
+        return false;
+
+    const uint8_t *p = (const uint8_t *)src + BYTECODE_MAGIC_LEN;
+    const uint8_t *const end = (const uint8_t *)src + len;
+    u64 version, memory_cap, stack_cap;
+
+    if (!read_varint(&p, end, &version) || version != BYTECODE_VERSION
+        || !read_varint(&p, end, &memory_cap) || !read_varint(&p, end, &stack_cap)
+        || !read_varint(&p, end, &bc->entry) || memory_cap > MAX_CAP || stack_cap > MAX_CAP)
+        return false;
+
+    bc->memory_cap = memory_cap;
+    bc->stack_cap = stack_cap;
+    bc->op_count = bc->symbol_count = 0;
+    bc->code = bc->code_end = NULL;
+    bc->data = bc->data_end = NULL;
+    bc->symbols = bc->symbols_end = NULL;
+    bc->image = false;
+    bc->opcodes_at = bc->operands_at = 0;
+    bc->base = src;
+    bc->next = 0;
+
+    for (;;) {
+        u64 id, size;
+
+        if (!read_varint(&p, end, &id))
+            return false;
+        else if (id == SECTION_END)
+            break;
+        else if (!read_varint(&p, end, &size) || size > (u64)(end - p))
+            return false;
+
+        const uint8_t *const section_end = p + size;
+
+        switch (id) {
+            case SECTION_CODE:
+                if (!read_varint(&p, section_end, &bc->op_count))
+                    return false;
+
+                bc->code = p;
+                bc->code_end = section_end;
+                break;
+            case SECTION_DATA:
+                bc->data = p;
+                bc->data_end = section_end;
+                break;
+            case SECTION_SYMBOLS:
+                if (!read_varint(&p, section_end, &bc->symbol_count))
+                    return false;
+
+                bc->symbols = p;
+                bc->symbols_end = section_end;
+                break;
+            case SECTION_IMAGE: {
+                if (size != IMAGE_SECTION_SIZE)
+                    return false;
+
+                const u64 op_count = read_le(p, 8);
+                const u64 opcodes_at = read_le(p + 8, 8);
+                const u64 operands_at = read_le(p + 16, 8);
+
+                // Both arrays have to be whole, padding and all.
+                if (op_count > len / 12 || opcodes_at % IMAGE_ALIGN != 0 || operands_at % IMAGE_ALIGN != 0
+                    || opcodes_at > len || operands_at < opcodes_at + align_image(op_count * 4)
+                    || operands_at > len || len - operands_at < align_image(op_count * 8))
+                    return false;
+
+                bc->image = true;
+                bc->op_count = op_count;
+                bc->opcodes_at = opcodes_at;
+                bc->operands_at = operands_at;
+                break;
+            }
+            default:
+                break;
+        }
+
+        p = section_end;
+    }
+
+    // Every opcode takes at least a byte, so a count bigger
+    // than the section is a lie.
+    return bc->image || (bc->code != NULL && bc->data != NULL && bc->op_count <= (u64)(bc->code_end - bc->code));
+}
+
+// The next op, false if there isn't a valid one. Only ever
+// hands out opcodes machine code is allowed to have.
+bool next_op(Bytecode *bc, Opcode *opcode, i64 *operand) {
+    u64 op, arg;
+
+    if (bc->image) {
+        if (bc->next == bc->op_count)
+            return false;
+
+        op = read_le(bc->base + bc->opcodes_at + bc->next * 4, 4);
+        arg = read_le(bc->base + bc->operands_at + bc->next * 8, 8);
+        bc->next++;
+
+        if (op >= OPCODE_COUNT)
+            return false;
+
+        *opcode = (Opcode)op;
+        *operand = (i64)arg;
+        return true;
+    }
+
+    if (!read_varint(&bc->code, bc->code_end, &op) || op >= OPCODE_COUNT
+        || !read_varint(&bc->data, bc->data_end, &arg))
+        return false;
+
+    *opcode = (Opcode)op;
+    *operand = unzigzag(arg);
+    return true;
+}
+
+// The name isn't terminated, it points into the file.
+bool next_symbol(Bytecode *bc, const char **name, size_t *name_len, i64 *value) {
+    u64 len, arg;
+
+    if (!read_varint(&bc->symbols, bc->symbols_end, &len) || len > (u64)(bc->symbols_end - bc->symbols))
+        return false;
+
+    *name = (const char *)bc->symbols;
+    *name_len = len;
+    bc->symbols += len;
+
+    if (!read_varint(&bc->symbols, bc->symbols_end, &arg))
+        return false;
+
+    *value = unzigzag(arg);
+    return true;
+}
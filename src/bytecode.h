@@ -0,0 +1,81 @@
+#ifndef BYTECODE_H
+#define BYTECODE_H
+
+#include "parser.h"
+#include "output.h"
+#include "vm.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Machine code packed into bytes instead of written out as text,
+// numbers as LEB128 varints and operands zigzagged first so small
+// negative ones stay small:
+//   magic    "\x7fMIN"
+//   version  BYTECODE_VERSION
+//   memory   slots, 0 for the default
+//   stack    slots, 0 for the default
+//   entry    address execution starts at
+// Then sections, each an id, its size in bytes and its contents,
+// until an id of 0:
+//   code     the op count, then every opcode
+//   data     every operand, as many as there are opcodes
+//   symbols  the count, then every label's name length, name and
+//            address
+//   image    in place of code and data, the op count and where the
+//            opcodes and operands are in the file, as 8 byte little
+//            endian numbers
+// Sections a reader doesn't know are skipped.
+//
+// An image's ops come after the end of the sections, as arrays of
+// 4 byte opcodes and 8 byte operands, little endian. Each starts
+// at a multiple of IMAGE_ALIGN and is padded with zeros to one, so
+// they can be mapped straight into the VM's memory.
+#define BYTECODE_MAGIC "\x7fMIN"
+#define BYTECODE_MAGIC_LEN 4
+#define BYTECODE_VERSION 1
+
+// The biggest page size around, 64KiB on some ARM systems.
+#define IMAGE_ALIGN ((size_t)64 << 10)
+#define IMAGE_SECTION_SIZE 24
+
+enum {
+    SECTION_END,
+    SECTION_CODE,
+    SECTION_DATA,
+    SECTION_SYMBOLS,
+    SECTION_IMAGE
+};
+
+// A file being read, with each section left to be read one
+// item at a time.
+typedef struct {
+    size_t memory_cap;
+    size_t stack_cap;
+    u64 entry;
+    u64 op_count;
+    u64 symbol_count;
+
+    const uint8_t *code;
+    const uint8_t *code_end;
+    const uint8_t *data;
+    const uint8_t *data_end;
+    const uint8_t *symbols;
+    const uint8_t *symbols_end;
+
+    // Set if the ops are in an image instead, at these offsets
+    // into the file starting at base.
+    bool image;
+    size_t opcodes_at;
+    size_t operands_at;
+    const uint8_t *base;
+    u64 next;
+} Bytecode;
+
+void write_bytecode(Output *out, const Root *root, bool image);
+bool is_bytecode(const void *src, size_t len);
+bool open_bytecode(Bytecode *bc, const void *src, size_t len);
+bool next_op(Bytecode *bc, Opcode *opcode, i64 *operand);
+bool next_symbol(Bytecode *bc, const char **name, size_t *name_len, i64 *value);
+
+#endif
@@ -1,4 +1,11 @@
+// Needed for open(), close() and sysconf() with -std=c11.
+#define _DEFAULT_SOURCE
+
 #include "disassembler.h"
+#include "loader.h"
+#include "bytecode.h"
+#include "scanner.h"
+#include "output.h"
 #include "vm.h"
 #include <stdio.h>
 #include <stdlib.h>
@@ -8,125 +15,395 @@
 #include <inttypes.h>
 #include <errno.h>
 #include <ctype.h>
+#include <stdatomic.h>
+
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// How each opcode's operand is written, anything not here takes
+// an integer.
+enum {
+    FORM_INTEGER,
+    FORM_NONE,
+    FORM_MEMORY,
+    FORM_STACK
+};
+
+static const unsigned char operand_forms[OPCODE_COUNT] = {
+    [NOP] = FORM_NONE,
+    [HLT] = FORM_NONE,
+    [PRCA] = FORM_NONE,
+    [PRIA] = FORM_NONE,
+    [NOT] = FORM_NONE,
+    [NEG] = FORM_NONE,
+    [BRAA] = FORM_NONE,
+    [DRP] = FORM_NONE,
+    [PSHA] = FORM_NONE,
+    [POPA] = FORM_NONE,
+    [SEZA] = FORM_NONE,
+    [SEPA] = FORM_NONE,
+    [SENA] = FORM_NONE,
+    [SEQA] = FORM_NONE,
+    [SNEA] = FORM_NONE,
+    [SLTA] = FORM_NONE,
+    [SLEA] = FORM_NONE,
+    [SGTA] = FORM_NONE,
+    [SGEA] = FORM_NONE,
+    [PRSA] = FORM_NONE,
+
+    [LDM] = FORM_MEMORY,
+    [STM] = FORM_MEMORY,
+    [PRCM] = FORM_MEMORY,
+    [PRIM] = FORM_MEMORY,
+    [PRSM] = FORM_MEMORY,
+    [CPYM] = FORM_MEMORY,
+    [FILM] = FORM_MEMORY,
+    [CMBM] = FORM_MEMORY,
+    [ADDM] = FORM_MEMORY,
+    [SUBM] = FORM_MEMORY,
+    [MULM] = FORM_MEMORY,
+    [DIVM] = FORM_MEMORY,
+    [MODM] = FORM_MEMORY,
+    [SHLM] = FORM_MEMORY,
+    [SHRM] = FORM_MEMORY,
+    [ANDM] = FORM_MEMORY,
+    [ORM] = FORM_MEMORY,
+    [XORM] = FORM_MEMORY,
+    [NEGM] = FORM_MEMORY,
+    [NOTM] = FORM_MEMORY,
+    [RDCM] = FORM_MEMORY,
+    [RDIM] = FORM_MEMORY,
+    [REFM] = FORM_MEMORY,
+    [LDDM] = FORM_MEMORY,
+    [STDM] = FORM_MEMORY,
+    [CMPM] = FORM_MEMORY,
+    [INCM] = FORM_MEMORY,
+    [DECM] = FORM_MEMORY,
+    [PSHM] = FORM_MEMORY,
+    [POPM] = FORM_MEMORY,
+    [SWPM] = FORM_MEMORY,
+    [SEQM] = FORM_MEMORY,
+    [SNEM] = FORM_MEMORY,
+    [SLTM] = FORM_MEMORY,
+    [SLEM] = FORM_MEMORY,
+    [SGTM] = FORM_MEMORY,
+    [SGEM] = FORM_MEMORY,
+
+    [LDAS] = FORM_STACK,
+    [STAS] = FORM_STACK,
+    [PRCS] = FORM_STACK,
+    [PRIS] = FORM_STACK,
+    [ADDS] = FORM_STACK,
+    [SUBS] = FORM_STACK,
+    [MULS] = FORM_STACK,
+    [DIVS] = FORM_STACK,
+    [MODS] = FORM_STACK,
+    [SHLS] = FORM_STACK,
+    [SHRS] = FORM_STACK,
+    [ANDS] = FORM_STACK,
+    [ORS] = FORM_STACK,
+    [XORS] = FORM_STACK,
+    [NOTS] = FORM_STACK,
+    [NEGS] = FORM_STACK,
+    [RDCS] = FORM_STACK,
+    [RDIS] = FORM_STACK,
+    [REFS] = FORM_STACK,
+    [LDDS] = FORM_STACK,
+    [STDS] = FORM_STACK,
+    [CMPS] = FORM_STACK,
+    [INCS] = FORM_STACK,
+    [DECS] = FORM_STACK,
+    [PSHS] = FORM_STACK,
+    [SWPS] = FORM_STACK,
+    [SEZS] = FORM_STACK,
+    [SEPS] = FORM_STACK,
+    [SENS] = FORM_STACK,
+    [SEQS] = FORM_STACK,
+    [SNES] = FORM_STACK,
+    [SLTS] = FORM_STACK,
+    [SLES] = FORM_STACK,
+    [SGTS] = FORM_STACK,
+    [SGES] = FORM_STACK
+};
+
+void disassemble_op(Output *out, Opcode opcode, i64 operand) {
+    // Machine code can have any number for an opcode, and the
+    // superinstructions' are as undefined in it as any other.
+    if ((u64)opcode >= OPCODE_COUNT) {
+        output_string(out, "undefined ", 10);
+        output_int(out, operand);
+        return;
+    }
+
+    const char *mnemonic = opcode_to_string(opcode);
+    output_string(out, mnemonic, strlen(mnemonic));
+
+    const unsigned char form = operand_forms[opcode];
+
+    if (form == FORM_NONE)
+        return;
+
+    output_char(out, ' ');
+
+    // [] for a memory access, ^ for the top of the stack.
+    if (form == FORM_MEMORY) {
+        output_char(out, '[');
+        output_int(out, operand);
+        output_char(out, ']');
+    } else if (form == FORM_STACK)
+        output_char(out, '^');
+    else
+        output_int(out, operand);
+}
+
+static void output_header(Output *out, size_t memory_cap, size_t stack_cap) {
+    if (memory_cap != 0) {
+        output_string(out, ".memory ", 8);
+        output_int(out, memory_cap);
+        output_char(out, '\n');
+    }
+
+    if (stack_cap != 0) {
+        output_string(out, ".stack ", 7);
+        output_int(out, stack_cap);
+        output_char(out, '\n');
+    }
+}
+
+// Symbols are left out since the operands are just numbers,
+// and so's the entry point since there's no way to write it.
+static bool disassemble_bytecode(Output *out, const char *src, size_t len) {
+    Bytecode bc;
 
-#define BUFFER_CAP 65
-
-void disassemble_op(char *buffer, Opcode opcode, i64 operand) {
-    strcpy(buffer, opcode_to_string(opcode));
-
-    // Not all instructions have operands.
-    switch (opcode) {
-        case NOP:
-        case HLT:
-        case PRCA:
-        case PRIA:
-        case NOT:
-        case NEG:
-        case BRAA:
-        case DRP:
-        case PSHA:
-        case POPA:
-        case SEZA:
-        case SEPA:
-        case SENA:
-        case SEQA:
-        case SNEA:
-        case SLTA:
-        case SLEA:
-        case SGTA:
-        case SGEA: break;
-        default: {
-            strcat(buffer, " ");
-
-            char operand_buffer[BUFFER_CAP];
-
-            // Add [] to indicate a memory access.
-            // Add ^ to indicate a top of stack access.
-            switch (opcode) {
-                case LDM:
-                case STM:
-                case PRCM:
-                case PRIM:
-                case ADDM:
-                case SUBM:
-                case MULM:
-                case DIVM:
-                case MODM:
-                case SHLM:
-                case SHRM:
-                case ANDM:
-                case ORM:
-                case XORM:
-                case NEGM:
-                case NOTM:
-                case RDCM:
-                case RDIM:
-                case REFM:
-                case LDDM:
-                case STDM:
-                case CMPM:
-                case INCM:
-                case DECM:
-                case PSHM:
-                case POPM:
-                case SWPM:
-                case SEQM:
-                case SNEM:
-                case SLTM:
-                case SLEM:
-                case SGTM:
-                case SGEM:
-                    sprintf(operand_buffer, "[%" PRId64 "]", operand);
-                    break;
-                case LDAS:
-                case STAS:
-                case PRCS:
-                case PRIS:
-                case ADDS:
-                case SUBS:
-                case MULS:
-                case DIVS:
-                case MODS:
-                case SHLS:
-                case SHRS:
-                case ANDS:
-                case ORS:
-                case XORS:
-                case NOTS:
-                case NEGS:
-                case RDCS:
-                case RDIS:
-                case REFS:
-                case LDDS:
-                case STDS:
-                case CMPS:
-                case INCS:
-                case DECS:
-                case PSHS:
-                case SWPS:
-                case SEZS:
-                case SEPS:
-                case SENS:
-                case SEQS:
-                case SNES:
-                case SLTS:
-                case SLES:
-                case SGTS:
-                case SGES:
-                    strcpy(operand_buffer, "^");
-                    break;
-                default:
-                    sprintf(operand_buffer, "%" PRId64, operand);
-                    break;
-            }
-
-            strcat(buffer, operand_buffer);
-            break;
+    if (!open_bytecode(&bc, src, len)) {
+        fprintf(stderr, "disassembler: error: invalid bytecode\n");
+        return false;
+    }
+
+    output_header(out, bc.memory_cap, bc.stack_cap);
+
+    Opcode opcode;
+    i64 operand;
+
+    for (u64 i = 0; i < bc.op_count; i++) {
+        if (!next_op(&bc, &opcode, &operand)) {
+            fprintf(stderr, "disassembler: error: invalid instruction %" PRIu64 "\n", i);
+            return false;
         }
+
+        if (i > 0)
+            output_char(out, '\n');
+
+        disassemble_op(out, opcode, operand);
     }
+
+    return true;
+}
+
+// Text bigger than this is split up between threads, a chunk
+// per thread or a few for each if there's plenty.
+#define MIN_CHUNK_SIZE ((size_t)1 << 20)
+#define CHUNKS_PER_THREAD 4
+
+// A part of the text that ends at whitespace, so no number is
+// split between two. Its ops are the ones whose opcode is in it.
+typedef struct {
+    size_t start;
+    size_t end;
+
+    // How many numbers are in it, and in the ones before it.
+    size_t numbers;
+    size_t before;
+
+    // Kept in memory until it's this chunk's turn to be written.
+    Output out;
+    ScanResult result;
+} Chunk;
+
+typedef struct {
+    const char *src;
+    size_t len;
+    int base;
+    Chunk *chunks;
+    size_t count;
+    atomic_size_t next;
+
+    // Chunks are counted, then formatted once it's known which
+    // numbers are opcodes.
+    bool formatting;
+} Split;
+
+static void count_chunk(Split *split, Chunk *chunk) {
+    Scanner scan;
+    open_scanner(&scan, split->src, chunk->end, chunk->start, split->base);
+    chunk->numbers = count_numbers(&scan);
+}
+
+// Reads on past the end for the operand of its last op.
+static void format_chunk(Split *split, Chunk *chunk, Output *out) {
+    Scanner scan;
+    open_scanner(&scan, split->src, split->len, chunk->start, split->base);
+
+    const size_t written = out->flushed + out->len;
+    i64 opcode;
+    i64 operand;
+    ScanResult result;
+
+    // Odd means it starts with the last operand of the chunk before.
+    if (chunk->before % 2 == 1)
+        next_number(&scan, &operand);
+
+    while ((result = next_number(&scan, &opcode)) == SCAN_NUMBER && scan.start < chunk->end
+           && (result = next_number(&scan, &operand)) == SCAN_NUMBER) {
+        if (chunk->before > 0 || out->flushed + out->len > written)
+            output_char(out, '\n');
+
+        disassemble_op(out, opcode, operand);
+    }
+
+    // An opcode past the end belongs to the next chunk.
+    chunk->result = result == SCAN_NUMBER ? SCAN_END : result;
 }
 
-int disassemble(char *infile, char *outfile) {
+static void *disassemble_chunks(void *arg) {
+    Split *split = arg;
+    size_t i;
+
+    while ((i = atomic_fetch_add(&split->next, 1)) < split->count) {
+        if (split->formatting) {
+            Chunk *chunk = &split->chunks[i];
+            chunk->out = (Output){ .cap = 0 };
+            open_output(&chunk->out, -1);
+            format_chunk(split, chunk, &chunk->out);
+        } else
+            count_chunk(split, &split->chunks[i]);
+    }
+
+    return NULL;
+}
+
+// This thread is one of the workers.
+static void run_split(Split *split, size_t threads) {
+    pthread_t *workers = malloc(threads * sizeof(pthread_t));
+    size_t started = 0;
+
+    atomic_store(&split->next, 0);
+
+    while (started < threads - 1 && pthread_create(&workers[started], NULL, disassemble_chunks, split) == 0)
+        started++;
+
+    disassemble_chunks(split);
+
+    for (size_t i = 0; i < started; i++)
+        pthread_join(workers[i], NULL);
+
+    free(workers);
+}
+
+static bool report_result(ScanResult result) {
+    if (result == SCAN_INVALID) {
+        fprintf(stderr, "disassembler: error: constant conversion failed\n");
+        return false;
+    } else if (result == SCAN_RANGE) {
+        fprintf(stderr, "disassembler: error: constant conversion failed: %s\n", strerror(ERANGE));
+        return false;
+    }
+
+    return true;
+}
+
+static bool disassemble_text(Output *out, const char *src, size_t len, size_t threads) {
+    size_t i = 0;
+    size_t memory_cap = 0;
+    size_t stack_cap = 0;
+
+    if (!parse_header(src, &i, &memory_cap, &stack_cap)) {
+        fprintf(stderr, "disassembler: error: invalid header\n");
+        return false;
+    }
+
+    output_header(out, memory_cap, stack_cap);
+
+    if (threads == 0) {
+        const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (size_t)cpus : 1;
+    }
+
+    size_t count = (len - i) / MIN_CHUNK_SIZE;
+
+    // Splitting only pays for itself when there's another thread.
+    if (threads == 1)
+        count = 1;
+    else if (count > threads * CHUNKS_PER_THREAD)
+        count = threads * CHUNKS_PER_THREAD;
+    else if (count == 0)
+        count = 1;
+
+    if (threads > count)
+        threads = count;
+
+    Split split = {
+        .src = src,
+        .len = len,
+        .base = scan_base(src + i, len - i, true),
+        .chunks = calloc(count, sizeof(Chunk)),
+        .count = count,
+        .formatting = false
+    };
+
+    size_t start = i;
+
+    for (size_t j = 0; j < count; j++) {
+        size_t end = j == count - 1 ? len : i + (len - i) / count * (j + 1);
+
+        if (end < start)
+            end = start;
+
+        while (end < len && !isspace((unsigned char)src[end]))
+            end++;
+
+        split.chunks[j].start = start;
+        split.chunks[j].end = end;
+        start = end;
+    }
+
+    // One chunk starts with an opcode and can go straight out.
+    if (count == 1) {
+        format_chunk(&split, &split.chunks[0], out);
+        const ScanResult result = split.chunks[0].result;
+        free(split.chunks);
+        return report_result(result);
+    }
+
+    run_split(&split, threads);
+
+    for (size_t j = 1; j < count; j++)
+        split.chunks[j].before = split.chunks[j - 1].before + split.chunks[j - 1].numbers;
+
+    split.formatting = true;
+    run_split(&split, threads);
+
+    // Everything up to the first error is written, like it would
+    // be if it had all been done in one go.
+    ScanResult result = SCAN_END;
+
+    for (size_t j = 0; j < count; j++) {
+        Chunk *chunk = &split.chunks[j];
+
+        if (result == SCAN_END) {
+            output_string(out, chunk->out.buffer, chunk->out.len);
+            result = chunk->result;
+        }
+
+        free(chunk->out.buffer);
+    }
+
+    free(split.chunks);
+    return report_result(result);
+}
+
+int disassemble(char *infile, char *outfile, size_t threads) {
     FILE *f = fopen(infile, "r");
 
     if (f == NULL) {
@@ -138,7 +415,8 @@ int disassemble(char *infile, char *outfile) {
     size_t file_size = ftell(f);
     rewind(f);
 
-    char *src = malloc(file_size + 1);
+    // The padding ends the header too.
+    char *src = malloc(file_size + SCAN_PADDING);
     size_t read_size = fread(src, 1, file_size, f);
     fclose(f);
 
@@ -148,83 +426,28 @@ int disassemble(char *infile, char *outfile) {
         return EXIT_FAILURE;
     }
 
-    src[read_size] = '\0';
+    memset(src + read_size, 0, SCAN_PADDING);
 
-    f = fopen(outfile, "w");
+    const int fd = open(outfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
 
-    if (f == NULL) {
+    if (fd < 0) {
         fprintf(stderr, "%s: error: failed to open file '%s'\n", infile, outfile);
         free(src);
         return EXIT_FAILURE;
     }
 
-    char buffer[BUFFER_CAP];
-    size_t buffer_size = 0;
-    const size_t len = strlen(src);
-    bool is_binary = true;
-    i64 opcode;
-    i64 operand = 0;
-    int mode = 2;
-    size_t i = 0;
-
-    while (i < len) {
-        if (buffer_size == BUFFER_CAP) {
-            fprintf(stderr, "disassembler: error: constant exceeds maximum size of %u\n", BUFFER_CAP);
-            free(src);
-            fclose(f);
-            return EXIT_FAILURE;
-        }
-
-        if (is_binary && isdigit(src[i]) && src[i] != '0' && src[i] != '1')
-            is_binary = false;
-
-        buffer[buffer_size++] = src[i++];
-
-        if (i != len && !isspace(src[i]))
-            continue;
-
-        while (i != len && isspace(src[i]))
-            i++;
-
-        if (mode > 0) {
-            buffer[buffer_size] = '\0';
-            char *endptr;
-            errno = 0;
-
-            if (mode == 2)
-                opcode = strtoll(buffer, &endptr, is_binary ? 2 : 10);
-            else
-                operand = strtoll(buffer, &endptr, is_binary ? 2 : 10);
-
-            if (endptr == buffer || *endptr != '\0') {
-                fprintf(stderr, "disassembler: error: constant conversion failed\n");
-                free(src);
-                fclose(f);
-                return EXIT_FAILURE;
-            } else if (errno == ERANGE || errno == EINVAL) {
-                fprintf(stderr, "disassembler: error: constant conversion failed: %s\n", strerror(errno));
-                free(src);
-                fclose(f);
-                return EXIT_FAILURE;
-            }
-
-            mode--;
-            buffer_size = 0;
-        }
+    Output out = { .cap = 0 };
+    open_output(&out, fd);
 
-        if (mode == 0) {
-            char op_buffer[BUFFER_CAP * 2 + 2];
-            disassemble_op(op_buffer, opcode, operand);
-            fputs(op_buffer, f);
+    const bool disassembled = is_bytecode(src, read_size) ? disassemble_bytecode(&out, src, read_size) : disassemble_text(&out, src, read_size, threads);
+    free(src);
 
-            if (i != len)
-                fputc('\n', f);
+    const bool written = close_output(&out);
 
-            mode = 2;
-        }
+    if (close(fd) != 0 || !written) {
+        fprintf(stderr, "%s: error: failed to write to file '%s'\n", infile, outfile);
+        return EXIT_FAILURE;
     }
 
-    free(src);
-    fclose(f);
-    return EXIT_SUCCESS;
-}
\ No newline at end of file
+    return disassembled ? EXIT_SUCCESS : EXIT_FAILURE;
+}
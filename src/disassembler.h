@@ -1,9 +1,11 @@
 #ifndef DISASSEMBLER_H
 #define DISASSEMBLER_H
 
+#include "output.h"
 #include "vm.h"
+#include <stddef.h>
 
-void disassemble_op(char *buffer, Opcode opcode, i64 operand);
-int disassemble(char *infile, char *outfile);
+void disassemble_op(Output *out, Opcode opcode, i64 operand);
+int disassemble(char *infile, char *outfile, size_t threads);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,117 @@
+// Needed for read() with -std=c11.
+#define _DEFAULT_SOURCE
+
+#include "input.h"
+#include <stdlib.h>
+#include <errno.h>
+
+#include <unistd.h>
+
+void open_input(Input *in, Output *prompt) {
+    in->prompt = prompt;
+
+    // Already holding what a snapshot had left to read.
+    if (in->buffer != NULL)
+        return;
+
+    if (in->cap == 0)
+        in->cap = DEFAULT_INPUT_CAP;
+
+    in->buffer = malloc(in->cap);
+    in->pos = in->len = 0;
+    in->eof = false;
+}
+
+void close_input(Input *in) {
+    free(in->buffer);
+    in->buffer = NULL;
+}
+
+bool refill_input(Input *in) {
+    if (in->eof)
+        return false;
+
+    if (in->prompt != NULL)
+        flush_output(in->prompt);
+
+    ssize_t n;
+
+    do
+        n = read(STDIN_FILENO, in->buffer, in->cap);
+    while (n < 0 && errno == EINTR);
+
+    // Errors end the input just like the end of a file would.
+    if (n <= 0) {
+        in->eof = true;
+        in->pos = in->len = 0;
+        return false;
+    }
+
+    in->pos = 0;
+    in->len = n;
+    return true;
+}
+
+// Drops what's left of the line c is from.
+static void skip_line(Input *in, int c) {
+    while (c != '\n' && c != -1)
+        c = next_char(in);
+}
+
+// The first character of the next line, 0 if it's empty
+// or there's nothing left to read.
+char input_char(Input *in) {
+    const int c = next_char(in);
+    skip_line(in, c);
+    return c == '\n' || c == -1 ? 0 : c;
+}
+
+// The integer at the start of the next line, 0 if there isn't
+// one, like atoi() would. False if it doesn't fit in an int64_t.
+bool input_int(Input *in, int64_t *value) {
+    int c = next_char(in);
+
+    while (c == ' ' || c == '\t')
+        c = next_char(in);
+
+    const bool negative = c == '-';
+
+    if (c == '-' || c == '+')
+        c = next_char(in);
+
+    // The magnitude of INT64_MIN is one more than INT64_MAX.
+    const uint64_t limit = negative ? (uint64_t)INT64_MAX + 1 : (uint64_t)INT64_MAX;
+    uint64_t n = 0;
+    bool overflow = false;
+
+    while (c >= '0' && c <= '9') {
+        const uint64_t digit = c - '0';
+
+        if (n > (limit - digit) / 10)
+            overflow = true;
+        else
+            n = n * 10 + digit;
+
+        c = next_char(in);
+    }
+
+    skip_line(in, c);
+    *value = negative ? (int64_t)-n : (int64_t)n;
+    return !overflow;
+}
+
+// Copies up to cap characters of the next line, without the
+// newline, and drops the rest. Returns how many were copied.
+size_t input_line(Input *in, char *line, size_t cap) {
+    size_t len = 0;
+    int c = next_char(in);
+
+    while (c != '\n' && c != -1) {
+        if (len < cap)
+            line[len++] = c;
+
+        c = next_char(in);
+    }
+
+    return len;
+}
@@ -0,0 +1,41 @@
+#ifndef INPUT_H
+#define INPUT_H
+
+#include "output.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define DEFAULT_INPUT_CAP ((size_t)64 << 10)
+
+// What the VM reads, taken from stdin with read() in big chunks
+// instead of going through stdio a line at a time. Every read
+// instruction takes a whole line.
+typedef struct {
+    char *buffer;
+    size_t pos;
+    size_t len;
+    size_t cap;
+    bool eof;
+
+    // Whatever was printed is probably prompting for the input,
+    // so it's flushed before blocking on a read.
+    Output *prompt;
+} Input;
+
+void open_input(Input *in, Output *prompt);
+void close_input(Input *in);
+bool refill_input(Input *in);
+char input_char(Input *in);
+bool input_int(Input *in, int64_t *value);
+size_t input_line(Input *in, char *line, size_t cap);
+
+// The next character, or -1 at the end of the input.
+static inline int next_char(Input *in) {
+    if (in->pos == in->len && !refill_input(in))
+        return -1;
+
+    return (unsigned char)in->buffer[in->pos++];
+}
+
+#endif
@@ -0,0 +1,1512 @@
+// Needed for MAP_ANONYMOUS with -std=c11.
+#define _DEFAULT_SOURCE
+
+#include "jit.h"
+#include "vm.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <assert.h>
+
+#if defined(__x86_64__) && defined(__linux__)
+
+#include <sys/mman.h>
+
+// Native code generation for x86-64, used two ways:
+//   run_jit()    translates the whole program up front, every
+//                instruction on its own into a fixed template.
+//   run_trace()  interprets, and only compiles the path taken through
+//                loops once they get hot, see the bottom of the file.
+// Instructions without a template (mostly I/O and the stack addressed
+// forms) call back into the switch engine for that one instruction.
+//
+// Registers, all callee saved so the fallback can call into C:
+//   rbx  accumulator
+//   rbp  flags, packed FLAG_CF | FLAG_ZF | FLAG_NF, or for traces
+//        a value whose sign gives the flags
+//   r12  VM
+//   r13  data[]
+//   r14  stack pointer
+//   r15  stack[]
+// rax, rcx and rdx are scratch.
+//
+// Traces can also keep a few slots of data[] in r8 to r11, rsi and
+// rdi, written back whenever anything else could look at memory.
+//
+// Operands live in data[] and programs can store into them, so the
+// operands that are baked into the code have to be guarded:
+//   - Slots written by an instruction with a constant address are
+//     found up front and their operands are loaded at runtime.
+//   - Stores to computed addresses check a map of the baked slots
+//     and leave for the interpreter if they hit one.
+
+typedef uint8_t byte;
+
+// Slots are addressed as [r13 + slot * 8] with a 32 bit
+// displacement, anything past this goes through the interpreter.
+#define MAX_DIRECT ((i64)1 << 28)
+
+#define RAX 0
+#define RCX 1
+#define RBX 3
+
+// Caller saved, so only traces that save them around calls use them.
+static const int promotable[] = { 8, 9, 10, 11, 6, 7 };
+#define MAX_PROMOTED (sizeof(promotable) / sizeof(promotable[0]))
+
+// Second byte of the 0F 8x near conditional jumps, flipping
+// the lowest bit inverts the condition.
+#define JMP 0x00
+#define JAE 0x83
+#define JZ 0x84
+#define JNZ 0x85
+#define JS 0x88
+#define JNS 0x89
+#define JL 0x8C
+#define JGE 0x8D
+#define JLE 0x8E
+#define JG 0x8F
+
+typedef enum {
+    TO_INSTRUCTION,
+    TO_OFFSET,
+    TO_EXIT,
+    TO_STALE,
+    TO_RETURN,
+    TO_DISPATCH,
+    TO_EXIT_RAX,
+    TO_EPILOGUE
+} FixupKind;
+
+// A rel32 to fill in once everything has been emitted.
+typedef struct {
+    size_t at;
+    FixupKind kind;
+    i64 value;
+} Fixup;
+
+typedef struct Jit {
+    VM *vm;
+
+    // The whole program, when compiling it up front.
+    size_t count;
+    size_t *offsets;
+    const byte **targets;
+
+    // Whether rbp holds a flag value rather than packed flags.
+    bool values;
+
+    // The slot of data[] that rbx is known to hold, or -1.
+    i64 known;
+
+    // Slots kept in registers, the nth in promotable[n].
+    i64 promoted[MAX_PROMOTED];
+    size_t promoted_count;
+
+    bool *dynamic;
+    bool *embedded;
+
+    // Set when a store hits an embedded operand, so whatever was
+    // compiled from it is out of date.
+    bool stale;
+
+    byte *buffer;
+    size_t len;
+    size_t cap;
+
+    Fixup *fixups;
+    size_t fixup_count;
+    size_t fixup_cap;
+
+    size_t return_;
+    size_t dispatch;
+    size_t exit_rax;
+    size_t epilogue;
+} Jit;
+
+typedef u64 (*Entry)(VM *vm, const byte *start, u64 flags);
+
+static void create_jit(Jit *jit, VM *vm) {
+    jit->vm = vm;
+    jit->count = 0;
+    jit->offsets = NULL;
+    jit->targets = NULL;
+    jit->values = false;
+    jit->known = -1;
+    jit->promoted_count = 0;
+    // Only operands matter, so these are just as big as the program.
+    jit->dynamic = calloc(vm->op_count, sizeof(bool));
+    jit->embedded = calloc(vm->op_count, sizeof(bool));
+    jit->stale = false;
+    jit->cap = 4096;
+    jit->buffer = malloc(jit->cap);
+    jit->len = 0;
+    jit->fixup_cap = 64;
+    jit->fixups = malloc(jit->fixup_cap * sizeof(Fixup));
+    jit->fixup_count = 0;
+}
+
+static void delete_jit(Jit *jit) {
+    free(jit->buffer);
+    free(jit->offsets);
+    free(jit->targets);
+    free(jit->dynamic);
+    free(jit->embedded);
+    free(jit->fixups);
+}
+
+static void emit(Jit *jit, const byte *bytes, size_t size) {
+    while (jit->len + size > jit->cap) {
+        jit->cap *= 2;
+        jit->buffer = realloc(jit->buffer, jit->cap);
+    }
+
+    memcpy(jit->buffer + jit->len, bytes, size);
+    jit->len += size;
+}
+
+#define EMIT(...) do { \
+        const byte bytes_[] = { __VA_ARGS__ }; \
+        emit(jit, bytes_, sizeof(bytes_)); \
+    } while (0)
+
+static void emit32(Jit *jit, uint32_t value) {
+    emit(jit, (const byte *)&value, 4);
+}
+
+static void emit64(Jit *jit, u64 value) {
+    emit(jit, (const byte *)&value, 8);
+}
+
+static void emit_fixup(Jit *jit, FixupKind kind, i64 value) {
+    if (jit->fixup_count == jit->fixup_cap) {
+        jit->fixup_cap *= 2;
+        jit->fixups = realloc(jit->fixups, jit->fixup_cap * sizeof(Fixup));
+    }
+
+    jit->fixups[jit->fixup_count++] = (Fixup){ .at = jit->len, .kind = kind, .value = value };
+    emit32(jit, 0);
+}
+
+static void emit_jump(Jit *jit, byte condition, FixupKind kind, i64 value) {
+    if (condition == JMP)
+        EMIT(0xE9);
+    else
+        EMIT(0x0F, condition);
+
+    emit_fixup(jit, kind, value);
+}
+
+// Jump to the instruction at target, or leave for the
+// interpreter if it's not one we compiled.
+static void emit_branch(Jit *jit, byte condition, i64 target) {
+    if (target >= 0 && (u64)target < jit->count)
+        emit_jump(jit, condition, TO_INSTRUCTION, target);
+    else
+        emit_jump(jit, condition, TO_EXIT, target);
+}
+
+static bool fits_i32(i64 value) {
+    return value >= INT32_MIN && value <= INT32_MAX;
+}
+
+// mov reg, value
+static void emit_load_constant(Jit *jit, int reg, i64 value) {
+    if (fits_i32(value)) {
+        EMIT(0x48, 0xC7, 0xC0 | reg);
+        emit32(jit, (uint32_t)value);
+    } else {
+        EMIT(0x48, 0xB8 | reg);
+        emit64(jit, (u64)value);
+    }
+}
+
+// <opcode> reg, [r13 + address * 8]
+static void emit_memory_op(Jit *jit, byte opcode, int reg, i64 address) {
+    EMIT(0x49 | (reg >= 8 ? 4 : 0), opcode, 0x85 | ((reg & 7) << 3));
+    emit32(jit, (uint32_t)(address * 8));
+}
+
+// mov reg, [r13 + address * 8]
+static void emit_load_memory(Jit *jit, int reg, i64 address) {
+    emit_memory_op(jit, 0x8B, reg, address);
+}
+
+// <opcode> reg, rm
+static void emit_registers(Jit *jit, byte opcode, int reg, int rm) {
+    EMIT(0x48 | (reg >= 8 ? 4 : 0) | (rm >= 8 ? 1 : 0), opcode, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// The register a slot is kept in, or -1.
+static int slot_register(Jit *jit, i64 slot) {
+    for (size_t i = 0; i < jit->promoted_count; i++) {
+        if (jit->promoted[i] == slot)
+            return promotable[i];
+    }
+
+    return -1;
+}
+
+// <opcode> reg, data[slot] wherever the slot is kept. With a /digit
+// opcode, reg is the digit and the slot is the only operand.
+static void emit_slot_op(Jit *jit, byte opcode, int reg, i64 slot) {
+    const int rm = slot_register(jit, slot);
+
+    if (rm >= 0)
+        emit_registers(jit, opcode, reg, rm);
+    else
+        emit_memory_op(jit, opcode, reg, slot);
+}
+
+// Write the promoted slots back to memory, and read them in again.
+static void emit_spill(Jit *jit) {
+    for (size_t i = 0; i < jit->promoted_count; i++)
+        emit_memory_op(jit, 0x89, promotable[i], jit->promoted[i]);
+}
+
+static void emit_fill(Jit *jit) {
+    for (size_t i = 0; i < jit->promoted_count; i++)
+        emit_memory_op(jit, 0x8B, promotable[i], jit->promoted[i]);
+}
+
+static void emit_load_operand(Jit *jit, int reg, size_t address) {
+    if (jit->dynamic[address])
+        emit_load_memory(jit, reg, address);
+    else
+        emit_load_constant(jit, reg, jit->vm->data[address]);
+}
+
+// Leave for the interpreter at pc, jumping there if condition holds.
+static void emit_exit(Jit *jit, byte condition, i64 pc) {
+    emit_jump(jit, condition, TO_EXIT, pc);
+}
+
+// rbx = llabs(rbx) - llabs(rcx), then set the flags from it.
+// If the operand was a constant rcx already holds its absolute value.
+static void emit_compare(Jit *jit, bool absolute) {
+    if (!absolute) {
+        EMIT(0x48, 0x89, 0xC8,          // mov rax, rcx
+             0x48, 0xC1, 0xF8, 0x3F,    // sar rax, 63
+             0x48, 0x31, 0xC1,          // xor rcx, rax
+             0x48, 0x29, 0xC1);         // sub rcx, rax
+    }
+
+    EMIT(0x48, 0x89, 0xD8,          // mov rax, rbx
+         0x48, 0xC1, 0xF8, 0x3F,    // sar rax, 63
+         0x48, 0x31, 0xC3,          // xor rbx, rax
+         0x48, 0x29, 0xC3,          // sub rbx, rax
+         0x48, 0x29, 0xCB);         // sub rbx, rcx
+
+    // Traces test the result itself when they branch.
+    if (jit->values) {
+        EMIT(0x48, 0x89, 0xDD);     // mov rbp, rbx
+        return;
+    }
+
+    EMIT(0x48, 0x85, 0xDB,          // test rbx, rbx
+         0x0F, 0x9F, 0xC0,          // setg al
+         0x0F, 0x94, 0xC1,          // sete cl
+         0x0F, 0x9C, 0xC2,          // setl dl
+         0x0F, 0xB6, 0xC0,          // movzx eax, al
+         0x0F, 0xB6, 0xC9,          // movzx ecx, cl
+         0x0F, 0xB6, 0xD2,          // movzx edx, dl
+         0x8D, 0x04, 0x48,          // lea eax, [rax + rcx * 2]
+         0x8D, 0x2C, 0x90);         // lea ebp, [rax + rdx * 4]
+}
+
+// Branch on the flags in rbp.
+static void emit_flag_branch(Jit *jit, u64 mask, byte condition, size_t address) {
+    EMIT(0xF7, 0xC5);               // test ebp, mask
+    emit32(jit, (uint32_t)mask);
+
+    if (jit->dynamic[address]) {
+        emit_load_memory(jit, RAX, address);
+        emit_jump(jit, condition, TO_DISPATCH, 0);
+    } else
+        emit_branch(jit, condition, jit->vm->data[address]);
+}
+
+// Branch on the accumulator.
+static void emit_acc_branch(Jit *jit, byte condition, size_t address) {
+    EMIT(0x48, 0x85, 0xDB);         // test rbx, rbx
+
+    if (jit->dynamic[address]) {
+        emit_load_memory(jit, RAX, address);
+        emit_jump(jit, condition, TO_DISPATCH, 0);
+    } else
+        emit_branch(jit, condition, jit->vm->data[address]);
+}
+
+// Where a store by the instruction at address lands, if it makes one.
+// At compile time only constant addresses are known, at runtime the
+// pointer of STDM can be followed too.
+static bool store_range(VM *vm, size_t address, bool follow_pointers, i64 *start, i64 *length) {
+    const i64 operand = vm->data[address];
+    *start = operand;
+    *length = 1;
+
+    switch (vm->instructions[address]) {
+        case STM:
+        case NOTM:
+        case NEGM:
+        case RDCM:
+        case RDIM:
+        case INCM:
+        case DECM:
+        case POPM:
+        case SWPM:
+        case SEZM:
+        case SEPM:
+        case SENM:
+        case SEQM:
+        case SNEM:
+        case SLTM:
+        case SLEM:
+        case SGTM:
+        case SGEM:
+            return true;
+        case IPS:
+            *length = 128;
+            return true;
+        case STDM:
+            if (!follow_pointers || operand < 0 || (u64)operand >= vm->memory_cap)
+                return false;
+
+            *start = vm->data[operand];
+            return true;
+        case CPYI:
+        case FILI:
+            if (!follow_pointers)
+                return false;
+
+            *start = vm->acc;
+            *length = operand;
+            return true;
+        case CPYM:
+        case FILM:
+            if (!follow_pointers || operand < 0 || (u64)operand >= vm->memory_cap)
+                return false;
+
+            *start = vm->acc;
+            *length = vm->data[operand];
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Whether the instruction at address is about to store into an
+// operand that was baked into compiled code.
+static bool hits_embedded(Jit *jit, size_t address) {
+    i64 start;
+    i64 length;
+
+    if (!store_range(jit->vm, address, true, &start, &length))
+        return false;
+
+    for (i64 i = start; i < start + length; i++) {
+        if (i >= 0 && (u64)i < jit->vm->op_count && jit->embedded[i])
+            return true;
+    }
+
+    return false;
+}
+
+// The flags as a value that set_flags() would give them for,
+// which is what traces keep in rbp.
+static i64 flag_value(u64 flags) {
+    return flags & FLAG_CF ? 1 : flags & FLAG_ZF ? 0 : -1;
+}
+
+static u64 value_flags(i64 value) {
+    return value > 0 ? FLAG_CF : value == 0 ? FLAG_ZF : FLAG_NF;
+}
+
+// Called from compiled code for instructions without a template.
+// Returns the address to continue at, or -1 to leave the JIT with
+// vm->pc already set.
+static i64 fallback(VM *vm, i64 address, u64 *flags, Jit *jit) {
+    const bool stale = hits_embedded(jit, address);
+
+    unpack_flags(vm, jit->values ? value_flags((i64)*flags) : *flags);
+    execute_at(vm, address);
+    *flags = jit->values ? (u64)flag_value(pack_flags(vm)) : pack_flags(vm);
+
+    jit->stale = jit->stale || stale;
+    return vm->running && !stale ? vm->pc : -1;
+}
+
+static void emit_fallback(Jit *jit, size_t address) {
+    emit_spill(jit);
+    EMIT(0x49, 0x89, 0x9C, 0x24);   // mov [r12 + acc], rbx
+    emit32(jit, offsetof(VM, acc));
+    EMIT(0x4D, 0x89, 0xB4, 0x24);   // mov [r12 + sp], r14
+    emit32(jit, offsetof(VM, sp));
+    EMIT(0x48, 0x89, 0x2C, 0x24,    // mov [rsp], rbp
+         0x4C, 0x89, 0xE7,          // mov rdi, r12
+         0xBE);                     // mov esi, address
+    emit32(jit, (uint32_t)address);
+    EMIT(0x48, 0x89, 0xE2,          // mov rdx, rsp
+         0x48, 0xB9);               // mov rcx, jit
+    emit64(jit, (u64)(uintptr_t)jit);
+    EMIT(0x48, 0xB8);               // mov rax, fallback
+    emit64(jit, (u64)(uintptr_t)fallback);
+    EMIT(0xFF, 0xD0,                // call rax
+         0x49, 0x8B, 0x9C, 0x24);   // mov rbx, [r12 + acc]
+    emit32(jit, offsetof(VM, acc));
+    EMIT(0x4D, 0x8B, 0xB4, 0x24);   // mov r14, [r12 + sp]
+    emit32(jit, offsetof(VM, sp));
+    emit_fill(jit);
+    EMIT(0x48, 0x8B, 0x2C, 0x24,    // mov rbp, [rsp]
+         0x48, 0x3D);               // cmp rax, address + 1
+    emit32(jit, (uint32_t)(address + 1));
+    emit_jump(jit, JNZ, TO_RETURN, 0);
+}
+
+static void emit_stack_push(Jit *jit, size_t address) {
+    VM *vm = jit->vm;
+    const i64 operand = vm->data[address];
+
+    if (fits_i32(vm->stack_cap)) {
+        EMIT(0x49, 0x81, 0xFE);     // cmp r14, stack_cap
+        emit32(jit, (uint32_t)vm->stack_cap);
+    } else {
+        emit_load_constant(jit, RAX, vm->stack_cap);
+        EMIT(0x49, 0x39, 0xC6);     // cmp r14, rax
+    }
+
+    emit_exit(jit, JZ, address);    // The interpreter reports it.
+
+    // The value has to be loaded after the check, it may use rax.
+    if (vm->instructions[address] == PSHA)
+        EMIT(0x4B, 0x89, 0x1C, 0xF7);   // mov [r15 + r14 * 8], rbx
+    else if (vm->instructions[address] == PSHI && !jit->dynamic[address] && fits_i32(operand)) {
+        EMIT(0x4B, 0xC7, 0x04, 0xF7);   // mov qword [r15 + r14 * 8], operand
+        emit32(jit, (uint32_t)operand);
+    } else {
+        if (vm->instructions[address] == PSHM)
+            emit_slot_op(jit, 0x8B, RAX, operand);
+        else
+            emit_load_operand(jit, RAX, address);
+
+        EMIT(0x4B, 0x89, 0x04, 0xF7);   // mov [r15 + r14 * 8], rax
+    }
+
+    EMIT(0x49, 0xFF, 0xC6);         // inc r14
+}
+
+static void emit_stack_pop(Jit *jit, size_t address, int reg) {
+    EMIT(0x4D, 0x85, 0xF6);         // test r14, r14
+    emit_exit(jit, JZ, address);
+    EMIT(0x49, 0xFF, 0xCE,                     // dec r14
+         0x4B, 0x8B, 0x04 | (reg << 3), 0xF7); // mov reg, [r15 + r14 * 8]
+}
+
+static bool addressable(VM *vm, i64 slot) {
+    return slot >= 0 && (u64)slot < vm->memory_cap && slot < MAX_DIRECT;
+}
+
+// Translate one instruction, returns false if it had to fall back.
+static bool translate(Jit *jit, size_t address) {
+    VM *vm = jit->vm;
+    const i64 operand = vm->data[address];
+    const bool dynamic = jit->dynamic[address];
+
+    // Memory forms need the address baked in.
+    const bool direct = !dynamic && addressable(vm, operand);
+
+    // Anything that doesn't say otherwise clobbers rbx.
+    const i64 known = jit->known;
+    jit->known = -1;
+
+    // r/m64, r64 and r64, r/m64 forms of add, sub, and, or, xor, and
+    // the /digit of their r/m64, imm32 form.
+    byte to_rm = 0;
+    byte from_rm = 0;
+    byte digit = 0;
+
+    switch (vm->instructions[address]) {
+        case NOP:
+        case DAT:
+            jit->known = known;
+            return true;
+        case HLT:
+            EMIT(0x41, 0xC6, 0x84, 0x24);   // mov byte [r12 + running], 0
+            emit32(jit, offsetof(VM, running));
+            EMIT(0x00);
+            emit_exit(jit, JMP, address + 1);
+            return true;
+        case LDI:
+        case REFM:
+            emit_load_operand(jit, RBX, address);
+            return true;
+        case LDM:
+            if (!direct)
+                break;
+
+            // Already there from the last load or store.
+            if (known != operand)
+                emit_slot_op(jit, 0x8B, RBX, operand);
+
+            jit->known = operand;
+            return true;
+        case STM:
+            if (!direct)
+                break;
+
+            emit_slot_op(jit, 0x89, RBX, operand);
+            jit->known = operand;
+            return true;
+        case ADDI: to_rm = 0x01; digit = 0; goto alu_immediate;
+        case SUBI: to_rm = 0x29; digit = 5; goto alu_immediate;
+        case ANDI: to_rm = 0x21; digit = 4; goto alu_immediate;
+        case ORI: to_rm = 0x09; digit = 1; goto alu_immediate;
+        case XORI: to_rm = 0x31; digit = 6; goto alu_immediate;
+        alu_immediate:
+            if (!dynamic && fits_i32(operand)) {
+                EMIT(0x48, 0x81, 0xC3 | (digit << 3));  // op rbx, operand
+                emit32(jit, (uint32_t)operand);
+            } else {
+                emit_load_operand(jit, RAX, address);
+                EMIT(0x48, to_rm, 0xC3);    // op rbx, rax
+            }
+
+            return true;
+        case ADDM: from_rm = 0x03; goto alu_memory;
+        case SUBM: from_rm = 0x2B; goto alu_memory;
+        case ANDM: from_rm = 0x23; goto alu_memory;
+        case ORM: from_rm = 0x0B; goto alu_memory;
+        case XORM: from_rm = 0x33; goto alu_memory;
+        alu_memory:
+            if (!direct)
+                break;
+
+            emit_slot_op(jit, from_rm, RBX, operand);
+            return true;
+        case MULI:
+            if (!dynamic && fits_i32(operand)) {
+                EMIT(0x48, 0x69, 0xDB);     // imul rbx, rbx, operand
+                emit32(jit, (uint32_t)operand);
+            } else {
+                emit_load_operand(jit, RAX, address);
+                EMIT(0x48, 0x0F, 0xAF, 0xD8);   // imul rbx, rax
+            }
+
+            return true;
+        case MULM: {
+            if (!direct)
+                break;
+
+            const int rm = slot_register(jit, operand);
+
+            if (rm >= 0)
+                EMIT(0x48 | (rm >= 8 ? 1 : 0), 0x0F, 0xAF, 0xD8 | (rm & 7));   // imul rbx, rm
+            else {
+                EMIT(0x49, 0x0F, 0xAF, 0x9D);   // imul rbx, [r13 + operand * 8]
+                emit32(jit, (uint32_t)(operand * 8));
+            }
+
+            return true;
+        }
+        case DIVI:
+        case DIVM:
+        case MODI:
+        case MODM: {
+            const Opcode opcode = vm->instructions[address];
+
+            if (opcode == DIVM || opcode == MODM) {
+                if (!direct)
+                    break;
+
+                emit_slot_op(jit, 0x8B, RCX, operand);
+            } else
+                emit_load_operand(jit, RCX, address);
+
+            EMIT(0x48, 0x89, 0xD8,          // mov rax, rbx
+                 0x48, 0x99,                // cqo
+                 0x48, 0xF7, 0xF9);         // idiv rcx
+
+            if (opcode == DIVI || opcode == DIVM)
+                EMIT(0x48, 0x89, 0xC3);     // mov rbx, rax
+            else
+                EMIT(0x48, 0x89, 0xD3);     // mov rbx, rdx
+
+            return true;
+        }
+        case SHLI:
+        case SHLM:
+        case SHRI:
+        case SHRM: {
+            const Opcode opcode = vm->instructions[address];
+            const bool left = opcode == SHLI || opcode == SHLM;
+
+            if (opcode == SHLI || opcode == SHRI) {
+                if (!dynamic) {
+                    // shl rbx, operand or sar rbx, operand
+                    EMIT(0x48, 0xC1, left ? 0xE3 : 0xFB, (byte)(operand & 63));
+                    return true;
+                }
+
+                emit_load_operand(jit, RCX, address);
+            } else {
+                if (!direct)
+                    break;
+
+                emit_slot_op(jit, 0x8B, RCX, operand);
+            }
+
+            if (left)
+                EMIT(0x48, 0xD3, 0xE3);     // shl rbx, cl
+            else
+                EMIT(0x48, 0xD3, 0xFB);     // sar rbx, cl
+
+            return true;
+        }
+        case NOT:
+            EMIT(0x31, 0xC0,                // xor eax, eax
+                 0x48, 0x85, 0xDB,          // test rbx, rbx
+                 0x0F, 0x94, 0xC0,          // sete al
+                 0x48, 0x89, 0xC3);         // mov rbx, rax
+            return true;
+        case NEG:
+            EMIT(0x48, 0xF7, 0xDB);         // neg rbx
+            return true;
+        case NEGM:
+            if (!direct)
+                break;
+
+            emit_slot_op(jit, 0xF7, 3, operand);    // neg qword [r13 + operand * 8]
+            jit->known = known == operand ? -1 : known;
+            return true;
+        case INCA:
+            EMIT(0x48, 0xFF, 0xC3);         // inc rbx
+            return true;
+        case DECA:
+            EMIT(0x48, 0xFF, 0xCB);         // dec rbx
+            return true;
+        case INCM:
+            if (!direct)
+                break;
+
+            emit_slot_op(jit, 0xFF, 0, operand);    // inc qword [r13 + operand * 8]
+            jit->known = known == operand ? -1 : known;
+            return true;
+        case DECM:
+            if (!direct)
+                break;
+
+            emit_slot_op(jit, 0xFF, 1, operand);    // dec qword [r13 + operand * 8]
+            jit->known = known == operand ? -1 : known;
+            return true;
+        case LDDA:
+            emit_spill(jit);
+            EMIT(0x49, 0x8B, 0x5C, 0xDD, 0x00);     // mov rbx, [r13 + rbx * 8]
+            return true;
+        case LDDM:
+            if (!direct)
+                break;
+
+            emit_spill(jit);
+            emit_slot_op(jit, 0x8B, RAX, operand);
+            EMIT(0x49, 0x8B, 0x5C, 0xC5, 0x00);     // mov rbx, [r13 + rax * 8]
+            return true;
+        case STDM:
+            if (!direct)
+                break;
+
+            // It could be storing to a promoted slot.
+            emit_spill(jit);
+            emit_slot_op(jit, 0x8B, RAX, operand);
+            EMIT(0x49, 0x89, 0x5C, 0xC5, 0x00);     // mov [r13 + rax * 8], rbx
+            emit_fill(jit);
+            EMIT(0x48, 0xB9);                       // mov rcx, op_count
+            emit64(jit, vm->op_count);
+            EMIT(0x48, 0x39, 0xC8,                  // cmp rax, rcx
+                 0x73, 0x14,                        // jae past the check
+                 0x48, 0xB9);                       // mov rcx, embedded
+            emit64(jit, (u64)(uintptr_t)jit->embedded);
+            EMIT(0x80, 0x3C, 0x01, 0x00);           // cmp byte [rcx + rax], 0
+            emit_jump(jit, JNZ, TO_STALE, address + 1);
+            return true;
+        case CMPI:
+            if (!dynamic) {
+                emit_load_constant(jit, RCX, llabs(operand));
+                emit_compare(jit, true);
+                return true;
+            }
+
+            emit_load_operand(jit, RCX, address);
+            emit_compare(jit, false);
+            return true;
+        case CMPM:
+            if (!direct)
+                break;
+
+            emit_slot_op(jit, 0x8B, RCX, operand);
+            emit_compare(jit, false);
+            return true;
+        case BEQ:
+            emit_flag_branch(jit, FLAG_ZF, JNZ, address);
+            return true;
+        case BNE:
+            emit_flag_branch(jit, FLAG_ZF, JZ, address);
+            return true;
+        case BLT:
+            emit_flag_branch(jit, FLAG_NF, JNZ, address);
+            return true;
+        case BLE:
+            emit_flag_branch(jit, FLAG_NF | FLAG_ZF, JNZ, address);
+            return true;
+        case BGT:
+            emit_flag_branch(jit, FLAG_CF, JNZ, address);
+            return true;
+        case BGE:
+            emit_flag_branch(jit, FLAG_CF | FLAG_ZF, JNZ, address);
+            return true;
+        case BRZ:
+            emit_acc_branch(jit, JZ, address);
+            return true;
+        case BRP:
+            emit_acc_branch(jit, JNS, address);
+            return true;
+        case BRN:
+            emit_acc_branch(jit, JS, address);
+            return true;
+        case BRA:
+        case CSR:
+            if (dynamic) {
+                emit_load_memory(jit, RAX, address);
+                emit_jump(jit, JMP, TO_DISPATCH, 0);
+            } else
+                emit_branch(jit, JMP, operand);
+
+            return true;
+        case BRAA:
+            EMIT(0x48, 0x89, 0xD8);         // mov rax, rbx
+            emit_jump(jit, JMP, TO_DISPATCH, 0);
+            return true;
+        case PSHA:
+        case PSHI:
+            emit_stack_push(jit, address);
+            jit->known = known;
+            return true;
+        case PSHM:
+            if (!direct)
+                break;
+
+            emit_stack_push(jit, address);
+            jit->known = known;
+            return true;
+        case POPA:
+            emit_stack_pop(jit, address, RBX);
+            return true;
+        case POPM:
+            if (!direct)
+                break;
+
+            emit_stack_pop(jit, address, RAX);
+            emit_slot_op(jit, 0x89, RAX, operand);
+            jit->known = known == operand ? -1 : known;
+            return true;
+        case DRP:
+            EMIT(0x49, 0xFF, 0xCE);         // dec r14
+            jit->known = known;
+            return true;
+        default:
+            break;
+    }
+
+    emit_fallback(jit, address);
+    return false;
+}
+
+static void emit_prologue(Jit *jit) {
+    EMIT(0x53,                      // push rbx
+         0x55,                      // push rbp
+         0x41, 0x54,                // push r12
+         0x41, 0x55,                // push r13
+         0x41, 0x56,                // push r14
+         0x41, 0x57,                // push r15
+         0x48, 0x83, 0xEC, 0x08,    // sub rsp, 8
+         0x49, 0x89, 0xFC,          // mov r12, rdi
+         0x4C, 0x8B, 0xAF);         // mov r13, [rdi + data]
+    emit32(jit, offsetof(VM, data));
+    EMIT(0x4C, 0x8B, 0xBF);         // mov r15, [rdi + stack]
+    emit32(jit, offsetof(VM, stack));
+    EMIT(0x48, 0x8B, 0x9F);         // mov rbx, [rdi + acc]
+    emit32(jit, offsetof(VM, acc));
+    EMIT(0x4C, 0x8B, 0xB7);         // mov r14, [rdi + sp]
+    emit32(jit, offsetof(VM, sp));
+    EMIT(0x48, 0x89, 0xD5,          // mov rbp, rdx
+         0xFF, 0xE6);               // jmp rsi
+}
+
+// Shared tails: coming back from a fallback with the next address
+// in rax, jumping to a computed address in rax, and leaving.
+static void emit_epilogue(Jit *jit) {
+    jit->return_ = jit->len;
+    EMIT(0x48, 0x85, 0xC0);         // test rax, rax
+    emit_jump(jit, JS, TO_EPILOGUE, 0);
+
+    // Traces only ever leave.
+    if (jit->targets != NULL) {
+        jit->dispatch = jit->len;
+        EMIT(0x48, 0x3D);           // cmp rax, count
+        emit32(jit, (uint32_t)jit->count);
+        emit_jump(jit, JAE, TO_EXIT_RAX, 0);
+        EMIT(0x48, 0xB9);           // mov rcx, targets
+        emit64(jit, (u64)(uintptr_t)jit->targets);
+        EMIT(0xFF, 0x24, 0xC1);     // jmp [rcx + rax * 8]
+    }
+
+    jit->exit_rax = jit->len;
+    emit_spill(jit);
+    EMIT(0x49, 0x89, 0x84, 0x24);   // mov [r12 + pc], rax
+    emit32(jit, offsetof(VM, pc));
+
+    jit->epilogue = jit->len;
+    EMIT(0x49, 0x89, 0x9C, 0x24);   // mov [r12 + acc], rbx
+    emit32(jit, offsetof(VM, acc));
+    EMIT(0x4D, 0x89, 0xB4, 0x24);   // mov [r12 + sp], r14
+    emit32(jit, offsetof(VM, sp));
+    EMIT(0x48, 0x89, 0xE8,          // mov rax, rbp
+         0x48, 0x83, 0xC4, 0x08,    // add rsp, 8
+         0x41, 0x5F,                // pop r15
+         0x41, 0x5E,                // pop r14
+         0x41, 0x5D,                // pop r13
+         0x41, 0x5C,                // pop r12
+         0x5D,                      // pop rbp
+         0x5B,                      // pop rbx
+         0xC3);                     // ret
+}
+
+static void patch(Jit *jit, size_t at, size_t target) {
+    const int32_t rel = (int32_t)((i64)target - (i64)(at + 4));
+    memcpy(jit->buffer + at, &rel, 4);
+}
+
+static void resolve_fixups(Jit *jit) {
+    // Exit stubs get emitted as they're needed, so don't cache the count.
+    for (size_t i = 0; i < jit->fixup_count; i++) {
+        const Fixup fixup = jit->fixups[i];
+
+        switch (fixup.kind) {
+            case TO_INSTRUCTION:
+                patch(jit, fixup.at, jit->offsets[fixup.value]);
+                break;
+            case TO_OFFSET:
+                patch(jit, fixup.at, fixup.value);
+                break;
+            case TO_STALE:
+                patch(jit, fixup.at, jit->len);
+                EMIT(0x48, 0xB9);           // mov rcx, &jit->stale
+                emit64(jit, (u64)(uintptr_t)&jit->stale);
+                EMIT(0xC6, 0x01, 0x01);     // mov byte [rcx], 1
+                emit_load_constant(jit, RAX, fixup.value);
+                EMIT(0xE9);
+                emit32(jit, (uint32_t)(int32_t)((i64)jit->exit_rax - (i64)(jit->len + 4)));
+                break;
+            case TO_EXIT:
+                patch(jit, fixup.at, jit->len);
+                emit_load_constant(jit, RAX, fixup.value);
+                EMIT(0xE9);
+                emit32(jit, (uint32_t)(int32_t)((i64)jit->exit_rax - (i64)(jit->len + 4)));
+                break;
+            case TO_RETURN:
+                patch(jit, fixup.at, jit->return_);
+                break;
+            case TO_DISPATCH:
+                patch(jit, fixup.at, jit->dispatch);
+                break;
+            case TO_EXIT_RAX:
+                patch(jit, fixup.at, jit->exit_rax);
+                break;
+            case TO_EPILOGUE:
+                patch(jit, fixup.at, jit->epilogue);
+                break;
+        }
+    }
+}
+
+// Copy what's been emitted somewhere it can run.
+static byte *install(Jit *jit) {
+    byte *code = mmap(NULL, jit->len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (code == MAP_FAILED)
+        return NULL;
+
+    memcpy(code, jit->buffer, jit->len);
+
+    if (mprotect(code, jit->len, PROT_READ | PROT_EXEC) != 0) {
+        munmap(code, jit->len);
+        return NULL;
+    }
+
+    return code;
+}
+
+static byte *compile(Jit *jit, VM *vm) {
+    create_jit(jit, vm);
+    jit->count = vm->op_count;
+    jit->offsets = malloc(jit->count * sizeof(size_t));
+    jit->targets = malloc(jit->count * sizeof(byte *));
+
+    // Operands that get stored to at constant addresses can't be
+    // baked into the code.
+    for (size_t i = 0; i < jit->count; i++) {
+        i64 start;
+        i64 length;
+
+        if (!store_range(vm, i, false, &start, &length))
+            continue;
+
+        for (i64 j = start; j < start + length; j++) {
+            if (j >= 0 && (u64)j < jit->count)
+                jit->dynamic[j] = true;
+        }
+    }
+
+    emit_prologue(jit);
+
+    for (size_t i = 0; i < jit->count; i++) {
+        jit->offsets[i] = jit->len;
+        const Opcode opcode = vm->instructions[i];
+
+        // Anything can jump here, so nothing is known about rbx.
+        jit->known = -1;
+
+        if (translate(jit, i) && opcode != NOP && opcode != DAT && !jit->dynamic[i])
+            jit->embedded[i] = true;
+    }
+
+    // Running off the end of the program.
+    emit_exit(jit, JMP, jit->count);
+    emit_epilogue(jit);
+    resolve_fixups(jit);
+
+    byte *code = install(jit);
+
+    if (code == NULL)
+        return NULL;
+
+    for (size_t i = 0; i < jit->count; i++)
+        jit->targets[i] = code + jit->offsets[i];
+
+    return code;
+}
+
+bool run_jit(VM *vm) {
+    if (vm->pc < 0 || (u64)vm->pc >= vm->op_count || vm->op_count > MAX_DIRECT)
+        return false;
+
+    Jit jit;
+    byte *code = compile(&jit, vm);
+
+    if (code == NULL) {
+        fprintf(stderr, "vm: warning: failed to map memory for the JIT, interpreting instead\n");
+        delete_jit(&jit);
+        return false;
+    }
+
+    // ISO C doesn't allow casting between object and function pointers.
+    union {
+        byte *code;
+        Entry entry;
+    } entry = { .code = code };
+
+    const u64 flags = entry.entry(vm, jit.targets[vm->pc], pack_flags(vm));
+    unpack_flags(vm, flags);
+
+    if (!vm->running) {
+        vm->mar = vm->pc - 1;
+        vm->cir = vm->instructions[vm->mar];
+        vm->mdr = vm->data[vm->mar];
+    }
+
+    munmap(code, jit.len);
+    delete_jit(&jit);
+    return true;
+}
+
+// Tracing: the switch engine runs the program and counts how often
+// each backward branch target (and each place a trace was left at) is
+// reached. Once one gets hot, the path taken from it is recorded
+// until it comes back around, or reaches another trace, and compiled
+// as a straight line with guards that leave wherever the program
+// would have gone elsewhere.
+//
+// Being a single path lets traces do a bit more than the templates:
+//   - Compares leave their result in rbp and branches test its sign,
+//     the flags are only worked out when leaving.
+//   - Loads of a slot that rbx already holds are dropped.
+//
+// Traces share the map of embedded operands, and any store into one
+// throws every trace away, checked by the compiled stores through
+// pointers, the fallbacks, and before every interpreted instruction.
+
+#define HOT_LOOP 64
+#define MAX_TRACE 256
+
+// How long a place that failed to record waits before trying again.
+#define BACKOFF (HOT_LOOP * 16)
+
+// After this many flushes the program is treated as self-modifying
+// and the goto engine runs the rest of it.
+#define MAX_FLUSHES 8
+
+typedef struct {
+    byte *code;
+    size_t len;
+    const byte *body;
+    bool uses_flags;
+} Trace;
+
+typedef struct {
+    Jit jit;
+    Trace **traces;
+    int32_t *counters;
+    size_t flushes;
+
+    bool recording;
+    size_t start;
+    size_t length;
+    size_t addresses[MAX_TRACE];
+    i64 operands[MAX_TRACE];
+} Tracer;
+
+static bool is_branch(Opcode opcode) {
+    switch (opcode) {
+        case BRA:
+        case CSR:
+        case BRAA:
+        case BRZ:
+        case BRP:
+        case BRN:
+        case BEQ:
+        case BNE:
+        case BLT:
+        case BLE:
+        case BGT:
+        case BGE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Instructions that address a slot of data[] through their operand,
+// which can as well be a register.
+static bool uses_slot(Opcode opcode) {
+    switch (opcode) {
+        case LDM:
+        case STM:
+        case ADDM:
+        case SUBM:
+        case ANDM:
+        case ORM:
+        case XORM:
+        case MULM:
+        case DIVM:
+        case MODM:
+        case SHLM:
+        case SHRM:
+        case NEGM:
+        case INCM:
+        case DECM:
+        case CMPM:
+        case PSHM:
+        case POPM:
+        case LDDM:
+        case STDM:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Whether the instruction at address can continue at next.
+static bool follows(VM *vm, size_t address, size_t next) {
+    const i64 target = vm->data[address];
+
+    switch (vm->instructions[address]) {
+        case BRA:
+        case CSR:
+            return (i64)next == target;
+        case BRAA:
+            return true;
+        case BRZ:
+        case BRP:
+        case BRN:
+        case BEQ:
+        case BNE:
+        case BLT:
+        case BLE:
+        case BGT:
+        case BGE:
+            return (i64)next == target || next == address + 1;
+        default:
+            return next == address + 1;
+    }
+}
+
+// Leave the trace if the branch at address wouldn't go to next.
+static void emit_guard(Jit *jit, size_t address, size_t next) {
+    const i64 target = jit->vm->data[address];
+    byte condition;
+
+    switch (jit->vm->instructions[address]) {
+        case BRA:
+        case CSR:
+            return;
+        case BRAA:
+            EMIT(0x48, 0x81, 0xFB);         // cmp rbx, next
+            emit32(jit, (uint32_t)next);
+            EMIT(0x48, 0x89, 0xD8);         // mov rax, rbx
+            emit_jump(jit, JNZ, TO_EXIT_RAX, 0);
+            return;
+        case BRZ: condition = JZ; goto accumulator;
+        case BRP: condition = JNS; goto accumulator;
+        case BRN: condition = JS; goto accumulator;
+        accumulator:
+            if (target == (i64)address + 1)
+                return;
+
+            EMIT(0x48, 0x85, 0xDB);         // test rbx, rbx
+            break;
+        case BEQ: condition = JZ; goto flags;
+        case BNE: condition = JNZ; goto flags;
+        case BLT: condition = JL; goto flags;
+        case BLE: condition = JLE; goto flags;
+        case BGT: condition = JG; goto flags;
+        case BGE: condition = JGE; goto flags;
+        flags:
+            if (target == (i64)address + 1)
+                return;
+
+            EMIT(0x48, 0x85, 0xED);         // test rbp, rbp
+            break;
+        default:
+            return;
+    }
+
+    if ((i64)next == target)
+        emit_exit(jit, condition ^ 1, address + 1);
+    else
+        emit_exit(jit, condition, target);
+}
+
+// Pick the slots used most by the trace to keep in registers. Slots
+// holding operands of the trace are left alone, they're read from
+// memory at runtime.
+static void promote(Tracer *tracer) {
+    Jit *jit = &tracer->jit;
+    VM *vm = jit->vm;
+    i64 slots[MAX_TRACE];
+    size_t uses[MAX_TRACE];
+    size_t count = 0;
+
+    for (size_t i = 0; i < tracer->length; i++) {
+        const size_t address = tracer->addresses[i];
+        const i64 slot = vm->data[address];
+        bool operand = false;
+
+        if (!uses_slot(vm->instructions[address]) || jit->dynamic[address] || !addressable(vm, slot))
+            continue;
+
+        for (size_t j = 0; j < tracer->length && !operand; j++)
+            operand = (i64)tracer->addresses[j] == slot;
+
+        if (operand)
+            continue;
+
+        size_t j = 0;
+
+        while (j < count && slots[j] != slot)
+            j++;
+
+        if (j == count) {
+            slots[count] = slot;
+            uses[count++] = 0;
+        }
+
+        uses[j]++;
+    }
+
+    jit->promoted_count = 0;
+
+    while (jit->promoted_count < MAX_PROMOTED && count > 0) {
+        size_t best = 0;
+
+        for (size_t i = 1; i < count; i++) {
+            if (uses[i] > uses[best])
+                best = i;
+        }
+
+        jit->promoted[jit->promoted_count++] = slots[best];
+        slots[best] = slots[--count];
+        uses[best] = uses[count];
+    }
+}
+
+static Trace *compile_trace(Tracer *tracer, size_t end) {
+    Jit *jit = &tracer->jit;
+    VM *vm = jit->vm;
+    bool stores[MAX_TRACE];
+    bool native[MAX_TRACE];
+
+    // The recording has to still be what's in memory, and the trace
+    // can't store into operands that other traces have baked in.
+    for (size_t i = 0; i < tracer->length; i++) {
+        const size_t address = tracer->addresses[i];
+        const size_t next = i + 1 < tracer->length ? tracer->addresses[i + 1] : end;
+        i64 start;
+        i64 length;
+
+        if (vm->data[address] != tracer->operands[i] || !follows(vm, address, next))
+            return NULL;
+
+        stores[i] = store_range(vm, address, false, &start, &length);
+
+        for (i64 j = start; stores[i] && j < start + length; j++) {
+            if (j >= 0 && (u64)j < vm->op_count && jit->embedded[j])
+                return NULL;
+        }
+    }
+
+    for (size_t i = 0; i < tracer->length; i++) {
+        i64 start;
+        i64 length;
+
+        if (!stores[i])
+            continue;
+
+        store_range(vm, tracer->addresses[i], false, &start, &length);
+
+        for (i64 j = start; j < start + length; j++) {
+            if (j >= 0 && (u64)j < vm->op_count)
+                jit->dynamic[j] = true;
+        }
+    }
+
+    // The guards compare against branch targets, those have to stay put.
+    for (size_t i = 0; i < tracer->length; i++) {
+        const size_t address = tracer->addresses[i];
+
+        if (is_branch(vm->instructions[address]) && jit->dynamic[address])
+            return NULL;
+    }
+
+    promote(tracer);
+
+    Trace *trace = malloc(sizeof(Trace));
+    trace->uses_flags = false;
+
+    jit->len = 0;
+    jit->fixup_count = 0;
+    jit->known = -1;
+    emit_prologue(jit);
+    const size_t body = jit->len;
+    emit_fill(jit);
+    const size_t loop = jit->len;
+
+    for (size_t i = 0; i < tracer->length; i++) {
+        const size_t address = tracer->addresses[i];
+        const size_t next = i + 1 < tracer->length ? tracer->addresses[i + 1] : end;
+        const Opcode opcode = vm->instructions[address];
+
+        if (is_branch(opcode)) {
+            emit_guard(jit, address, next);
+            native[i] = true;
+            trace->uses_flags = trace->uses_flags || (opcode >= BEQ && opcode <= BGE);
+        } else {
+            native[i] = translate(jit, address);
+            trace->uses_flags = trace->uses_flags || !native[i] || opcode == CMPI || opcode == CMPM;
+        }
+    }
+
+    // Going around again, or on to wherever the recording stopped.
+    if (end == tracer->start)
+        emit_jump(jit, JMP, TO_OFFSET, loop);
+    else
+        emit_exit(jit, JMP, end);
+
+    emit_epilogue(jit);
+    resolve_fixups(jit);
+
+    trace->code = install(jit);
+
+    if (trace->code == NULL) {
+        free(trace);
+        return NULL;
+    }
+
+    trace->len = jit->len;
+    trace->body = trace->code + body;
+
+    for (size_t i = 0; i < tracer->length; i++) {
+        const size_t address = tracer->addresses[i];
+        const Opcode opcode = vm->instructions[address];
+
+        if (native[i] && opcode != NOP && opcode != DAT && opcode != BRAA && !jit->dynamic[address])
+            jit->embedded[address] = true;
+    }
+
+    return trace;
+}
+
+static void flush(Tracer *tracer) {
+    const size_t count = tracer->jit.vm->op_count;
+
+    for (size_t i = 0; i < count; i++) {
+        Trace *trace = tracer->traces[i];
+
+        if (trace == NULL)
+            continue;
+
+        munmap(trace->code, trace->len);
+        free(trace);
+        tracer->traces[i] = NULL;
+    }
+
+    memset(tracer->jit.dynamic, 0, count * sizeof(bool));
+    memset(tracer->jit.embedded, 0, count * sizeof(bool));
+    memset(tracer->counters, 0, count * sizeof(int32_t));
+    tracer->jit.stale = false;
+    tracer->recording = false;
+    tracer->flushes++;
+}
+
+// Count one more arrival at pc, and start recording there once it's hot.
+static void heat(Tracer *tracer, i64 pc) {
+    if (tracer->recording || pc < 0 || (u64)pc >= tracer->jit.vm->op_count || tracer->traces[pc] != NULL)
+        return;
+
+    if (++tracer->counters[pc] < HOT_LOOP)
+        return;
+
+    tracer->counters[pc] = 0;
+    tracer->recording = true;
+    tracer->start = pc;
+    tracer->length = 0;
+}
+
+static void stop_recording(Tracer *tracer, Trace *trace) {
+    tracer->recording = false;
+
+    if (trace != NULL)
+        tracer->traces[tracer->start] = trace;
+    else
+        tracer->counters[tracer->start] = -BACKOFF;
+}
+
+// Called before every instruction while recording, pc is the one
+// about to run.
+static void record(Tracer *tracer, i64 pc) {
+    if (pc < 0 || (u64)pc >= tracer->jit.vm->op_count || tracer->length == MAX_TRACE) {
+        stop_recording(tracer, NULL);
+        return;
+    }
+
+    if (((u64)pc == tracer->start && tracer->length > 0) || tracer->traces[pc] != NULL) {
+        stop_recording(tracer, compile_trace(tracer, pc));
+        return;
+    }
+
+    tracer->addresses[tracer->length] = pc;
+    tracer->operands[tracer->length] = tracer->jit.vm->data[pc];
+    tracer->length++;
+}
+
+// Run one instruction in the switch engine.
+static void step(Tracer *tracer, i64 pc) {
+    VM *vm = tracer->jit.vm;
+    const bool stale = pc >= 0 && (u64)pc < vm->op_count && hits_embedded(&tracer->jit, pc);
+
+    cycle_vm(vm);
+
+    if (stale)
+        flush(tracer);
+    else if (vm->running && vm->pc <= pc)
+        heat(tracer, vm->pc);
+}
+
+static void enter(Tracer *tracer, Trace *trace) {
+    VM *vm = tracer->jit.vm;
+
+    // ISO C doesn't allow casting between object and function pointers.
+    union {
+        byte *code;
+        Entry entry;
+    } entry = { .code = trace->code };
+
+    const u64 flags = trace->uses_flags ? (u64)flag_value(pack_flags(vm)) : 0;
+    const u64 value = entry.entry(vm, trace->body, flags);
+
+    if (trace->uses_flags)
+        unpack_flags(vm, value_flags((i64)value));
+}
+
+bool run_trace(VM *vm) {
+    if (vm->op_count > MAX_DIRECT)
+        return false;
+
+    Tracer tracer;
+    create_jit(&tracer.jit, vm);
+    tracer.jit.values = true;
+    tracer.traces = calloc(vm->op_count, sizeof(Trace *));
+    tracer.counters = calloc(vm->op_count, sizeof(int32_t));
+    tracer.flushes = 0;
+    tracer.recording = false;
+
+    while (vm->running && tracer.flushes <= MAX_FLUSHES) {
+        const i64 pc = vm->pc;
+
+        if (tracer.recording)
+            record(&tracer, pc);
+
+        Trace *trace = pc >= 0 && (u64)pc < vm->op_count ? tracer.traces[pc] : NULL;
+
+        // Traces that use the flags need them to have been set,
+        // the value in rbp can't say that none are.
+        if (tracer.recording || trace == NULL || (trace->uses_flags && pack_flags(vm) == 0)) {
+            step(&tracer, pc);
+            continue;
+        }
+
+        enter(&tracer, trace);
+
+        if (tracer.jit.stale)
+            flush(&tracer);
+        else if (vm->pc == pc) {
+            // It left before doing anything, to let the
+            // interpreter report a stack error.
+            step(&tracer, pc);
+        } else
+            heat(&tracer, vm->pc);
+    }
+
+    tracer.flushes = 0;
+    flush(&tracer);
+    free(tracer.traces);
+    free(tracer.counters);
+    delete_jit(&tracer.jit);
+    return true;
+}
+
+#else
+
+// No JIT for this platform, always interpret.
+bool run_jit(VM *vm) {
+    (void)vm;
+    return false;
+}
+
+bool run_trace(VM *vm) {
+    (void)vm;
+    return false;
+}
+
+#endif
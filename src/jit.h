@@ -0,0 +1,10 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include "vm.h"
+#include <stdbool.h>
+
+bool run_jit(VM *vm);
+bool run_trace(VM *vm);
+
+#endif
@@ -1,3 +1,6 @@
+// Needed for mmap() and friends with -std=c11.
+#define _DEFAULT_SOURCE
+
 #include "lexer.h"
 #include "token.h"
 #include "utils.h"
@@ -11,45 +14,101 @@
 #include <inttypes.h>
 #include <errno.h>
 
-Lexer create_lexer(char *file) {
-    FILE *f = fopen(file, "r");
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Numbers are copied without their underscores to convert them,
+// anything longer than this is out of range anyway.
+#define MAX_NUMBER_LEN 80
+
+// Files that can't be read lex as empty, with the error counted.
+static Lexer failed_lexer(char *file, FILE *diag, Arena *arena) {
+    return (Lexer){ .file = file, .src = NULL, .src_len = 0, .mapped = false, .cur = '\0', .pos = 0, .ln = 1, .col = 1, .diag = diag, .arena = arena, .errors = 1 };
+}
+
+// Pipes and such can't be mapped, so they're read instead.
+static bool read_source(int fd, char **src, size_t *src_len) {
+    size_t cap = 4096;
+    size_t len = 0;
+    char *buffer = malloc(cap);
+
+    while (true) {
+        if (len == cap) {
+            cap *= 2;
+            buffer = realloc(buffer, cap);
+        }
+
+        const ssize_t n = read(fd, buffer + len, cap - len);
 
-    if (f == NULL) {
-        fprintf(stderr, "%s: error: no such file exists\n", file);
-        exit(1);
+        if (n == 0)
+            break;
+        else if (n < 0 && errno != EINTR) {
+            free(buffer);
+            return false;
+        } else if (n > 0)
+            len += n;
     }
 
-    fseek(f, 0, SEEK_END);
-    size_t file_size = ftell(f);
-    rewind(f);
+    *src = buffer;
+    *src_len = len;
+    return true;
+}
 
-    char *src = malloc(file_size + 1);
-    size_t read_size = fread(src, 1, file_size, f);
-    fclose(f);
+Lexer create_lexer(char *file, FILE *diag, Arena *arena) {
+    const int fd = open(file, O_RDONLY);
 
-    if (file_size != read_size) {
-        fprintf(stderr, "%s: error: failed to read file\n", file);
-        free(src);
-        exit(1);
+    if (fd < 0) {
+        fprintf(diag, "%s: error: no such file exists\n", file);
+        return failed_lexer(file, diag, arena);
     }
 
-    src[read_size] = '\0';
+    struct stat st;
+    char *src = MAP_FAILED;
+    size_t src_len = 0;
+    bool mapped = false;
+
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        src_len = st.st_size;
+        src = mmap(NULL, src_len, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+
+    if (src != MAP_FAILED) {
+        madvise(src, src_len, MADV_SEQUENTIAL);
+        mapped = true;
+    } else if (!read_source(fd, &src, &src_len)) {
+        fprintf(diag, "%s: error: failed to read file\n", file);
+        close(fd);
+        return failed_lexer(file, diag, arena);
+    }
+
+    close(fd);
 
     return (Lexer){ 
         .file = file,
         .src = src, 
-        .src_len = read_size,
-        .cur = src[0],
+        .src_len = src_len,
+        .mapped = mapped,
+        .cur = src_len > 0 ? src[0] : '\0',
         .pos = 0, 
         .ln = 1, 
-        .col = 1 
+        .col = 1,
+        .diag = diag,
+        .arena = arena,
+        .errors = 0
     };
 }
 
 void delete_lexer(Lexer *lex) {
-    free(lex->src);
+    if (lex->mapped)
+        munmap(lex->src, lex->src_len);
+    else
+        free(lex->src);
 }
 
+// There's no terminator past the end of a mapped file, so
+// it's made up here.
 static void step(Lexer *lex) {
     if (lex->pos >= lex->src_len)
         return;
@@ -59,11 +118,13 @@ static void step(Lexer *lex) {
     } else
         lex->col++;
     
-    lex->cur = lex->src[++lex->pos];
+    lex->cur = ++lex->pos < lex->src_len ? lex->src[lex->pos] : '\0';
 }
 
 static char peek(Lexer *lex, int offset) {
-    if (lex->pos + offset >= lex->src_len)
+    if (lex->src_len == 0)
+        return '\0';
+    else if (lex->pos + offset >= lex->src_len)
         return lex->src[lex->src_len - 1];
     else if ((int)lex->pos + offset < 1)
         return lex->src[0];
@@ -71,17 +132,22 @@ static char peek(Lexer *lex, int offset) {
     return lex->src[lex->pos + offset];
 }
 
-static Token create_and_step(Lexer *lex, TokenType type, char *value) {
-    Token tok = create_token(type, mystrdup(value), lex->ln, lex->col);
-
-    while (*value) {
-        step(lex);
-        value++;
-    }
+// Tokens from here to wherever the lexer is now.
+static Token token_from(Lexer *lex, TokenType type, size_t start, size_t ln, size_t col) {
+    return create_token(type, lex->src + start, lex->pos - start, ln, col);
+}
 
+// Single character tokens.
+static Token create_and_step(Lexer *lex, TokenType type) {
+    Token tok = create_token(type, lex->src + lex->pos, 1, lex->ln, lex->col);
+    step(lex);
     return tok;
 }
 
+static Token eof_token(Lexer *lex) {
+    return create_token(TOK_EOF, "eof", 3, lex->ln, lex->col);
+}
+
 static Token skip_comment(Lexer *lex) {
     step(lex);
 
@@ -89,46 +155,69 @@ static Token skip_comment(Lexer *lex) {
         step(lex);
 
     if (lex->cur == '\n')
-        return create_and_step(lex, TOK_EOL, "\n");
+        return create_and_step(lex, TOK_EOL);
 
-    return create_token(TOK_EOF, mystrdup("eof"), lex->ln, lex->col);
+    return eof_token(lex);
 }
 
 static Token lex_id(Lexer *lex) {
-    size_t col = lex->col;
-    size_t realloc_size = 16;
-    char *value = malloc(realloc_size);
-    size_t len = 0;
-
-    while (isalnum(lex->cur) || lex->cur == '_' || lex->cur == '@') {
-        if (len + 2 >= realloc_size) {
-            realloc_size *= 2;
-            value = realloc(value, realloc_size);
-        }
+    const size_t start = lex->pos;
+    const size_t col = lex->col;
 
-        value[len++] = tolower(lex->cur);
+    while (isalnum(lex->cur) || lex->cur == '_' || lex->cur == '@')
         step(lex);
-    }
 
-    value[len] = '\0';
-    return create_token(TOK_ID, value, lex->ln, col);
+    return token_from(lex, TOK_ID, start, lex->ln, col);
+}
+
+// Reports a number that didn't convert, it comes out as 0.
+static Token digit_conversion_failed(Lexer *lex, Token tok, int err, size_t col) {
+    if (err == 0)
+        fprintf(lex->diag, "%s:%zu:%zu: error: digit conversion failed\n", lex->file, lex->ln, col);
+    else
+        fprintf(lex->diag, "%s:%zu:%zu: error: digit conversion failed: %s\n", lex->file, lex->ln, col, strerror(err));
+
+    lex->errors++;
+    tok.number = 0;
+    return tok;
 }
 
-static Token lex_prefixed_digit(Lexer *lex, size_t col, bool has_minus) {
-    size_t realloc_size = 16;
-    char *value = malloc(realloc_size);
+// Prefixed and suffixed numbers wrap around to 32 bits.
+static Token convert_radix(Lexer *lex, Token tok, const char *digits, bool too_long, int radix) {
+    const bool negative = digits[0] == '-';
+    char *endptr;
+    errno = 0;
+    int64_t val;
+
+    if (negative)
+        val = strtol(digits, &endptr, radix);
+    else
+        val = strtoul(digits, &endptr, radix);
+
+    if (endptr == digits || *endptr != '\0')
+        return digit_conversion_failed(lex, tok, 0, lex->col);
+    else if (errno == EINVAL || errno == ERANGE || too_long)
+        return digit_conversion_failed(lex, tok, too_long ? ERANGE : errno, lex->col);
+
+    tok.number = negative ? (int64_t)(int32_t)val : (int64_t)(uint32_t)val;
+    return tok;
+}
+
+static Token lex_prefixed_digit(Lexer *lex, size_t start, size_t col, bool has_minus) {
+    char digits[MAX_NUMBER_LEN + 1];
     size_t len = 0;
+    bool too_long = false;
 
     if (has_minus)
-        value[len++] = '-';
+        digits[len++] = '-';
 
-    value[len++] = '0';
+    digits[len++] = '0';
     step(lex);
 
     bool is_hex = false;
 
     if (lex->cur == 'x') {
-        value[len++] = 'x';
+        digits[len++] = 'x';
         step(lex);
         is_hex = true;
     }
@@ -137,67 +226,36 @@ static Token lex_prefixed_digit(Lexer *lex, size_t col, bool has_minus) {
             (isalpha(lex->cur) && (tolower(lex->cur) >= 'a' || tolower(lex->cur <= 'z'))))) ||
             (!is_hex && isdigit(lex->cur) && lex->cur >= '0' && lex->cur <= '7')) {
 
-        if (len + 2 >= realloc_size) {
-            realloc_size *= 2;
-            value = realloc(value, realloc_size);
-        }
+        if (len < MAX_NUMBER_LEN)
+            digits[len++] = lex->cur;
+        else
+            too_long = true;
 
-        value[len++] = lex->cur;
         step(lex);
     }
 
-    value[len] = '\0';
-
-    int64_t val;
-    char *endptr;
-    errno = 0;
-
-    if (has_minus)
-        val = strtol(value, &endptr, is_hex ? 0 : 8);
-    else
-        val = strtoul(value, &endptr, is_hex ? 0 : 8);
-
-    if (endptr == value || *endptr != '\0') {
-        fprintf(stderr, "%s:%zu:%zu: error: digit conversion failed\n", lex->file, lex->ln, lex->col);
-        inc_errors();
-        strcpy(value, "0");
-        return create_token(TOK_INT, value, lex->ln, lex->col);
-    } else if (errno == EINVAL || errno == ERANGE) {
-        fprintf(stderr, "%s:%zu:%zu: error: digit conversion failed: %s\n", lex->file, lex->ln, lex->col, strerror(errno));
-        inc_errors();
-        strcpy(value, "0");
-        return create_token(TOK_INT, value, lex->ln, lex->col);
-    }
-
-    value = realloc(value, 32);
-
-    if (has_minus)
-        sprintf(value, "%" PRId32, (int32_t)val);
-    else
-        sprintf(value, "%" PRIu32, (uint32_t)val);
-
-    return create_token(TOK_INT, value, lex->ln, col);
+    digits[len] = '\0';
+    return convert_radix(lex, token_from(lex, TOK_INT, start, lex->ln, col), digits, too_long, is_hex ? 0 : 8);
 }
 
 static Token lex_digit(Lexer *lex) {
-    size_t col = lex->col;
-    size_t realloc_size = 16;
-    char *value = malloc(realloc_size);
+    const size_t start = lex->pos;
+    const size_t col = lex->col;
+    char digits[MAX_NUMBER_LEN + 1];
     size_t len = 0;
+    bool too_long = false;
 
     bool has_decimal = false;
     bool has_minus = false;
 
     if (lex->cur == '-') {
         has_minus = true;
-        value[len++] = '-';
+        digits[len++] = '-';
         step(lex);
     }
 
-    if (lex->cur == '0' && (peek(lex, 1) == 'x' || isdigit(peek(lex, 1)))) {
-        free(value);
-        return lex_prefixed_digit(lex, col, has_minus);
-    }
+    if (lex->cur == '0' && (peek(lex, 1) == 'x' || isdigit(peek(lex, 1))))
+        return lex_prefixed_digit(lex, start, col, has_minus);
 
     while (isdigit(lex->cur) || (lex->cur == '.' && len > 0 && !has_decimal && isdigit(peek(lex, 1))) ||
             (lex->cur == '_' && isdigit(peek(lex, 1)))) {
@@ -209,73 +267,50 @@ static Token lex_digit(Lexer *lex) {
             continue;
         }
 
-        if (len + 2 >= realloc_size) {
-            realloc_size *= 2;
-            value = realloc(value, realloc_size);
-        }
+        if (len < MAX_NUMBER_LEN)
+            digits[len++] = lex->cur;
+        else
+            too_long = true;
 
-        value[len++] = lex->cur;
         step(lex);
     }
 
-    value[len] = '\0';
+    digits[len] = '\0';
 
+    // Nothing takes floats, so they're left as they are.
     if (lex->cur == 'f') {
         step(lex);
-
-        if (!has_decimal) {
-            value = realloc(value, len + 3);
-            strcat(value, ".0");
-        }
-
-        return create_token(TOK_FLOAT, value, lex->ln, col);
-    } else if (!has_decimal && (lex->cur == 'h' || lex->cur == 'o' || lex->cur == 'b')) {
+        return token_from(lex, TOK_FLOAT, start, lex->ln, col);
+    } else if (has_decimal)
+        return token_from(lex, TOK_FLOAT, start, lex->ln, col);
+    else if (lex->cur == 'h' || lex->cur == 'o' || lex->cur == 'b') {
         int radix;
 
         if (lex->cur == 'h')
             radix = 16;
         else if (lex->cur == 'o')
             radix = 8;
-        else if (lex->cur == 'b')
+        else
             radix = 2;
 
         step(lex);
+        return convert_radix(lex, token_from(lex, TOK_INT, start, lex->ln, col), digits, too_long, radix);
+    }
 
-        char *endptr;
-        errno = 0;
-        int64_t val;
-
-        if (value[0] == '-')
-            val = strtol(value, &endptr, radix);
-        else
-            val = strtoul(value, &endptr, radix);
-
-        if (endptr == value || *endptr != '\0') {
-            fprintf(stderr, "%s:%zu:%zu: error: digit conversion failed\n", lex->file, lex->ln, lex->col);
-            inc_errors();
-            strcpy(value, "0");
-            return create_token(TOK_INT, value, lex->ln, lex->col);
-        } else if (errno == EINVAL || errno == ERANGE) {
-            fprintf(stderr, "%s:%zu:%zu: error: digit conversion failed: %s\n", lex->file, lex->ln, lex->col, strerror(errno));
-            inc_errors();
-            strcpy(value, "0");
-            return create_token(TOK_INT, value, lex->ln, lex->col);
-        }
-
-        value = realloc(value, 32);
+    Token tok = token_from(lex, TOK_INT, start, lex->ln, col);
+    errno = 0;
+    tok.number = strtoll(digits, NULL, 10);
 
-        if (value[0] == '-')
-            sprintf(value, "%" PRId32, (int32_t)val);
-        else
-            sprintf(value, "%" PRIu32, (uint32_t)val);
-    }
+    if (errno == ERANGE || too_long)
+        return digit_conversion_failed(lex, tok, ERANGE, col);
 
-    return create_token(has_decimal ? TOK_FLOAT : TOK_INT, value, lex->ln, col);
+    return tok;
 }
 
 static Token lex_char(Lexer *lex) {
-    size_t col = lex->col;
-    char *value = malloc(16);
+    const size_t start = lex->pos;
+    const size_t col = lex->col;
+    int value = 0;
     step(lex);
 
     if (lex->cur == '\\') {
@@ -283,93 +318,65 @@ static Token lex_char(Lexer *lex) {
 
         switch (lex->cur) {
             case 'n':
-                strcpy(value, "10");
+                value = 10;
                 break;
             case 't':
-                strcpy(value, "9");
+                value = 9;
                 break;
             case 'r':
-                strcpy(value, "13");
+                value = 13;
                 break;
             case '0':
-                strcpy(value, "0");
+                value = 0;
                 break;
             case '\'':
             case '"':
             case '\\':
-                sprintf(value, "%d", (int)lex->cur);
+                value = (int)lex->cur;
                 break;
             default:
-                fprintf(stderr, "%s:%zu:%zu: unsupported escape sequence '\\%c'\n", lex->file, lex->ln, lex->col, lex->cur);
-                inc_errors();
-                value[0] = '\0';
+                fprintf(lex->diag, "%s:%zu:%zu: unsupported escape sequence '\\%c'\n", lex->file, lex->ln, lex->col, lex->cur);
+                lex->errors++;
                 break;
         }
     } else
-        sprintf(value, "%d", (int)lex->cur);
+        value = (int)lex->cur;
 
-    char *endptr;
-    errno = 0;
-    int32_t val = strtol(value, &endptr, 10);
-
-    if (endptr == value || *endptr != '\0') {
-        fprintf(stderr, "%s:%zu:%zu: error: digit conversion failed\n", lex->file, lex->ln, lex->col);
-        val = 0;
-    } else if (errno == ERANGE || errno == EINVAL) {
-        fprintf(stderr, "%s:%zu:%zu: error: digit conversion failed: %s\n", lex->file, lex->ln, lex->col, strerror(errno));
-        val = 0;
-    }
-
-    sprintf(value, "%" PRId32, val);
     step(lex);
 
     if (lex->cur != '\'') {
-        fprintf(stderr, "%s:%zu:%zu: error: unclosed character constant\n", lex->file, lex->ln, lex->col);
-        inc_errors();
+        fprintf(lex->diag, "%s:%zu:%zu: error: unclosed character constant\n", lex->file, lex->ln, lex->col);
+        lex->errors++;
     } else
         step(lex);
 
-    return (Token){ .type = TOK_INT, .value = value, .ln = lex->ln, .col = col };
+    Token tok = token_from(lex, TOK_INT, start, lex->ln, col);
+    tok.number = value;
+    return tok;
 }
 
+// Escapes are left for the parser, the token is just what's
+// between the quotes. Strings next to each other are joined
+// together, which is the only time it's copied.
 static Token lex_string(Lexer *lex) {
-    size_t ln = lex->ln;
-    size_t col = lex->col;
-
-    size_t realloc_size = 16;
-    char *value = malloc(realloc_size);
-    size_t len = 0;
+    const size_t ln = lex->ln;
+    const size_t col = lex->col;
     step(lex);
 
-    while (lex->cur != '\0' && lex->cur != '"') {
-        if (len + 2 >= realloc_size) {
-            realloc_size *= 2;
-            value = realloc(value, realloc_size);
-        }
-
-        value[len++] = lex->cur;
+    const size_t start = lex->pos;
 
-        // Ehhhh I don't really like repeating myself here,
-        // but trying to catch a \" in the while condition
-        // gets a bit confusing.
-        if (lex->cur == '\\' && peek(lex, 1) == '"') {
-            if (len + 2 >= realloc_size) {
-                realloc_size *= 2;
-                value = realloc(value, realloc_size);
-            }
-
-            value[len++] = lex->cur;
+    while (lex->cur != '\0' && lex->cur != '"') {
+        if (lex->cur == '\\' && peek(lex, 1) == '"')
             step(lex);
-        }
 
         step(lex);
     }
-    
-    value[len] = '\0';
+
+    Token tok = token_from(lex, TOK_STRING, start, ln, col);
 
     if (lex->cur != '"') {
-        fprintf(stderr, "%s:%zu:%zu: error: unclosed string literal\n", lex->file, ln, col);
-        inc_errors();
+        fprintf(lex->diag, "%s:%zu:%zu: error: unclosed string literal\n", lex->file, ln, col);
+        lex->errors++;
     } else
         step(lex);
 
@@ -379,16 +386,20 @@ static Token lex_string(Lexer *lex) {
 
     while (lex->cur == '"') {
         Token next = lex_string(lex);
+        char *value = arena_alloc(lex->arena, tok.len + next.len + 1);
+
+        memcpy(value, tok.value, tok.len);
+        memcpy(value + tok.len, next.value, next.len);
+        value[tok.len + next.len] = '\0';
 
-        value = realloc(value, (strlen(value) + strlen(next.value) + 1) * sizeof(char));
-        strcat(value, next.value);
-        free(next.value);
+        tok.value = value;
+        tok.len += next.len;
 
         while (isspace(lex->cur))
             step(lex);
     }
 
-    return (Token){ .type = TOK_STRING, .value = value, .ln = ln, .col = col };
+    return tok;
 }
 
 Token lex_next_token(Lexer *lex) {
@@ -396,7 +407,7 @@ Token lex_next_token(Lexer *lex) {
         step(lex);
 
     if (lex->cur == '\n')
-        return create_and_step(lex, TOK_EOL, "\n");
+        return create_and_step(lex, TOK_EOL);
     else if (lex->cur == ';')
         return skip_comment(lex);
     else if (isalpha(lex->cur) || lex->cur == '_')
@@ -409,15 +420,15 @@ Token lex_next_token(Lexer *lex) {
         return lex_string(lex);
 
     switch (lex->cur) {
-        case '\0': return create_token(TOK_EOF, mystrdup("eof"), lex->ln, lex->col);
-        case ':': return create_and_step(lex, TOK_COLON, ":");
-        case '.': return create_and_step(lex, TOK_DOT, ".");
-        case '^': return create_and_step(lex, TOK_TOS, "^");
+        case '\0': return eof_token(lex);
+        case ':': return create_and_step(lex, TOK_COLON);
+        case '.': return create_and_step(lex, TOK_DOT);
+        case '^': return create_and_step(lex, TOK_TOS);
         default: break;
     }
 
-    fprintf(stderr, "%s:%zu:%zu: error: unknown token '%c'\n", lex->file, lex->ln, lex->col, lex->cur);
-    inc_errors();
+    fprintf(lex->diag, "%s:%zu:%zu: error: unknown token '%c'\n", lex->file, lex->ln, lex->col, lex->cur);
+    lex->errors++;
     step(lex);
     return lex_next_token(lex);
-}
\ No newline at end of file
+}
@@ -3,18 +3,28 @@
 
 #include "token.h"
 #include <stdio.h>
+#include <stdbool.h>
 
 typedef struct {
     char *file;
+
+    // Mapped from the file when it can be, tokens point into it.
     char *src;
     size_t src_len;
+    bool mapped;
+
     char cur;
     size_t pos;
     size_t ln;
     size_t col;
+
+    // Where errors are reported.
+    FILE *diag;
+    Arena *arena;
+    size_t errors;
 } Lexer;
 
-Lexer create_lexer(char *file);
+Lexer create_lexer(char *file, FILE *diag, Arena *arena);
 void delete_lexer(Lexer *lex);
 Token lex_next_token(Lexer *lex);
 
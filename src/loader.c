@@ -1,28 +1,207 @@
+// Needed for pread(), fdopen() and mmap() with -std=c11.
+#define _DEFAULT_SOURCE
+
 #include "loader.h"
+#include "bytecode.h"
+#include "scanner.h"
 #include "vm.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <errno.h>
 #include <ctype.h>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #define BUFFER_CAP 65
 
+// Machine code can start with a header of directives, one per
+// line and always in decimal, before the instructions:
+//   .memory <slots>
+//   .stack <slots>
+// Leaves pos at the first instruction, sizes that aren't given
+// are left alone.
+bool parse_header(const char *src, size_t *pos, size_t *memory_cap, size_t *stack_cap) {
+    size_t i = *pos;
+
+    while (isspace(src[i]))
+        i++;
+
+    while (src[i] == '.') {
+        size_t *size;
+        i++;
+
+        if (strncmp(&src[i], "memory", 6) == 0) {
+            size = memory_cap;
+            i += 6;
+        } else if (strncmp(&src[i], "stack", 5) == 0) {
+            size = stack_cap;
+            i += 5;
+        } else
+            return false;
+
+        char buffer[BUFFER_CAP];
+        size_t buffer_size = 0;
+
+        while (src[i] == ' ' || src[i] == '\t')
+            i++;
+
+        while (src[i] != '\0' && !isspace(src[i]) && buffer_size < BUFFER_CAP - 1)
+            buffer[buffer_size++] = src[i++];
+
+        buffer[buffer_size] = '\0';
+
+        if (!size_from_string(buffer, size))
+            return false;
+
+        while (isspace(src[i]))
+            i++;
+    }
+
+    *pos = i;
+    return true;
+}
+
+// Bytecode needs no parsing, just unpacking straight into memory,
+// and images don't even need that. False if it's malformed, after
+// saying why.
+static bool unpack_bytecode(VM *vm, Bytecode *bc, int fd, char *filename) {
+    if (vm->memory_cap == 0)
+        vm->memory_cap = bc->memory_cap;
+
+    if (vm->stack_cap == 0)
+        vm->stack_cap = bc->stack_cap;
+
+    if (!bc->image || !map_image(vm, fd, bc->opcodes_at, bc->operands_at, bc->op_count)) {
+        map_vm(vm);
+
+        Opcode opcode;
+        i64 operand;
+
+        for (u64 i = 0; i < bc->op_count; i++) {
+            if (!next_op(bc, &opcode, &operand)) {
+                fprintf(stderr, "loader: error: invalid instruction %" PRIu64 " in file '%s'\n", i, filename);
+                return false;
+            }
+
+            push_op(vm, opcode, operand);
+        }
+    }
+
+    if (bc->entry >= vm->op_count) {
+        fprintf(stderr, "loader: error: entry point out of the program in file '%s'\n", filename);
+        return false;
+    }
+
+    vm->pc = bc->entry;
+    return true;
+}
+
+// Mapped rather than read, so only the pages that get
+// looked at are ever touched.
+static bool load_bytecode(VM *vm, int fd, char *filename) {
+    struct stat st;
+    void *src;
+
+    if (fstat(fd, &st) != 0 || (src = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        fprintf(stderr, "loader: error: failed to read file '%s'\n", filename);
+        return false;
+    }
+
+    Bytecode bc;
+    bool loaded = open_bytecode(&bc, src, st.st_size);
+
+    if (!loaded)
+        fprintf(stderr, "loader: error: invalid bytecode in file '%s'\n", filename);
+    else
+        loaded = unpack_bytecode(vm, &bc, fd, filename);
+
+    munmap(src, st.st_size);
+    return loaded;
+}
+
+// An address, or the name of a label kept in the file, which only
+// bytecode has. False if it's neither, after saying why.
+bool find_address(char *filename, const char *str, i64 *address) {
+    char *endptr;
+    errno = 0;
+    *address = strtoll(str, &endptr, 10);
+
+    if (endptr != str && *endptr == '\0' && errno == 0 && *address >= 0)
+        return true;
+
+    const int fd = open(filename, O_RDONLY);
+    struct stat st;
+    void *src = MAP_FAILED;
+
+    if (fd < 0 || fstat(fd, &st) != 0 || (src = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        fprintf(stderr, "loader: error: failed to read file '%s'\n", filename);
+
+        if (fd >= 0)
+            close(fd);
+
+        return false;
+    }
+
+    close(fd);
+
+    Bytecode bc;
+    const bool labels = open_bytecode(&bc, src, st.st_size);
+    bool found = false;
+
+    if (labels) {
+        const size_t len = strlen(str);
+        const char *name;
+        size_t name_len;
+
+        for (u64 i = 0; !found && i < bc.symbol_count && next_symbol(&bc, &name, &name_len, address); i++)
+            found = name_len == len && memcmp(name, str, len) == 0;
+    }
+
+    munmap(src, st.st_size);
+
+    if (!labels)
+        fprintf(stderr, "loader: error: no labels in file '%s', assemble it with -bytecode or -image to keep them\n", filename);
+    else if (!found)
+        fprintf(stderr, "loader: error: no label '%s' in file '%s'\n", str, filename);
+
+    return found;
+}
+
 void load_file(VM *vm, char *filename, bool is_binary) {
-    FILE *f = fopen(filename, "r");
+    const int fd = open(filename, O_RDONLY);
 
-    if (f == NULL) {
+    if (fd < 0) {
         fprintf(stderr, "loader: error: no such file '%s'\n", filename);
         kill(vm);
     }
 
+    char magic[BYTECODE_MAGIC_LEN];
+
+    if (pread(fd, magic, sizeof(magic), 0) == sizeof(magic) && is_bytecode(magic, sizeof(magic))) {
+        const bool loaded = load_bytecode(vm, fd, filename);
+        close(fd);
+
+        if (!loaded)
+            kill(vm);
+
+        return;
+    }
+
+    FILE *f = fdopen(fd, "r");
+
     fseek(f, 0, SEEK_END);
     size_t file_size = ftell(f);
     rewind(f);
 
-    char *src = malloc(file_size + 1);
+    // The padding ends the header too.
+    char *src = malloc(file_size + SCAN_PADDING);
     size_t read_size = fread(src, 1, file_size, f);
     fclose(f);
 
@@ -31,63 +210,45 @@ void load_file(VM *vm, char *filename, bool is_binary) {
         kill(vm);
     }
 
-    src[read_size] = '\0';
+    memset(src + read_size, 0, SCAN_PADDING);
 
-    char buffer[BUFFER_CAP];
-    size_t buffer_size = 0;
-    const size_t len = strlen(src);
-    i64 opcode = 0;
-    i64 operand = 0;
-    int mode = 2;
     size_t i = 0;
+    size_t memory_cap = 0;
+    size_t stack_cap = 0;
 
-    while (i < len) {
-        if (buffer_size == BUFFER_CAP) {
-            fprintf(stderr, "loader: error: constant exceeds maximum size of %u\n", BUFFER_CAP);
-            free(src);
-            kill(vm);
-        }
-
-        if (is_binary && isdigit(src[i]) && src[i] != '0' && src[i] != '1')
-            is_binary = false;
+    if (!parse_header(src, &i, &memory_cap, &stack_cap)) {
+        fprintf(stderr, "loader: error: invalid header in file '%s'\n", filename);
+        free(src);
+        kill(vm);
+    }
 
-        buffer[buffer_size++] = src[i++];
+    // Sizes given on the command line win over the program's.
+    if (vm->memory_cap == 0)
+        vm->memory_cap = memory_cap;
 
-        if (i != len && !isspace(src[i]))
-            continue;
+    if (vm->stack_cap == 0)
+        vm->stack_cap = stack_cap;
 
-        while (i != len && isspace(src[i]))
-            i++;
+    map_vm(vm);
 
-        if (mode > 0) {
-            buffer[buffer_size] = '\0';
-            char *endptr;
-            errno = 0;
-
-            if (mode == 2)
-                opcode = strtoll(buffer, &endptr, is_binary ? 2 : 10);
-            else
-                operand = strtoll(buffer, &endptr, is_binary ? 2 : 10);
-
-            if (endptr == buffer || *endptr != '\0') {
-                fprintf(stderr, "loader: error: constant conversion failed\n");
-                free(src);
-                kill(vm);
-            } else if (errno == ERANGE || errno == EINVAL) {
-                fprintf(stderr, "loader: error: constant conversion failed: %s\n", strerror(errno));
-                free(src);
-                kill(vm);
-            }
+    Scanner scan;
+    open_scanner(&scan, src, read_size, i, scan_base(src + i, read_size - i, is_binary));
 
-            mode--;
-            buffer_size = 0;
-        }
+    i64 opcode;
+    i64 operand;
+    ScanResult result;
 
-        if (mode == 0) {
-            push_op(vm, opcode, operand);
-            mode = 2;
-        }
-    }
+    // A lone opcode at the end is left out.
+    while ((result = next_number(&scan, &opcode)) == SCAN_NUMBER && (result = next_number(&scan, &operand)) == SCAN_NUMBER)
+        push_op(vm, opcode, operand);
 
     free(src);
+
+    if (result == SCAN_INVALID) {
+        fprintf(stderr, "loader: error: constant conversion failed\n");
+        kill(vm);
+    } else if (result == SCAN_RANGE) {
+        fprintf(stderr, "loader: error: constant conversion failed: %s\n", strerror(ERANGE));
+        kill(vm);
+    }
 }
@@ -4,6 +4,8 @@
 #include "vm.h"
 #include <stdbool.h>
 
+bool parse_header(const char *src, size_t *pos, size_t *memory_cap, size_t *stack_cap);
+bool find_address(char *filename, const char *str, i64 *address);
 void load_file(VM *vm, char *filename, bool is_binary);
 
 #endif
\ No newline at end of file
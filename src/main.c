@@ -2,22 +2,40 @@
 #include "loader.h"
 #include "assembler.h"
 #include "disassembler.h"
+#include "aot.h"
+#include "verifier.h"
+#include "snapshot.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <inttypes.h>
 
 void help(char *prog) {
-    printf("usage: %s <command> [options] <input file>\n"
+    printf("usage: %s <command> [options] <input file>...\n"
            "commands:\n"
+           "    aot               compile to a native executable through C\n"
            "    asm               assemble a machine code file\n"
            "    dis               disassemble a machine code file\n"
            "    exe               execute a machine code file\n"
            "    run               assemble a machine code file\n"
            "options:\n"
            //"    -decimal          output decimal machine code\n"
+           "    -buffer=<size>    output buffer size in bytes with an optional k, m or g suffix, or line\n"
+           "    -bytecode         output machine code as compact bytecode\n"
+           "    -engine=<name>    dispatch engine to execute with (switch, goto, tail, jit, trace)\n"
+           "    -fuse=<fusions>   superinstructions to use (all, none or a histogram file)\n"
+           "    -histogram=<file> record executed opcode pairs to a file\n"
+           "    -image            output machine code as bytecode that can be mapped straight into memory\n"
+           "    -j <threads>      threads to assemble several files or disassemble a big one with\n"
            "    -linebreak        output linebreaks in machine code\n"
-           "    -o <output file>  specify the output filename\n"
+           "    -memory=<slots>   size of memory, with an optional k, m or g suffix\n"
+           "    -o <output file>  specify the output filename, or directory for several files\n"
+           "    -restore          execute a snapshot from where it was taken\n"
+           "    -snapshot=<file>  file to write a snapshot to, snapshot.snap by default\n"
+           "    -snapshot-at=<at> stop at an address or label and write a snapshot\n"
+           "    -stack=<slots>    size of the stack, with an optional k, m or g suffix\n"
+           "    -verify           report whether the program passed the verifier\n"
            , prog);
 }
 
@@ -31,6 +49,7 @@ int main(int argc, char **argv) {
     bool dis = false;
     bool exe = false;
     bool run = false;
+    bool aot = false;
 
     if (strcmp(command, "exe") == 0)
         exe = true;
@@ -38,22 +57,81 @@ int main(int argc, char **argv) {
         run = true;
     else if (strcmp(command, "dis") == 0)
         dis = true;
+    else if (strcmp(command, "aot") == 0)
+        aot = true;
     else if (strcmp(command, "asm") != 0) {
         fprintf(stderr, "error: no such command '%s'\n", command);
         return EXIT_FAILURE;
     }
 
     char *infile = NULL;
+    char **infiles = malloc(argc * sizeof(char *));
+    size_t infile_count = 0;
     char *outfile = "a.out";
+    bool outfile_given = false;
+    size_t threads = 0;
     bool decimal = true;
     bool linebreak = false;
+    Format format = FORMAT_TEXT;
+    Engine engine = ENGINE_SWITCH;
+    char *fuse = "all";
+    char *histogram = NULL;
+    size_t memory_cap = 0;
+    size_t stack_cap = 0;
+    bool verify = false;
+    char *snapshot = "snapshot.snap";
+    char *snapshot_at = NULL;
+    bool restore = false;
+    Output output = { .cap = 0, .line = false };
+    bool buffer = false;
 
     for (int i = 2; i < argc; i++) {
         //if (strcmp(argv[i], "-decimal") == 0)
         //    decimal = true;
         if (strcmp(argv[i], "-linebreak") == 0)
             linebreak = true;
-        else if (strcmp(argv[i], "-o") == 0) {
+        else if (strcmp(argv[i], "-bytecode") == 0)
+            format = FORMAT_BYTECODE;
+        else if (strcmp(argv[i], "-image") == 0)
+            format = FORMAT_IMAGE;
+        else if (strcmp(argv[i], "-verify") == 0)
+            verify = true;
+        else if (strcmp(argv[i], "-restore") == 0)
+            restore = true;
+        else if (strncmp(argv[i], "-snapshot=", 10) == 0)
+            snapshot = argv[i] + 10;
+        else if (strncmp(argv[i], "-snapshot-at=", 13) == 0)
+            snapshot_at = argv[i] + 13;
+        else if (strcmp(argv[i], "-buffer=line") == 0) {
+            output.line = true;
+            buffer = true;
+        } else if (strncmp(argv[i], "-buffer=", 8) == 0) {
+            if (!size_from_string(argv[i] + 8, &output.cap)) {
+                fprintf(stderr, "error: invalid buffer size '%s'\n", argv[i] + 8);
+                return EXIT_FAILURE;
+            }
+
+            buffer = true;
+        } else if (strncmp(argv[i], "-engine=", 8) == 0) {
+            if (!engine_from_string(argv[i] + 8, &engine)) {
+                fprintf(stderr, "error: no such engine '%s'\n", argv[i] + 8);
+                return EXIT_FAILURE;
+            }
+        } else if (strncmp(argv[i], "-fuse=", 6) == 0)
+            fuse = argv[i] + 6;
+        else if (strncmp(argv[i], "-histogram=", 11) == 0)
+            histogram = argv[i] + 11;
+        else if (strncmp(argv[i], "-memory=", 8) == 0) {
+            if (!size_from_string(argv[i] + 8, &memory_cap)) {
+                fprintf(stderr, "error: invalid memory size '%s'\n", argv[i] + 8);
+                return EXIT_FAILURE;
+            }
+        } else if (strncmp(argv[i], "-stack=", 7) == 0) {
+            if (!size_from_string(argv[i] + 7, &stack_cap)) {
+                fprintf(stderr, "error: invalid stack size '%s'\n", argv[i] + 7);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "-o") == 0) {
             if (i == argc - 1) {
                 fprintf(stderr, "error: missing output filename for option '-o'\n");
                 return EXIT_FAILURE;
@@ -63,17 +141,44 @@ int main(int argc, char **argv) {
             }
 
             outfile = argv[++i];
-        } else if (i == argc - 1)
-            infile = argv[i];
+            outfile_given = true;
+        } else if (strcmp(argv[i], "-j") == 0) {
+            if (i == argc - 1 || !size_from_string(argv[i + 1], &threads) || threads == 0) {
+                fprintf(stderr, "error: invalid thread count for option '-j'\n");
+                return EXIT_FAILURE;
+            }
+
+            i++;
+        } else if (argv[i][0] != '-' || i == argc - 1)
+            infiles[infile_count++] = argv[i];
         else {
             fprintf(stderr, "error: undefined option '%s'\n", argv[i]);
             return EXIT_FAILURE;
         }
     }
 
-    if (infile == NULL) {
+    if (infile_count == 0) {
         fprintf(stderr, "error: missing input file\n");
         return EXIT_FAILURE;
+    } else if (infile_count > 1) {
+        // Every file gets its own output, next to it or in -o.
+        if (strcmp(command, "asm") != 0) {
+            fprintf(stderr, "error: only command 'asm' takes more than one input file\n");
+            return EXIT_FAILURE;
+        }
+
+        const int status = assemble_all(infiles, infile_count, outfile_given ? outfile : NULL, threads, linebreak, decimal, format);
+        free(infiles);
+        return status;
+    }
+
+    infile = infiles[0];
+    free(infiles);
+
+    // The input file is the snapshot, so there's nothing to assemble.
+    if (restore && !exe) {
+        fprintf(stderr, "error: invalid option '-restore' used with command '%s'\n", command);
+        return EXIT_FAILURE;
     }
 
     if (dis) {
@@ -81,10 +186,12 @@ int main(int argc, char **argv) {
         if (strcmp(outfile, "a.out") == 0)
             outfile = "dis.min";
 
-        return disassemble(infile, outfile);
-    } else if (!exe) {
+        return disassemble(infile, outfile, threads);
+    } else if (aot)
+        return compile_aot(infile, outfile, memory_cap, stack_cap);
+    else if (!exe) {
         if (run) {
-            int status = assemble(infile, outfile, linebreak, decimal);
+            int status = assemble(infile, outfile, linebreak, decimal, format);
             
             if (status == EXIT_FAILURE)
                 return status;
@@ -94,12 +201,55 @@ int main(int argc, char **argv) {
             if (dis)
                 return status;
         } else
-            return assemble(infile, outfile, linebreak, decimal);
+            return assemble(infile, outfile, linebreak, decimal, format);
     }
 
     VM *vm = create_vm();
-    load_file(vm, infile, true);
-    start_vm(vm);
+    vm->engine = engine;
+    vm->memory_cap = memory_cap;
+    vm->stack_cap = stack_cap;
+
+    if (buffer)
+        vm->output = output;
+
+    if (restore) {
+        if (!load_snapshot(vm, infile))
+            kill(vm);
+    } else
+        load_file(vm, infile, true);
+
+    // Programs that can't be proven safe keep every check.
+    vm->verified = verify_vm(vm, verify);
+
+    if (strcmp(fuse, "none") == 0)
+        vm->fusions = 0;
+    else if (strcmp(fuse, "all") != 0 && !load_fusions(vm, fuse))
+        kill(vm);
+
+    if (histogram != NULL)
+        record_histogram(vm);
+
+    // Whatever runs before the snapshot is taken doesn't need to
+    // run again, so the program stops there.
+    if (snapshot_at != NULL) {
+        i64 address;
+
+        if (!find_address(infile, snapshot_at, &address))
+            kill(vm);
+
+        if (!run_until(vm, address)) {
+            fprintf(stderr, "vm: error: program halted before reaching address %" PRId64 "\n", address);
+            kill(vm);
+        }
+
+        if (!save_snapshot(vm, snapshot))
+            kill(vm);
+    } else
+        start_vm(vm);
+
+    if (histogram != NULL && !save_histogram(vm, histogram))
+        kill(vm);
+
     delete_vm(vm);
     return EXIT_SUCCESS;
 }
\ No newline at end of file
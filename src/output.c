@@ -0,0 +1,202 @@
+// Needed for write() with -std=c11.
+#define _DEFAULT_SOURCE
+
+#include "output.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <unistd.h>
+
+// Every number from 00 to 99, so digits can be written two at a time.
+static const char digit_pairs[] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+static const uint64_t powers_of_ten[] = {
+    0,
+    10ull,
+    100ull,
+    1000ull,
+    10000ull,
+    100000ull,
+    1000000ull,
+    10000000ull,
+    100000000ull,
+    1000000000ull,
+    10000000000ull,
+    100000000000ull,
+    1000000000000ull,
+    10000000000000ull,
+    100000000000000ull,
+    1000000000000000ull,
+    10000000000000000ull,
+    100000000000000000ull,
+    1000000000000000000ull,
+    10000000000000000000ull
+};
+
+// Estimates the digits from the bit length, 1233 / 4096 being
+// close to log10(2), then corrects it with one comparison.
+static int count_digits(uint64_t n) {
+    const int estimate = (64 - __builtin_clzll(n | 1)) * 1233 >> 12;
+    return estimate - (n < powers_of_ten[estimate]) + 1;
+}
+
+// Room for a whole number past cap, so output_int() and
+// output_bin() only have to check once they're done.
+void open_output(Output *out, int fd) {
+    if (out->cap == 0)
+        out->cap = DEFAULT_OUTPUT_CAP;
+
+    out->buffer = malloc(out->cap + MAX_BIN_LEN);
+    out->len = 0;
+    out->fd = fd;
+    out->flushed = 0;
+    out->failed = false;
+}
+
+void flush_output(Output *out) {
+    if (out->fd < 0) {
+        out->cap *= 2;
+        out->buffer = realloc(out->buffer, out->cap + MAX_BIN_LEN);
+        return;
+    }
+
+    size_t written = 0;
+
+    while (!out->failed && written < out->len) {
+        const ssize_t n = write(out->fd, out->buffer + written, out->len - written);
+
+        // Nowhere for the rest to go, so drop it.
+        if (n < 0 && errno != EINTR)
+            out->failed = true;
+        else if (n > 0)
+            written += n;
+    }
+
+    out->flushed += out->len;
+    out->len = 0;
+}
+
+// False if any of it couldn't be written.
+bool close_output(Output *out) {
+    if (out->buffer == NULL)
+        return !out->failed;
+
+    flush_output(out);
+    free(out->buffer);
+    out->buffer = NULL;
+    return !out->failed;
+}
+
+void output_int(Output *out, int64_t value) {
+    char *p = out->buffer + out->len;
+    uint64_t n = (uint64_t)value;
+
+    if (value < 0) {
+        *p++ = '-';
+        n = -n;
+    }
+
+    char *const end = p + count_digits(n);
+    p = end;
+
+    while (n >= 100) {
+        p -= 2;
+        memcpy(p, &digit_pairs[n % 100 * 2], 2);
+        n /= 100;
+    }
+
+    if (n >= 10) {
+        p -= 2;
+        memcpy(p, &digit_pairs[n * 2], 2);
+    } else
+        *--p = '0' + n;
+
+    out->len = end - out->buffer;
+
+    if (out->len >= out->cap)
+        flush_output(out);
+}
+
+// Negative numbers get a sign rather than their two's complement,
+// so strtoll() reads them back the same.
+void output_bin(Output *out, int64_t value) {
+    char *p = out->buffer + out->len;
+    uint64_t n = (uint64_t)value;
+
+    if (value < 0) {
+        *p++ = '-';
+        n = -n;
+    }
+
+    for (int bit = 63 - __builtin_clzll(n | 1); bit >= 0; bit--)
+        *p++ = '0' + (n >> bit & 1);
+
+    out->len = p - out->buffer;
+
+    if (out->len >= out->cap)
+        flush_output(out);
+}
+
+void output_string(Output *out, const char *str, size_t len) {
+    while (len > 0) {
+        const size_t room = out->cap - out->len;
+        const size_t n = len < room ? len : room;
+
+        memcpy(out->buffer + out->len, str, n);
+        out->len += n;
+        str += n;
+        len -= n;
+
+        if (out->len >= out->cap)
+            flush_output(out);
+    }
+}
+
+void output_fill(Output *out, char c, size_t count) {
+    while (count > 0) {
+        const size_t room = out->cap - out->len;
+        const size_t n = count < room ? count : room;
+
+        memset(out->buffer + out->len, c, n);
+        out->len += n;
+        count -= n;
+
+        if (out->len >= out->cap)
+            flush_output(out);
+    }
+}
+
+// A character per cell, copied a buffer at a time. With line set
+// it's flushed after any chunk holding a newline rather than at
+// each one.
+void output_cells(Output *out, const int64_t *cells, size_t count) {
+    while (count > 0) {
+        const size_t room = out->cap - out->len;
+        const size_t n = count < room ? count : room;
+        char *const p = out->buffer + out->len;
+        bool newline = false;
+
+        for (size_t i = 0; i < n; i++) {
+            p[i] = (char)cells[i];
+            newline |= p[i] == '\n';
+        }
+
+        out->len += n;
+        cells += n;
+        count -= n;
+
+        if (out->len >= out->cap || (out->line && newline))
+            flush_output(out);
+    }
+}
@@ -0,0 +1,54 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// 64KiB, big enough that writing it out costs less than filling it.
+#define DEFAULT_OUTPUT_CAP ((size_t)64 << 10)
+
+// Longest an int64_t gets in decimal, "-9223372036854775808",
+// and in binary, a sign and 64 bits.
+#define MAX_INT_LEN 20
+#define MAX_BIN_LEN 65
+
+// What the VM prints, and what the assembler and disassembler
+// write, written out with write() in big chunks instead of going
+// through stdio a character at a time.
+typedef struct {
+    char *buffer;
+    size_t len;
+
+    // Written to, or with -1, kept in memory and grown to fit.
+    int fd;
+
+    // How much went out before what's in the buffer.
+    size_t flushed;
+
+    // Set once a write fails, everything after it is dropped.
+    bool failed;
+
+    // Flushed once it holds cap characters, and at the end of
+    // every line too if line is set.
+    size_t cap;
+    bool line;
+} Output;
+
+void open_output(Output *out, int fd);
+void flush_output(Output *out);
+bool close_output(Output *out);
+void output_int(Output *out, int64_t value);
+void output_bin(Output *out, int64_t value);
+void output_string(Output *out, const char *str, size_t len);
+void output_fill(Output *out, char c, size_t count);
+void output_cells(Output *out, const int64_t *cells, size_t count);
+
+static inline void output_char(Output *out, char c) {
+    out->buffer[out->len++] = c;
+
+    if (out->len >= out->cap || (out->line && c == '\n'))
+        flush_output(out);
+}
+
+#endif
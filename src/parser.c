@@ -11,150 +11,197 @@
 #include <stdint.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <ctype.h>
 
 #define OP(code, and) (Op){ .opcode = code, .operand = and }
 #define NOOP (Op){ .opcode = NOP, .operand = 0 }
 
 #define STARTING_TOK_CAP 32
 #define STARTING_ROOT_CAP 16
-#define TABLE_SIZE 10000
+#define STARTING_LABEL_CAP 64
+#define STARTING_REF_CAP 4
 
 // Give each unresolved label a unique number so they
 // can be resolved to their correct locations later.
-#define UNRESOLVED_LABEL_LOCATION (-(i64)label_count - 98473492432239434) // Magic number from my ass.
+#define UNRESOLVED_LABEL_LOCATION (-(i64)prs->label_count - 98473492432239434) // Magic number from my ass.
 
-typedef struct {
+struct Label {
     char *name;
+    size_t name_len;
     i64 value;
     i64 resolved_value; // After we know where in memory the label is.
     bool resolved;
-    bool used;
     bool is_subroutine;
     char *file;
     size_t ln;
     size_t col;
-} Label;
-
-static Label labels[TABLE_SIZE];
-static size_t label_count = 0;
-
-static bool text_initialized = false;
-static bool data_initialized = false;
-static bool in_text = false;
 
-static Root root;
+    // Every op that uses the label, to patch once it's resolved.
+    size_t *refs;
+    size_t ref_count;
+    size_t ref_capacity;
+};
 
-void root_push(Op stmt) {
-    if (root.op_count + 1 >= root.op_capacity) {
-        root.op_capacity *= 2;
-        root.ops = realloc(root.ops, root.op_capacity * sizeof(Op));
+void root_push(Parser *prs, Op stmt) {
+    if (prs->root.op_count + 1 >= prs->root.op_capacity) {
+        prs->root.ops = arena_grow(prs->root.arena, prs->root.ops, prs->root.op_capacity * sizeof(Op), prs->root.op_capacity * 2 * sizeof(Op));
+        prs->root.op_capacity *= 2;
     }
 
-    root.ops[root.op_count++] = stmt;
+    prs->root.ops[prs->root.op_count++] = stmt;
 }
 
+// Names are hashed and compared in lowercase, so they can be
+// looked up straight from the source.
 uint32_t hash_FNV1a(const char *data, size_t size) {
     uint32_t h = 2166136261UL;
 
     for (size_t i = 0; i < size; i++) {
-        h ^= data[i];
+        h ^= tolower(data[i]);
         h *= 16777619;
     }
 
-    return h % TABLE_SIZE;
+    return h;
 }
 
-Label *find_label(char *name) {
-    return &labels[hash_FNV1a(name, strlen(name))];
+static bool is_named(const Label *label, const char *name, size_t len) {
+    if (label->name_len != len)
+        return false;
+
+    for (size_t i = 0; i < len; i++) {
+        if (label->name[i] != tolower(name[i]))
+            return false;
+    }
+
+    return true;
 }
 
-Label *add_label(char *name, i64 value, char *file, size_t ln, size_t col) {
-    Label *label = find_label(name);
+// The slot in the table for name, either holding it or empty.
+// Slots hold the index of a label + 1, 0 being empty.
+static size_t *find_slot(size_t *table, size_t table_cap, Label *labels, const char *name, size_t len) {
+    size_t i = hash_FNV1a(name, len) & (table_cap - 1);
 
-    if (label->used) {
-        fprintf(stderr, "%s:%d: TABLE COLLISION\n", __FILE__, __LINE__);
-        inc_errors();
-        assert(false);
-    }
+    while (table[i] != 0 && !is_named(&labels[table[i] - 1], name, len))
+        i = (i + 1) & (table_cap - 1);
 
-    label->name = name;
-    label->value = value;
-    label->resolved = false;
-    label->used = true;
-    label->file = file;
-    label->ln = ln;
-    label->col = col;
-    label_count++;
-    return label;
+    return &table[i];
+}
+
+Label *find_label(Parser *prs, const char *name, size_t len) {
+    const size_t slot = *find_slot(prs->label_table, prs->label_table_cap, prs->labels, name, len);
+    return slot != 0 ? &prs->labels[slot - 1] : NULL;
 }
 
-void delete_labels() {
-    for (size_t i = 0; i < label_count; i++) {
-        Label *label = &labels[i];
+// Kept at most half full so probes stay short.
+static void grow_label_table(Parser *prs) {
+    const size_t table_cap = prs->label_table_cap * 2;
+    size_t *table = arena_alloc(prs->root.arena, table_cap * sizeof(size_t));
+    memset(table, 0, table_cap * sizeof(size_t));
+
+    for (size_t i = 0; i < prs->label_count; i++)
+        *find_slot(table, table_cap, prs->labels, prs->labels[i].name, prs->labels[i].name_len) = i + 1;
 
-        if (!label->used)
-            continue;
+    prs->label_table = table;
+    prs->label_table_cap = table_cap;
+}
+
+// Only for names that aren't labels yet, in lowercase. The
+// returned label moves if another one is added.
+Label *add_label(Parser *prs, char *name, i64 value, char *file, size_t ln, size_t col) {
+    if (prs->label_count == prs->label_capacity) {
+        prs->labels = arena_grow(prs->root.arena, prs->labels, prs->label_capacity * sizeof(Label), prs->label_capacity * 2 * sizeof(Label));
+        prs->label_capacity *= 2;
+    }
+
+    if ((prs->label_count + 1) * 2 > prs->label_table_cap)
+        grow_label_table(prs);
+
+    Label *label = &prs->labels[prs->label_count++];
+    *label = (Label){ .name = name, .name_len = strlen(name), .value = value, .resolved = false, .is_subroutine = false, .file = file, .ln = ln, .col = col, .refs = NULL, .ref_count = 0, .ref_capacity = 0 };
+    *find_slot(prs->label_table, prs->label_table_cap, prs->labels, name, label->name_len) = prs->label_count;
+    return label;
+}
 
-        free(label->name);
-        free(label->file);
-        label->used = false;
+// The op using the label is the next one pushed.
+static void add_ref(Parser *prs, Label *label) {
+    if (label->ref_count == label->ref_capacity) {
+        const size_t ref_capacity = label->ref_capacity == 0 ? STARTING_REF_CAP : label->ref_capacity * 2;
+        label->refs = arena_grow(prs->root.arena, label->refs, label->ref_capacity * sizeof(size_t), ref_capacity * sizeof(size_t));
+        label->ref_capacity = ref_capacity;
     }
+
+    label->refs[label->ref_count++] = prs->root.op_count;
 }
 
-Parser create_parser(char *file) {
-    Lexer lex = create_lexer(file);
+// Everything the parser allocates comes from the arena the
+// root ends up owning.
+Parser create_parser(char *file, FILE *diag) {
+    Arena *arena = create_arena();
+    Lexer lex = create_lexer(file, diag, arena);
     Token tok;
 
-    Token *tokens = malloc(STARTING_TOK_CAP * sizeof(Token));
+    Token *tokens = arena_alloc(arena, STARTING_TOK_CAP * sizeof(Token));
     size_t token_count = 0;
     size_t token_capacity = STARTING_TOK_CAP;
 
     while ((tok = lex_next_token(&lex)).type != TOK_EOF) {
         // +2, extra +1 for the EOF.
         if (token_count + 2 >= token_capacity) {
+            tokens = arena_grow(arena, tokens, token_capacity * sizeof(Token), token_capacity * 2 * sizeof(Token));
             token_capacity *= 2;
-            tokens = realloc(tokens, token_capacity * sizeof(Token));
         }
 
         tokens[token_count++] = tok;
     }
 
     tokens[token_count++] = tok;
-    delete_lexer(&lex);
 
-    return (Parser){ .file = file, .tokens = tokens, .token_count = token_count, .tok = &tokens[0], .pos = 0 };
+    return (Parser){
+        .file = file,
+        .lex = lex,
+        .tokens = tokens,
+        .token_count = token_count,
+        .tok = &tokens[0],
+        .pos = 0,
+        .labels = arena_alloc(arena, STARTING_LABEL_CAP * sizeof(Label)),
+        .label_count = 0,
+        .label_capacity = STARTING_LABEL_CAP,
+        .label_table = memset(arena_alloc(arena, STARTING_LABEL_CAP * 2 * sizeof(size_t)), 0, STARTING_LABEL_CAP * 2 * sizeof(size_t)),
+        .label_table_cap = STARTING_LABEL_CAP * 2,
+        .text_initialized = false,
+        .data_initialized = false,
+        .in_text = false,
+        .root = (Root){ .arena = arena, .ops = arena_alloc(arena, STARTING_ROOT_CAP * sizeof(Op)), .op_count = 0, .op_capacity = STARTING_ROOT_CAP, .memory_cap = 0, .stack_cap = 0, .errors = 0 },
+        .diag = diag,
+        .errors = lex.errors
+    };
 }
 
+// The root is handed over to the caller along with the arena,
+// so only the source is let go of here.
 void delete_parser(Parser *prs) {
-    for (size_t i = 0; i < prs->token_count; i++)
-        delete_token(&prs->tokens[i]);
-
-    free(prs->tokens);
+    delete_lexer(&prs->lex);
 }
 
 static void eat(Parser *prs, TokenType type) {
     if (type != prs->tok->type) {
-        fprintf(stderr, "%s:%zu:%zu: error: found token '%s' when expecting '%s'\n", prs->file, prs->tok->ln, prs->tok->col, tokentype_to_string(prs->tok->type), tokentype_to_string(type));
-        inc_errors();
+        fprintf(prs->diag, "%s:%zu:%zu: error: found token '%s' when expecting '%s'\n", prs->file, prs->tok->ln, prs->tok->col, tokentype_to_string(prs->tok->type), tokentype_to_string(type));
+        prs->errors++;
     }
 
     if (prs->tok->type != TOK_EOF)
         prs->tok = &prs->tokens[++prs->pos];
 }
 
+// The lexer already converted it.
 i64 parse_digit(Parser *prs) {
-    errno = 0;
-    char *endptr;
-    i64 value = strtoll(prs->tok->value, &endptr, 10);
-
-    if (endptr == prs->tok->value || *endptr != '\0') {
-        fprintf(stderr, "%s:%zu:%zu: error: digit conversion failed\n", prs->file, prs->tok->ln, prs->tok->col);
-        inc_errors();
-        value = 0;
-    } else if (errno == EINVAL || errno == ERANGE) {
-        fprintf(stderr, "%s:%zu:%zu: error: digit conversion failed: %s\n", prs->file, prs->tok->ln, prs->tok->col, strerror(errno));
-        inc_errors();
-        value = 0;
+    i64 value = 0;
+
+    if (prs->tok->type == TOK_INT)
+        value = prs->tok->number;
+    else {
+        fprintf(prs->diag, "%s:%zu:%zu: error: digit conversion failed\n", prs->file, prs->tok->ln, prs->tok->col);
+        prs->errors++;
     }
 
     eat(prs, TOK_INT);
@@ -163,44 +210,39 @@ i64 parse_digit(Parser *prs) {
 
 Op parse_label_decl(Parser *prs, char *id, size_t ln, size_t col) {
     // Data label outside of the data section.
-    if (prs->tok->type != TOK_EOL && strcmp(prs->tok->value, "dsr") != 0 && !data_initialized) {
-        fprintf(stderr, "%s:%zu:%zu: error: defining data label '%s' outside of the data section\n", prs->file, ln, col, id);
-        free(id);
+    if (prs->tok->type != TOK_EOL && !token_is(prs->tok, "dsr") && !prs->data_initialized) {
+        fprintf(prs->diag, "%s:%zu:%zu: error: defining data label '%s' outside of the data section\n", prs->file, ln, col, id);
         return NOOP;
     } 
     // Branch label outside of the text section.
-    else if (prs->tok->type == TOK_EOL && !text_initialized) {
-        fprintf(stderr, "%s:%zu:%zu: error: defining branch label '%s' outside of the text section\n", prs->file, ln, col, id);
-        free(id);
+    else if (prs->tok->type == TOK_EOL && !prs->text_initialized) {
+        fprintf(prs->diag, "%s:%zu:%zu: error: defining branch label '%s' outside of the text section\n", prs->file, ln, col, id);
         return NOOP;
     }
     // Any label, no sections found.
-    else if (!text_initialized && !data_initialized) {
-        fprintf(stderr, "%s:%zu:%zu: error: defining label '%s' outside of a section\n", prs->file, ln, col, id);
-        free(id);
+    else if (!prs->text_initialized && !prs->data_initialized) {
+        fprintf(prs->diag, "%s:%zu:%zu: error: defining label '%s' outside of a section\n", prs->file, ln, col, id);
         return NOOP;
     }
 
-    Label *label = find_label(id);
+    Label *label = find_label(prs, id, strlen(id));
 
     // Check if this label already exists.
-    if (label->used) {
+    if (label != NULL) {
         if (label->resolved) {
-            fprintf(stderr, "%s:%zu:%zu: error: redefinition of label '%s'; first defined at %s:%zu:%zu\n", prs->file, ln, col, id, label->file, label->ln, label->col);
-            inc_errors();
+            fprintf(prs->diag, "%s:%zu:%zu: error: redefinition of label '%s'; first defined at %s:%zu:%zu\n", prs->file, ln, col, id, label->file, label->ln, label->col);
+            prs->errors++;
         } else {
             label->resolved = true;
-            label->resolved_value = root.op_count;
+            label->resolved_value = prs->root.op_count;
         }
 
-        if (strcmp(prs->tok->value, "dsr") == 0) {
-            free(id);
+        if (token_is(prs->tok, "dsr")) {
             eat(prs, TOK_ID);
 
             label->is_subroutine = true;
             return NOOP;
-        } else if (strcmp(prs->tok->value, "dat") != 0) {
-            free(id);
+        } else if (!token_is(prs->tok, "dat")) {
             return NOOP;
         }
 
@@ -208,7 +250,7 @@ Op parse_label_decl(Parser *prs, char *id, size_t ln, size_t col) {
 
         if (prs->tok->type == TOK_STRING) {
             // Define each character in a sequence in memory, add a null character too.
-            const size_t len = strlen(prs->tok->value);
+            const size_t len = prs->tok->len;
 
             for (size_t i = 0; i < len; i++) {
                 char c = prs->tok->value[i];
@@ -236,64 +278,61 @@ Op parse_label_decl(Parser *prs, char *id, size_t ln, size_t col) {
                             value = (int)c;
                             break;
                         default:
-                            fprintf(stderr, "%s:%zu:%zu: error: unsupported escape sequence '\\%c'\n", prs->file, prs->tok->ln, prs->tok->col, c);
-                            inc_errors();
+                            fprintf(prs->diag, "%s:%zu:%zu: error: unsupported escape sequence '\\%c'\n", prs->file, prs->tok->ln, prs->tok->col, c);
+                            prs->errors++;
                             assert(false);
                             break;
                     }
                 } else
                     value = (int)c;
 
-                root_push(OP(DAT, (i64)value));
+                root_push(prs, OP(DAT, (i64)value));
             }
 
             eat(prs, TOK_STRING);
-            free(id);
 
             // Yeah uhhh, WHY THE FUCK DOES THIS WORK WITHOUT THIS??
             // Adding this causes a table collision. Ah fuck it.
-            //add_label(id, 0, mystrdup(prs->file), ln, col);
+            //add_label(prs, id, 0, prs->file, ln, col);
 
             return OP(DAT, 0); // Null char.
         } else if (prs->tok->type != TOK_INT) {
-            fprintf(stderr, "%s:%zu:%zu: error: expected constant data value for label '%s' but found '%s'\n", prs->file, ln, col, id, tokentype_to_string(prs->tok->type));
-            inc_errors();
-            add_label(id, 0, mystrdup(prs->file), ln, col);
+            fprintf(prs->diag, "%s:%zu:%zu: error: expected constant data value for label '%s' but found '%s'\n", prs->file, ln, col, id, tokentype_to_string(prs->tok->type));
+            prs->errors++;
             return NOOP;
         }
 
-        free(id);
         return OP(DAT, parse_digit(prs));
     }
 
     // Parse a branch label, only allowed in the text section.
-    if (in_text) {
-        if (strcmp(prs->tok->value, "dsr") == 0) {
+    if (prs->in_text) {
+        if (token_is(prs->tok, "dsr")) {
             eat(prs, TOK_ID);
-            label = add_label(id, root.op_count, mystrdup(prs->file), ln, col);
+            label = add_label(prs, id, prs->root.op_count, prs->file, ln, col);
             label->resolved = true;
             label->resolved_value = label->value;
             label->is_subroutine = true;
             return NOOP;
         }
 
-        label = add_label(id, root.op_count, mystrdup(prs->file), ln, col);
+        label = add_label(prs, id, prs->root.op_count, prs->file, ln, col);
         label->resolved = true;
-        label->resolved_value = root.op_count;
+        label->resolved_value = prs->root.op_count;
         return NOOP;
     }
 
     if (prs->tok->type != TOK_ID) {
-        fprintf(stderr, "%s:%zu:%zu: error: expected DAT following data label '%s' but found '%s'\n", prs->file, ln, col, id, tokentype_to_string(prs->tok->type));
-        inc_errors();
+        fprintf(prs->diag, "%s:%zu:%zu: error: expected DAT following data label '%s' but found '%s'\n", prs->file, ln, col, id, tokentype_to_string(prs->tok->type));
+        prs->errors++;
 
-        add_label(id, 0, mystrdup(prs->file), ln, col);
+        add_label(prs, id, 0, prs->file, ln, col);
         return NOOP;
-    } else if (strcmp(prs->tok->value, "dat") != 0) {
-        fprintf(stderr, "%s:%zu:%zu: error: expected DAT following data label '%s' but found '%s'\n", prs->file, ln, col, id, prs->tok->value);
-        inc_errors();
+    } else if (!token_is(prs->tok, "dat")) {
+        fprintf(prs->diag, "%s:%zu:%zu: error: expected DAT following data label '%s' but found '%.*s'\n", prs->file, ln, col, id, (int)prs->tok->len, prs->tok->value);
+        prs->errors++;
 
-        add_label(id, 0, mystrdup(prs->file), ln, col);
+        add_label(prs, id, 0, prs->file, ln, col);
         return NOOP;
     }
 
@@ -301,7 +340,7 @@ Op parse_label_decl(Parser *prs, char *id, size_t ln, size_t col) {
 
     if (prs->tok->type == TOK_STRING) {
         // Define each character in a sequence in memory, add a null character too.
-        const size_t len = strlen(prs->tok->value);
+        const size_t len = prs->tok->len;
 
         for (size_t i = 0; i < len; i++) {
             char c = prs->tok->value[i];
@@ -329,48 +368,46 @@ Op parse_label_decl(Parser *prs, char *id, size_t ln, size_t col) {
                         value = atoi(prs->tok->value);
                         break;
                     default:
-                        fprintf(stderr, "%s:%zu:%zu: error: unsupported escape sequence '\\%c'\n", prs->file, prs->tok->ln, prs->tok->col, c);
-                        inc_errors();
+                        fprintf(prs->diag, "%s:%zu:%zu: error: unsupported escape sequence '\\%c'\n", prs->file, prs->tok->ln, prs->tok->col, c);
+                        prs->errors++;
                         assert(false);
                         break;
                 }
             } else
                 value = atoi(prs->tok->value);
 
-            root_push(OP(DAT, (i64)value));
+            root_push(prs, OP(DAT, (i64)value));
         }
 
-        add_label(id, UNRESOLVED_LABEL_LOCATION, mystrdup(prs->file), ln, col);
+        add_label(prs, id, UNRESOLVED_LABEL_LOCATION, prs->file, ln, col);
         return OP(DAT, 0); // Null char.
     } else if (prs->tok->type != TOK_INT) {
         printf("??????? >> %d\n", prs->tok->type == TOK_STRING);
-        fprintf(stderr, "%s:%zu:%zu: error: expected constant data value for label '%s' but found '%s'\n", prs->file, ln, col, id, tokentype_to_string(prs->tok->type));
-        inc_errors();
-        add_label(id, 0, mystrdup(prs->file), ln, col);
+        fprintf(prs->diag, "%s:%zu:%zu: error: expected constant data value for label '%s' but found '%s'\n", prs->file, ln, col, id, tokentype_to_string(prs->tok->type));
+        prs->errors++;
+        add_label(prs, id, 0, prs->file, ln, col);
         return NOOP;
     }
 
-    add_label(id, UNRESOLVED_LABEL_LOCATION, mystrdup(prs->file), ln, col);
+    add_label(prs, id, UNRESOLVED_LABEL_LOCATION, prs->file, ln, col);
     return OP(DAT, parse_digit(prs));
 }
 
-void assert_instr_in_text(Parser *prs, char *instr, size_t ln, size_t col) {
-    if (in_text)
+void assert_instr_in_text(Parser *prs, const Token *instr) {
+    if (prs->in_text)
         return;
 
-    fprintf(stderr, "%s:%zu:%zu: instruction '%s' outside of the text section\n", prs->file, ln, col, instr);
-    inc_errors();
+    fprintf(prs->diag, "%s:%zu:%zu: instruction '%.*s' outside of the text section\n", prs->file, instr->ln, instr->col, (int)instr->len, instr->value);
+    prs->errors++;
 }
 
 i64 parse_label(Parser *prs) {
-    Label *label = find_label(prs->tok->value);
+    Label *label = find_label(prs, prs->tok->value, prs->tok->len);
 
-    if (!label->used) {
-        label = add_label(mystrdup(prs->tok->value), UNRESOLVED_LABEL_LOCATION, mystrdup(prs->file), prs->tok->ln, prs->tok->col);
-        eat(prs, TOK_ID);
-        return label->value;
-    }
+    if (label == NULL)
+        label = add_label(prs, copy_token(prs->tok, prs->root.arena), UNRESOLVED_LABEL_LOCATION, prs->file, prs->tok->ln, prs->tok->col);
 
+    add_ref(prs, label);
     eat(prs, TOK_ID);
     return label->resolved ? label->resolved_value : label->value;
 }
@@ -381,509 +418,188 @@ i64 parse_operand(Parser *prs) {
     else if (prs->tok->type == TOK_ID)
         return parse_label(prs);
 
-    fprintf(stderr, "%s:%zu:%zu: error: invalid operand '%s'\n", prs->file, prs->tok->ln, prs->tok->col, tokentype_to_string(prs->tok->type));
-    inc_errors();
+    fprintf(prs->diag, "%s:%zu:%zu: error: invalid operand '%s'\n", prs->file, prs->tok->ln, prs->tok->col, tokentype_to_string(prs->tok->type));
+    prs->errors++;
     return 0;
 }
 
-Op parse_ops(Parser *prs) {
-    // The OPS instruction is actually an alias for a loop
-    // that repeats the OPC instruction until the length reaches 0.
-
-    // Store the pointer.
-    size_t pointer = root.op_count;
-    root_push(OP(STM, pointer));
-
-    // Get and store the length.
-    root_push(OP(prs->tok->type == TOK_ID ? LDM : LDI, parse_operand(prs)));
-    size_t length = root.op_count;
-    root_push(OP(STM, root.op_count));
-
-    // Store the counter.
-    root_push(OP(LDI, 0));
-    size_t counter = root.op_count;
-    root_push(OP(STM, root.op_count));
-
-    // Start of the loop.
-    size_t loop_start = root.op_count;
-    root_push(NOOP);
-
-    // Load the length and branch to the end of the loop if it's 0.
-    // We don't know the location of the end of the loop yet, we'll fill it in later.
-    root_push(OP(LDM, length));
-    size_t branch_zero = root.op_count;
-    root_push(OP(BRZ, 0));
-
-    // Load the next character.
-    root_push(OP(LDM, pointer));
-    root_push(OP(ADDM, counter));
-    root_push(OP(LDDA, 0));
-
-    // Print the character.
-    root_push(OP(PRCA, 0));
-
-    // Decrement the length, increment the counter.
-    root_push(OP(INCM, counter));
-    root_push(OP(DECM, length));
-
-    // Jump back to the start of the loop.
-    root_push(OP(BRA, loop_start));
-
-    // End of the loop, fill in the last branch zero.
-    root.ops[branch_zero].operand = root.op_count;
-    return NOOP;
-}
-
 Op parse_res(Parser *prs) {
     const size_t ln = prs->tok->col;
     const size_t col = prs->tok->col;
     i64 count = parse_digit(prs);
 
     if (count < 1) {
-        fprintf(stderr, "%s:%zu:%zu: error: can only reserve minimum 1 data\n", prs->file, ln, col);
-        inc_errors();
+        fprintf(prs->diag, "%s:%zu:%zu: error: can only reserve minimum 1 data\n", prs->file, ln, col);
+        prs->errors++;
         return NOOP;
     }
 
     for (i64 i = 0; i < count - 1; i++)
-        root_push(OP(DAT, 0));
+        root_push(prs, OP(DAT, 0));
 
     return OP(DAT, 0);
 }
 
-Op parse_id(Parser *prs) {
-    const size_t ln = prs->tok->ln;
-    const size_t col = prs->tok->col;
+// Every mnemonic, with the opcode for each form of operand it takes,
+// NIL for the ones it doesn't: none, ^, an integer and a label.
+// With OPERAND the label form takes integers too, without a form of
+// their own. ANYWHERE ones can be used outside the text section.
+#define NIL OPCODE_COUNT
+#define OPERAND 1
+#define ANYWHERE 2
+
+#define FOR_EACH_MNEMONIC(X) \
+    X('h', 'l', 't', BARE, HLT, NIL, NIL, NIL, 0) \
+    X('l', 'd', 'a', FORMS, NIL, LDAS, LDI, LDM, OPERAND) \
+    X('s', 't', 'a', FORMS, NIL, STAS, NIL, STM, 0) \
+    X('o', 'p', 'c', FORMS, PRCA, PRCS, PRCI, PRCM, 0) \
+    X('o', 'p', 'i', FORMS, PRIA, PRIS, PRII, PRIM, 0) \
+    X('a', 'd', 'd', FORMS, NIL, ADDS, ADDI, ADDM, OPERAND) \
+    X('s', 'u', 'b', FORMS, NIL, SUBS, SUBI, SUBM, OPERAND) \
+    X('m', 'u', 'l', FORMS, NIL, MULS, MULI, MULM, OPERAND) \
+    X('d', 'i', 'v', FORMS, NIL, DIVS, DIVI, DIVM, OPERAND) \
+    X('m', 'o', 'd', FORMS, NIL, MODS, MODI, MODM, OPERAND) \
+    X('s', 'h', 'l', FORMS, NIL, SHLS, SHLI, SHLM, OPERAND) \
+    X('s', 'h', 'r', FORMS, NIL, SHRS, SHRI, SHRM, OPERAND) \
+    X('a', 'n', 'd', FORMS, NIL, ANDS, ANDI, ANDM, OPERAND) \
+    X('o', 'r', '\0', FORMS, NIL, ORS, ORI, ORM, OPERAND) \
+    X('x', 'o', 'r', FORMS, NIL, XORS, XORI, XORM, OPERAND) \
+    X('n', 'o', 't', FORMS, NOT, NOTS, NIL, NOTM, 0) \
+    X('n', 'e', 'g', FORMS, NEG, NEGS, NIL, NEGM, 0) \
+    X('j', 'm', 'p', FORMS, BRAA, NIL, NIL, BRA, OPERAND) \
+    X('b', 'r', 'z', FORMS, NIL, NIL, NIL, BRZ, OPERAND) \
+    X('b', 'r', 'p', FORMS, NIL, NIL, NIL, BRP, OPERAND) \
+    X('b', 'r', 'n', FORMS, NIL, NIL, NIL, BRN, OPERAND) \
+    X('i', 'p', 'c', FORMS, RDCA, RDCS, NIL, RDCM, 0) \
+    X('i', 'p', 'i', FORMS, RDIA, RDIS, NIL, RDIM, 0) \
+    X('r', 'e', 'f', FORMS, NIL, REFS, NIL, REFM, 0) \
+    X('l', 'd', 'd', FORMS, LDDA, LDDS, NIL, LDDM, 0) \
+    X('s', 't', 'd', FORMS, NIL, STDS, NIL, STDM, 0) \
+    X('c', 'm', 'p', FORMS, NIL, CMPS, CMPI, CMPM, OPERAND) \
+    X('b', 'e', 'q', FORMS, NIL, NIL, NIL, BEQ, 0) \
+    X('b', 'n', 'e', FORMS, NIL, NIL, NIL, BNE, 0) \
+    X('b', 'l', 't', FORMS, NIL, NIL, NIL, BLT, 0) \
+    X('b', 'l', 'e', FORMS, NIL, NIL, NIL, BLE, 0) \
+    X('b', 'g', 't', FORMS, NIL, NIL, NIL, BGT, 0) \
+    X('b', 'g', 'e', FORMS, NIL, NIL, NIL, BGE, 0) \
+    X('c', 's', 'r', CALL, NIL, NIL, NIL, CSR, 0) \
+    X('r', 's', 'r', RETURN, BRAA, NIL, NIL, NIL, 0) \
+    X('i', 'n', 'c', FORMS, INCA, INCS, NIL, INCM, 0) \
+    X('d', 'e', 'c', FORMS, DECA, DECS, NIL, DECM, 0) \
+    X('p', 's', 'h', FORMS, PSHA, PSHS, PSHI, PSHM, OPERAND) \
+    X('p', 'o', 'p', FORMS, POPA, NIL, NIL, POPM, 0) \
+    X('d', 'r', 'p', BARE, DRP, NIL, NIL, NIL, 0) \
+    X('s', 'w', 'p', FORMS, SWPS, SWPS, NIL, SWPM, 0) \
+    X('s', 'e', 'z', FORMS, SEZA, SEZS, NIL, SEZM, 0) \
+    X('s', 'e', 'p', FORMS, SEPA, SEPS, NIL, SEPM, 0) \
+    X('s', 'e', 'n', FORMS, SENA, SENS, NIL, SENM, 0) \
+    X('s', 'e', 'q', FORMS, SEQA, SEQS, NIL, SEQM, 0) \
+    X('s', 'n', 'e', FORMS, SNEA, SNES, NIL, SNEM, 0) \
+    X('s', 'l', 't', FORMS, SLTA, SLTS, NIL, SLTM, 0) \
+    X('s', 'l', 'e', FORMS, SLEA, SLES, NIL, SLEM, 0) \
+    X('s', 'g', 't', FORMS, SGTA, SGTS, NIL, SGTM, 0) \
+    X('s', 'g', 'e', FORMS, SGEA, SGES, NIL, SGEM, 0) \
+    /* Unnamed data. */ \
+    X('d', 'a', 't', FORMS, NIL, NIL, NIL, DAT, OPERAND | ANYWHERE) \
+    X('r', 'e', 's', RESERVE, NIL, NIL, NIL, NIL, ANYWHERE) \
+    /* Blocks of memory, from the address in the accumulator and the */ \
+    /* one on top of the stack, as long as the operand. */ \
+    X('c', 'p', 'y', FORMS, NIL, NIL, CPYI, CPYM, OPERAND) \
+    X('f', 'i', 'l', FORMS, NIL, NIL, FILI, FILM, OPERAND) \
+    X('c', 'm', 'b', FORMS, NIL, NIL, CMBI, CMBM, OPERAND) \
+    /* Strings, from the address in the accumulator, as long as the */ \
+    /* operand or ending at a 0 without one. */ \
+    X('o', 'p', 's', FORMS, PRSA, NIL, PRSI, PRSM, 0) \
+    X('i', 'p', 's', FORMS, NIL, NIL, NIL, IPS, 0)
+
+typedef enum {
+    NOT_MNEMONIC,
+    FORMS,   // One of the forms, picked by the operand.
+    BARE,    // Never has an operand.
+    CALL,
+    RETURN,
+    RESERVE
+} MnemonicKind;
 
-    char *id = mystrdup(prs->tok->value);
-    eat(prs, TOK_ID);
-    
-    // Check for instructions.
-    if (strcmp(id, "hlt") == 0) {
-        assert_instr_in_text(prs, id, ln, col);
-        free(id);
-        return OP(HLT, 0);
-    } else if (strcmp(id, "lda") == 0) {
-        assert_instr_in_text(prs, id, ln, col);
-        free(id);
-
-        if (prs->tok->type == TOK_TOS)
-            return OP(LDAS, 0);
-
-        return OP(prs->tok->type == TOK_INT ? LDI : LDM, parse_operand(prs));
-    } else if (strcmp(id, "sta") == 0) {
-        assert_instr_in_text(prs, id, ln, col);
-        free(id);
-
-        if (prs->tok->type == TOK_TOS)
-            return OP(STAS, 0);
-
-        return OP(STM, parse_label(prs));
-    } else if (strcmp(id, "opc") == 0) {
-        assert_instr_in_text(prs, id, ln, col);
-        free(id);
-
-        if (prs->tok->type == TOK_EOL || prs->tok->type == TOK_EOF)
-            return OP(PRCA, 0);
-        else if (prs->tok->type == TOK_INT)
-            return OP(PRCI, parse_digit(prs));
-        else if (prs->tok->type == TOK_TOS)
-            return OP(PRCS, 0);
-
-        return OP(PRCM, parse_label(prs));
-    } else if (strcmp(id, "opi") == 0) {
-        assert_instr_in_text(prs, id, ln, col);
-        free(id);
-
-        if (prs->tok->type == TOK_EOL || prs->tok->type == TOK_EOF)
-            return OP(PRIA, 0);
-        else if (prs->tok->type == TOK_INT)
-            return OP(PRII, parse_digit(prs));
-        else if (prs->tok->type == TOK_TOS)
-            return OP(PRIS, 0);
-
-        return OP(PRIM, parse_label(prs));
-    } else if (strcmp(id, "add") == 0) {
-        assert_instr_in_text(prs, id, ln, col);
-        free(id);
-
-        if (prs->tok->type == TOK_TOS)
-            return OP(ADDS, 0);
-
-        return OP(prs->tok->type == TOK_INT ? ADDI : ADDM, parse_operand(prs));
-    } else if (strcmp(id, "sub") == 0) {
-        assert_instr_in_text(prs, id, ln, col);
-        free(id);
-
-        if (prs->tok->type == TOK_TOS)
-            return OP(SUBS, 0);
-
-        return OP(prs->tok->type == TOK_INT ? SUBI : SUBM, parse_operand(prs));
-    } else if (strcmp(id, "mul") == 0) {
-        assert_instr_in_text(prs, id, ln, col);
-        free(id);
-
-        if (prs->tok->type == TOK_TOS)
-            return OP(MULS, 0);
-
-        return OP(prs->tok->type == TOK_INT ? MULI : MULM, parse_operand(prs));
-    } else if (strcmp(id, "div") == 0) {
-        assert_instr_in_text(prs, id, ln, col);
-        free(id);
-
-        if (prs->tok->type == TOK_TOS)
-            return OP(DIVS, 0);
-
-        return OP(prs->tok->type == TOK_INT ? DIVI : DIVM, parse_operand(prs));
-    } else if (strcmp(id, "mod") == 0) {
-        assert_instr_in_text(prs, id, ln, col);
-        free(id);
-
-        if (prs->tok->type == TOK_TOS)
-            return OP(MODS, 0);
-
-        return OP(prs->tok->type == TOK_INT ? MODI : MODM, parse_operand(prs));
-    } else if (strcmp(id, "shl") == 0) {
-        assert_instr_in_text(prs, id, ln, col);
-        free(id);
-
-        if (prs->tok->type == TOK_TOS)
-            return OP(SHLS, 0);
-
-        return OP(prs->tok->type == TOK_INT ? SHLI : SHLM, parse_operand(prs));
-    } else if (strcmp(id, "shr") == 0) {
-        assert_instr_in_text(prs, id, ln, col);
-        free(id);
-
-        if (prs->tok->type == TOK_TOS)
-            return OP(SHRS, 0);
-
-        return OP(prs->tok->type == TOK_INT ? SHRI : SHRM, parse_operand(prs));
-    } else if (strcmp(id, "and") == 0) {
-        assert_instr_in_text(prs, id, ln, col);
-        free(id);
-
-        if (prs->tok->type == TOK_TOS)
-            return OP(ANDS, 0);
-
-        return OP(prs->tok->type == TOK_INT ? ANDI : ANDM, parse_operand(prs));
-    } else if (strcmp(id, "or") == 0) {
-        assert_instr_in_text(prs, id, ln, col);
-        free(id);
-
-        if (prs->tok->type == TOK_TOS)
-            return OP(ORS, 0);
-
-        return OP(prs->tok->type == TOK_INT ? ORI : ORM, parse_operand(prs));
-    } else if (strcmp(id, "xor") == 0) {
-        assert_instr_in_text(prs, id, ln, col);
-        free(id);
-
-        if (prs->tok->type == TOK_TOS)
-            return OP(XORS, 0);
-
-        return OP(prs->tok->type == TOK_INT ? XORI : XORM, parse_operand(prs));
-    } else if (strcmp(id, "not") == 0) {
-        assert_instr_in_text(prs, id, ln, col);
-        free(id);
-
-        if (prs->tok->type == TOK_EOL || prs->tok->type == TOK_EOF)
-            return OP(NOT, 0);
-        else if (prs->tok->type == TOK_TOS)
-            return OP(NOTS, 0);
-
-        return OP(NOTM, parse_label(prs));
-    } else if (strcmp(id, "neg") == 0) {
-        assert_instr_in_text(prs, id, ln, col);
-        free(id);
-
-        if (prs->tok->type == TOK_EOL || prs->tok->type == TOK_EOF)
-            return OP(NEG, 0);
-        else if (prs->tok->type == TOK_TOS)
-            return OP(NOTS, 0);
+typedef struct {
+    MnemonicKind kind;
+    Opcode none;
+    Opcode tos;
+    Opcode imm;
+    Opcode mem;
+    int flags;
+} Mnemonic;
 
-        return OP(NEGM, parse_label(prs));
-    } else if (strcmp(id, "jmp") == 0) {
-        assert_instr_in_text(prs, id, ln, col);
-        free(id);
+// Mnemonics are at most 3 characters, packed together they're
+// enough to tell them apart.
+#define PACK(a, b, c) ((uint32_t)(a) | (uint32_t)(b) << 8 | (uint32_t)(c) << 16)
 
-        if (prs->tok->type == TOK_EOL || prs->tok->type == TOK_EOF)
-            return OP(BRAA, 0);
+static Mnemonic find_mnemonic(const Token *id) {
+    uint32_t key = 0;
 
-        return OP(BRA, parse_operand(prs));
-    } else if (strcmp(id, "brz") == 0) {
-        assert_instr_in_text(prs, id, ln, col);
-        free(id);
-        return OP(BRZ, parse_operand(prs));
-    } else if (strcmp(id, "brp") == 0) {
-        assert_instr_in_text(prs, id, ln, col);
-        free(id);
-        return OP(BRP, parse_operand(prs));
-    } else if (strcmp(id, "brn") == 0) {
-        assert_instr_in_text(prs, id, ln, col);
-        free(id);
-        return OP(BRN, parse_operand(prs));
-    } else if (strcmp(id, "ipc") == 0) {
-        assert_instr_in_text(prs, id, ln, col);
-        free(id);
-
-        if (prs->tok->type == TOK_EOL || prs->tok->type == TOK_EOF)
-            return OP(RDCA, 0);
-        else if (prs->tok->type == TOK_TOS)
-            return OP(RDCS, 0);
-
-        return OP(RDCM, parse_label(prs));
-    } else if (strcmp(id, "ipi") == 0) {
-        assert_instr_in_text(prs, id, ln, col);
-        free(id);
-
-        if (prs->tok->type == TOK_EOL || prs->tok->type == TOK_EOF)
-            return OP(RDIA, 0);
-        else if (prs->tok->type == TOK_TOS)
-            return OP(RDIS, 0);
-
-        return OP(RDIM, parse_label(prs));
-    } else if (strcmp(id, "ref") == 0) {
-        assert_instr_in_text(prs, id, ln, col);
-        free(id);
-
-        if (prs->tok->type == TOK_TOS)
-            return OP(REFS, 0);
-
-        return OP(REFM, parse_label(prs));
-    } else if (strcmp(id, "ldd") == 0) {
-        assert_instr_in_text(prs, id, ln, col);
-        free(id);
-
-        if (prs->tok->type == TOK_EOL || prs->tok->type == TOK_EOF)
-            return OP(LDDA, 0);
-        else if (prs->tok->type == TOK_TOS)
-            return OP(LDDS, 0);
-
-        return OP(LDDM, parse_label(prs));
-    } else if (strcmp(id, "std") == 0) {
-        assert_instr_in_text(prs, id, ln, col);
-        free(id);
-
-        if (prs->tok->type == TOK_TOS)
-            return OP(STDS, 0);
-
-        return OP(STDM, parse_label(prs));
-    } else if (strcmp(id, "cmp") == 0) {
-        assert_instr_in_text(prs, id, ln, col);
-        free(id);
-
-        if (prs->tok->type == TOK_TOS)
-            return OP(CMPS, 0);
-
-        return OP(prs->tok->type == TOK_INT ? CMPI : CMPM, parse_operand(prs));
-    } else if (strcmp(id, "beq") == 0) {
-        assert_instr_in_text(prs, id, ln, col);
-        free(id);
-        return OP(BEQ, parse_label(prs));
-    } else if (strcmp(id, "bne") == 0) {
-        assert_instr_in_text(prs, id, ln, col);
-        free(id);
-        return OP(BNE, parse_label(prs));
-    } else if (strcmp(id, "blt") == 0) {
-        assert_instr_in_text(prs, id, ln, col);
-        free(id);
-        return OP(BLT, parse_label(prs));
-    } else if (strcmp(id, "ble") == 0) {
-        assert_instr_in_text(prs, id, ln, col);
-        free(id);
-        return OP(BLE, parse_label(prs));
-    } else if (strcmp(id, "bgt") == 0) {
-        assert_instr_in_text(prs, id, ln, col);
-        free(id);
-        return OP(BGT, parse_label(prs));
-    } else if (strcmp(id, "bge") == 0) {
-        assert_instr_in_text(prs, id, ln, col);
-        free(id);
-        return OP(BGE, parse_label(prs));
-    } else if (strcmp(id, "csr") == 0) {
-        assert_instr_in_text(prs, id, ln, col);
-        free(id);
-
-        // We want to push the return address
-        // so that the subroutine can pop it at the end.
-        // This way, the subroutine knows where to branch back to
-        // when it finds the RSR instruction.
-        // The return address will be the instruction after CSR.
-        // TOFIX: Will this break shit if there's no instruction after CSR?
-
-        root_push(OP(PSHI, root.op_count + 2));
-        return OP(CSR, parse_label(prs));
-    } else if (strcmp(id, "rsr") == 0) {
-        assert_instr_in_text(prs, id, ln, col);
-        free(id);
-        root_push(OP(POPA, 0));
-        return OP(BRAA, 0);
-    } else if (strcmp(id, "inc") == 0) {
-        assert_instr_in_text(prs, id, ln, col);
-        free(id);
-
-        if (prs->tok->type == TOK_EOL || prs->tok->type == TOK_EOF)
-            return OP(INCA, 0);
-        else if (prs->tok->type == TOK_TOS)
-            return OP(INCS, 0);
-
-        return OP(INCM, parse_label(prs));
-    } else if (strcmp(id, "dec") == 0) {
-        assert_instr_in_text(prs, id, ln, col);
-        free(id);
-
-        if (prs->tok->type == TOK_EOL || prs->tok->type == TOK_EOF)
-            return OP(DECA, 0);
-        else if (prs->tok->type == TOK_TOS)
-            return OP(DECS, 0);
-
-        return OP(DECM, parse_label(prs));
-    } else if (strcmp(id, "psh") == 0) {
-        assert_instr_in_text(prs, id, ln, col);
-        free(id);
-
-        if (prs->tok->type == TOK_EOL || prs->tok->type == TOK_EOF)
-            return OP(PSHA, 0);
-        else if (prs->tok->type == TOK_TOS)
-            return OP(PSHS, 0);
-
-        return OP(prs->tok->type == TOK_INT ? PSHI : PSHM, parse_operand(prs));
-    } else if (strcmp(id, "pop") == 0) {
-        assert_instr_in_text(prs, id, ln, col);
-        free(id);
-
-        if (prs->tok->type == TOK_EOL || prs->tok->type == TOK_EOF)
-            return OP(POPA, 0);
-
-        return OP(POPM, parse_label(prs));
-    } else if (strcmp(id, "drp") == 0) {
-        assert_instr_in_text(prs, id, ln, col);
-        free(id);
-        return OP(DRP, 0);
-    } else if (strcmp(id, "swp") == 0) {
-        assert_instr_in_text(prs, id, ln, col);
-        free(id);
-
-        if (prs->tok->type == TOK_EOL || prs->tok->type == TOK_EOF)
-            return OP(SWPS, 0);
-        else if (prs->tok->type == TOK_TOS)
-            return OP(SWPS, 0);
-
-        return OP(SWPM, parse_label(prs));
-    } else if (strcmp(id, "sez") == 0) {
-        assert_instr_in_text(prs, id, ln, col);
-        free(id);
-
-        if (prs->tok->type == TOK_EOL || prs->tok->type == TOK_EOF)
-            return OP(SEZA, 0);
-        else if (prs->tok->type == TOK_TOS)
-            return OP(SEZS, 0);
-
-        return OP(SEZM, parse_label(prs));
-    } else if (strcmp(id, "sep") == 0) {
-        assert_instr_in_text(prs, id, ln, col);
-        free(id);
-
-        if (prs->tok->type == TOK_EOL || prs->tok->type == TOK_EOF)
-            return OP(SEPA, 0);
-        else if (prs->tok->type == TOK_TOS)
-            return OP(SEPS, 0);
-
-        return OP(SEPM, parse_label(prs));
-    } else if (strcmp(id, "sen") == 0) {
-        assert_instr_in_text(prs, id, ln, col);
-        free(id);
-
-        if (prs->tok->type == TOK_EOL || prs->tok->type == TOK_EOF)
-            return OP(SENA, 0);
-        else if (prs->tok->type == TOK_TOS)
-            return OP(SENS, 0);
-
-        return OP(SENM, parse_label(prs));
-    } else if (strcmp(id, "seq") == 0) {
-        assert_instr_in_text(prs, id, ln, col);
-        free(id);
-
-        if (prs->tok->type == TOK_EOL || prs->tok->type == TOK_EOF)
-            return OP(SEQA, 0);
-        else if (prs->tok->type == TOK_TOS)
-            return OP(SEQS, 0);
-
-        return OP(SEQM, parse_label(prs));
-    } else if (strcmp(id, "sne") == 0) {
-        assert_instr_in_text(prs, id, ln, col);
-        free(id);
-
-        if (prs->tok->type == TOK_EOL || prs->tok->type == TOK_EOF)
-            return OP(SNEA, 0);
-        else if (prs->tok->type == TOK_TOS)
-            return OP(SNES, 0);
-
-        return OP(SNEM, parse_label(prs));
-    } else if (strcmp(id, "slt") == 0) {
-        assert_instr_in_text(prs, id, ln, col);
-        free(id);
-
-        if (prs->tok->type == TOK_EOL || prs->tok->type == TOK_EOF)
-            return OP(SLTA, 0);
-        else if (prs->tok->type == TOK_TOS)
-            return OP(SLTS, 0);
-
-        return OP(SLTM, parse_label(prs));
-    } else if (strcmp(id, "sle") == 0) {
-        assert_instr_in_text(prs, id, ln, col);
-        free(id);
-
-        if (prs->tok->type == TOK_EOL || prs->tok->type == TOK_EOF)
-            return OP(SLEA, 0);
-        else if (prs->tok->type == TOK_TOS)
-            return OP(SLES, 0);
-
-        return OP(SLEM, parse_label(prs));
-    } else if (strcmp(id, "sgt") == 0) {
-        assert_instr_in_text(prs, id, ln, col);
-        free(id);
-
-        if (prs->tok->type == TOK_EOL || prs->tok->type == TOK_EOF)
-            return OP(SGTA, 0);
-        else if (prs->tok->type == TOK_TOS)
-            return OP(SGTS, 0);
-
-        return OP(SGTM, parse_label(prs));
-    } else if (strcmp(id, "sge") == 0) {
-        assert_instr_in_text(prs, id, ln, col);
-        free(id);
-
-        if (prs->tok->type == TOK_EOL || prs->tok->type == TOK_EOF)
-            return OP(SGEA, 0);
-        else if (prs->tok->type == TOK_TOS)
-            return OP(SGES, 0);
-
-        return OP(SGEM, parse_label(prs));
-    }
-    // Unnamed data.
-    else if (strcmp(id, "dat") == 0) {
-        free(id);
-        return OP(DAT, parse_operand(prs));
-    }
-    // Instruction aliases.
-    else if (strcmp(id, "ops") == 0) {
-        assert_instr_in_text(prs, id, ln, col);
-        free(id);
-        return parse_ops(prs);
-    } else if (strcmp(id, "ips") == 0) {
-        assert_instr_in_text(prs, id, ln, col);
-        free(id);
-        return OP(IPS, parse_label(prs));
-    } else if (strcmp(id, "res") == 0) {
-        free(id);
-        return parse_res(prs);
+    if (id->len > 3)
+        return (Mnemonic){ NOT_MNEMONIC, NIL, NIL, NIL, NIL, 0 };
+
+    for (size_t i = 0; i < id->len; i++)
+        key |= (uint32_t)(unsigned char)tolower(id->value[i]) << (i * 8);
+
+#define MNEMONIC_CASE(a, b, c, kind, none, tos, imm, mem, flags) \
+    case PACK(a, b, c): return (Mnemonic){ kind, none, tos, imm, mem, flags };
+
+    switch (key) {
+        FOR_EACH_MNEMONIC(MNEMONIC_CASE)
+        default: return (Mnemonic){ NOT_MNEMONIC, NIL, NIL, NIL, NIL, 0 };
     }
 
+#undef MNEMONIC_CASE
+}
+
+Op parse_id(Parser *prs) {
+    // Tokens live as long as the parser, no need to copy it.
+    const Token *id = prs->tok;
+    const Mnemonic mnemonic = find_mnemonic(id);
+    eat(prs, TOK_ID);
+
     // Assume any non-instruction and data identifier
     // as a label.
-    return parse_label_decl(prs, id, ln, col);
+    if (mnemonic.kind == NOT_MNEMONIC)
+        return parse_label_decl(prs, copy_token(id, prs->root.arena), id->ln, id->col);
+
+    if (!(mnemonic.flags & ANYWHERE))
+        assert_instr_in_text(prs, id);
+
+    const TokenType type = prs->tok->type;
+
+    switch (mnemonic.kind) {
+        case BARE:
+            return OP(mnemonic.none, 0);
+        case CALL:
+            // We want to push the return address
+            // so that the subroutine can pop it at the end.
+            // This way, the subroutine knows where to branch back to
+            // when it finds the RSR instruction.
+            // The return address will be the instruction after CSR.
+            // TOFIX: Will this break shit if there's no instruction after CSR?
+
+            root_push(prs, OP(PSHI, prs->root.op_count + 2));
+            return OP(CSR, parse_label(prs));
+        case RETURN:
+            root_push(prs, OP(POPA, 0));
+            return OP(BRAA, 0);
+        case RESERVE:
+            return parse_res(prs);
+        default:
+            break;
+    }
+
+    if ((type == TOK_EOL || type == TOK_EOF) && mnemonic.none != NIL)
+        return OP(mnemonic.none, 0);
+    else if (type == TOK_TOS && mnemonic.tos != NIL)
+        return OP(mnemonic.tos, 0);
+    else if (type == TOK_INT && mnemonic.imm != NIL)
+        return OP(mnemonic.imm, parse_digit(prs));
+
+    return OP(mnemonic.mem, mnemonic.flags & OPERAND ? parse_operand(prs) : parse_label(prs));
 }
 
 Op parse_section_header(Parser *prs) {
@@ -893,30 +609,43 @@ Op parse_section_header(Parser *prs) {
 
     // TODO: Should we allow for sections to be redefined?
 
-    if (strcmp(prs->tok->value, "text") == 0) {
-        if (text_initialized) {
-            fprintf(stderr, "%s:%zu:%zu: error: redefinition of text section\n", prs->file, ln, col);
-            inc_errors();
+    if (token_is(prs->tok, "text")) {
+        if (prs->text_initialized) {
+            fprintf(prs->diag, "%s:%zu:%zu: error: redefinition of text section\n", prs->file, ln, col);
+            prs->errors++;
         } else
-            text_initialized = true;
+            prs->text_initialized = true;
 
-        in_text = true;
+        prs->in_text = true;
         eat(prs, TOK_ID);
         return parse_stmt(prs);
-    } else if (strcmp(prs->tok->value, "data") == 0) {
-        if (data_initialized) {
-            fprintf(stderr, "%s:%zu:%zu: error: redefinition of data section\n", prs->file, ln, col);
-            inc_errors();
+    } else if (token_is(prs->tok, "data")) {
+        if (prs->data_initialized) {
+            fprintf(prs->diag, "%s:%zu:%zu: error: redefinition of data section\n", prs->file, ln, col);
+            prs->errors++;
         } else
-            data_initialized = true;
+            prs->data_initialized = true;
 
-        in_text = false;
+        prs->in_text = false;
         eat(prs, TOK_ID);
         return parse_stmt(prs);
+    } else if (token_is(prs->tok, "memory") || token_is(prs->tok, "stack")) {
+        // Not sections but sizes, for the header of the machine code.
+        size_t *size = token_is(prs->tok, "memory") ? &prs->root.memory_cap : &prs->root.stack_cap;
+        eat(prs, TOK_ID);
+        const i64 value = parse_digit(prs);
+
+        if (value <= 0 || (u64)value > MAX_CAP) {
+            fprintf(prs->diag, "%s:%zu:%zu: error: size must be between 1 and %zu slots\n", prs->file, ln, col, MAX_CAP);
+            prs->errors++;
+        } else
+            *size = value;
+
+        return parse_stmt(prs);
     }
 
-    fprintf(stderr, "%s:%zu:%zu: error: invalid section '%s'\n", prs->file, ln, col, prs->tok->value);
-    inc_errors();
+    fprintf(prs->diag, "%s:%zu:%zu: error: invalid section '%.*s'\n", prs->file, ln, col, (int)prs->tok->len, prs->tok->value);
+    prs->errors++;
     eat(prs, TOK_ID);
     return parse_stmt(prs);
 }
@@ -932,68 +661,61 @@ Op parse_stmt(Parser *prs) {
         default: break;
     }
 
-    fprintf(stderr, "%s:%zu:%zu: error: invalid statement '%s'\n", prs->file, prs->tok->ln, prs->tok->col, tokentype_to_string(prs->tok->type));
-    inc_errors();
+    fprintf(prs->diag, "%s:%zu:%zu: error: invalid statement '%s'\n", prs->file, prs->tok->ln, prs->tok->col, tokentype_to_string(prs->tok->type));
+    prs->errors++;
     eat(prs, prs->tok->type);
     return NOOP;
 }
 
-void resolve_and_delete_labels() {
-    // EWWWWWWW gross!!
-    for (size_t i = 0; i < TABLE_SIZE && label_count > 0; i++) {
-        Label *label = &labels[i];
-
-        if (!label->used)
-            continue;
-
-        // Check if the unresolved value of this label
-        // is used anywhere in the program.
-        for (size_t j = 0; j < root.op_count; j++) {
-            Op *op = &root.ops[j];
-
-            if (op->operand == label->value) {
-                if (!label->resolved) {
-                    fprintf(stderr, "%s:%zu:%zu: error: undefined label '%s'\n", label->file, label->ln, label->col, label->name);
-                    inc_errors();
-                    break;
-                } else if (op->opcode == CSR && !label->is_subroutine) {
-                    fprintf(stderr, "%s:%zu:%zu: error: calling non-subroutine '%s'\n", label->file, label->ln, label->col, label->name);
-                    inc_errors();
-                    break;
-                }
+// Patches every use of each label, in the order they were found.
+void resolve_labels(Parser *prs) {
+    prs->root.symbols = arena_alloc(prs->root.arena, prs->label_count * sizeof(Symbol));
 
-                op->operand = label->resolved_value;
+    for (size_t i = 0; i < prs->label_count; i++) {
+        Label *label = &prs->labels[i];
+
+        if (label->resolved)
+            prs->root.symbols[prs->root.symbol_count++] = (Symbol){ label->name, label->name_len, label->resolved_value };
+
+        for (size_t j = 0; j < label->ref_count; j++) {
+            Op *op = &prs->root.ops[label->refs[j]];
+
+            if (!label->resolved) {
+                fprintf(prs->diag, "%s:%zu:%zu: error: undefined label '%s'\n", label->file, label->ln, label->col, label->name);
+                prs->errors++;
+                break;
+            } else if (op->opcode == CSR && !label->is_subroutine) {
+                fprintf(prs->diag, "%s:%zu:%zu: error: calling non-subroutine '%s'\n", label->file, label->ln, label->col, label->name);
+                prs->errors++;
+                break;
             }
-        }
 
-        free(label->name);
-        free(label->file);
-        label_count--;
+            op->operand = label->resolved_value;
+        }
     }
 }
 
-Root parse_root(char *file) {
-    // Just in case we're compiling multiple times and
-    // global variables are messed up.
-    text_initialized = data_initialized = in_text = false;
-    label_count = 0;
-
-    Parser prs = create_parser(file);
-    root = (Root){ .ops = malloc(STARTING_ROOT_CAP * sizeof(Op)), .op_count = 0, .op_capacity = STARTING_ROOT_CAP };
+// Everything an assembly needs lives in its parser, so
+// any number of them can run at once on different threads.
+// Errors are reported to diag.
+Root parse_root(char *file, FILE *diag) {
+    Parser prs = create_parser(file, diag);
 
     while (prs.tok->type != TOK_EOF)
-        root_push(parse_stmt(&prs));
+        root_push(&prs, parse_stmt(&prs));
 
-    resolve_and_delete_labels();
-    delete_parser(&prs);
+    resolve_labels(&prs);
 
-    if (root.op_count == 0)
+    if (prs.root.op_count == 0)
         // Just don't do anything.
-        root_push(OP(HLT, 0));
+        root_push(&prs, OP(HLT, 0));
 
+    Root root = prs.root;
+    root.errors = prs.errors;
+    delete_parser(&prs);
     return root;
 }
 
 void delete_root(Root *root) {
-    free(root->ops);
+    delete_arena(root->arena);
 }
\ No newline at end of file
@@ -2,25 +2,70 @@
 #define PARSER_H
 
 #include "token.h"
+#include "lexer.h"
+#include "arena.h"
 #include "vm.h"
 #include <stdio.h>
+#include <stdbool.h>
 
+// A label and the address it ended up at.
 typedef struct {
-    char *file;
-    Token *tokens;
-    size_t token_count;
-    Token *tok;
-    size_t pos;
-} Parser;
+    const char *name;
+    size_t name_len;
+    i64 value;
+} Symbol;
 
 typedef struct {
+    // Owns the ops, and everything else the assembly allocated.
+    Arena *arena;
     Op *ops;
     size_t op_count;
     size_t op_capacity;
+
+    // Every label that was defined, in the order they were.
+    Symbol *symbols;
+    size_t symbol_count;
+
+    // Sizes asked for with .memory and .stack, or 0.
+    size_t memory_cap;
+    size_t stack_cap;
+
+    // Errors reported while assembling, the ops are
+    // no good unless this is 0.
+    size_t errors;
 } Root;
 
+typedef struct Label Label;
+
+typedef struct {
+    char *file;
+
+    // Kept around for the tokens that point into its source.
+    Lexer lex;
+    Token *tokens;
+    size_t token_count;
+    Token *tok;
+    size_t pos;
+
+    // Labels in the order they were found, and an open
+    // addressing table of them by name.
+    Label *labels;
+    size_t label_count;
+    size_t label_capacity;
+    size_t *label_table;
+    size_t label_table_cap;
+
+    bool text_initialized;
+    bool data_initialized;
+    bool in_text;
+
+    Root root;
+    FILE *diag;
+    size_t errors;
+} Parser;
+
 Op parse_stmt(Parser *prs);
-Root parse_root(char *file);
+Root parse_root(char *file, FILE *diag);
 void delete_root(Root *root);
 
 #endif
\ No newline at end of file
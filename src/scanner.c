@@ -0,0 +1,216 @@
+#include "scanner.h"
+#include <stdint.h>
+
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
+// Whitespace like isspace() in the C locale: space, \t, \n, \v,
+// \f and \r.
+static bool is_space(char c) {
+    return c == ' ' || (unsigned char)(c - '\t') <= '\r' - '\t';
+}
+
+static u64 classify_scalar(const char *p) {
+    u64 spaces = 0;
+
+    for (int i = 0; i < 64; i++)
+        spaces |= (u64)is_space(p[i]) << i;
+
+    return spaces;
+}
+
+// Digits only binary doesn't have.
+static bool has_decimal_scalar(const char *p, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if ((unsigned char)(p[i] - '2') <= 7)
+            return true;
+    }
+
+    return false;
+}
+
+#ifdef __x86_64__
+// Unsigned x - low <= high - low, as a byte mask.
+static __m128i in_range_sse2(__m128i x, char low, char high) {
+    const __m128i offset = _mm_sub_epi8(x, _mm_set1_epi8(low));
+    return _mm_cmpeq_epi8(_mm_min_epu8(offset, _mm_set1_epi8(high - low)), offset);
+}
+
+static u64 classify_sse2(const char *p) {
+    u64 spaces = 0;
+
+    for (int i = 0; i < 64; i += 16) {
+        const __m128i x = _mm_loadu_si128((const __m128i *)(p + i));
+        const __m128i space = _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8(' ')), in_range_sse2(x, '\t', '\r'));
+        spaces |= (u64)(uint16_t)_mm_movemask_epi8(space) << i;
+    }
+
+    return spaces;
+}
+
+static bool has_decimal_sse2(const char *p, size_t len) {
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        if (_mm_movemask_epi8(in_range_sse2(_mm_loadu_si128((const __m128i *)(p + i)), '2', '9')) != 0)
+            return true;
+    }
+
+    return has_decimal_scalar(p + i, len - i);
+}
+
+__attribute__((target("avx2"))) static __m256i in_range_avx2(__m256i x, char low, char high) {
+    const __m256i offset = _mm256_sub_epi8(x, _mm256_set1_epi8(low));
+    return _mm256_cmpeq_epi8(_mm256_min_epu8(offset, _mm256_set1_epi8(high - low)), offset);
+}
+
+__attribute__((target("avx2"))) static u64 classify_avx2(const char *p) {
+    u64 spaces = 0;
+
+    for (int i = 0; i < 64; i += 32) {
+        const __m256i x = _mm256_loadu_si256((const __m256i *)(p + i));
+        const __m256i space = _mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8(' ')), in_range_avx2(x, '\t', '\r'));
+        spaces |= (u64)(uint32_t)_mm256_movemask_epi8(space) << i;
+    }
+
+    return spaces;
+}
+
+__attribute__((target("avx2"))) static bool has_decimal_avx2(const char *p, size_t len) {
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        if (_mm256_movemask_epi8(in_range_avx2(_mm256_loadu_si256((const __m256i *)(p + i)), '2', '9')) != 0)
+            return true;
+    }
+
+    return has_decimal_scalar(p + i, len - i);
+}
+#endif
+
+// The source is binary only if nothing in it could be decimal,
+// checked up front so a program starting with 11 isn't read as
+// 3 just because it hasn't got to a 2 yet.
+int scan_base(const char *src, size_t len, bool allow_binary) {
+    bool (*has_decimal)(const char *p, size_t len) = has_decimal_scalar;
+
+#ifdef __x86_64__
+    __builtin_cpu_init();
+    has_decimal = __builtin_cpu_supports("avx2") ? has_decimal_avx2 : has_decimal_sse2;
+#endif
+
+    return allow_binary && !has_decimal(src, len) ? 2 : 10;
+}
+
+// Scans from pos up to len, which can be part of a bigger
+// source as long as no number straddles it.
+void open_scanner(Scanner *scan, const char *src, size_t len, size_t pos, int base) {
+    scan->classify = classify_scalar;
+
+#ifdef __x86_64__
+    __builtin_cpu_init();
+    scan->classify = __builtin_cpu_supports("avx2") ? classify_avx2 : classify_sse2;
+#endif
+
+    scan->src = src;
+    scan->len = len;
+    scan->pos = scan->start = pos;
+    scan->base = base;
+
+    // Not a multiple of 64, so the first lookup loads a block.
+    scan->block = 1;
+    scan->spaces = 0;
+}
+
+static void load_block(Scanner *scan, size_t block) {
+    scan->block = block;
+    scan->spaces = scan->classify(scan->src + block);
+
+    if (scan->len - block < 64)
+        scan->spaces |= ~(u64)0 << (scan->len - block);
+}
+
+// The first byte from pos that is whitespace if space is set,
+// or isn't if it's not, or len.
+static size_t find(Scanner *scan, size_t pos, bool space) {
+    while (pos < scan->len) {
+        const size_t block = pos & ~(size_t)63;
+
+        if (block != scan->block)
+            load_block(scan, block);
+
+        const u64 bits = (space ? scan->spaces : ~scan->spaces) & ~(u64)0 << (pos - block);
+
+        if (bits != 0)
+            return block + __builtin_ctzll(bits);
+
+        pos = block + 64;
+    }
+
+    return scan->len;
+}
+
+// Like strtoll(), but it has to be the whole of it.
+static ScanResult parse_number(const char *p, size_t len, int base, i64 *value) {
+    const bool negative = len > 0 && p[0] == '-';
+    size_t i = len > 0 && (p[0] == '-' || p[0] == '+');
+
+    if (i == len)
+        return SCAN_INVALID;
+
+    // The magnitude of INT64_MIN is one more than INT64_MAX.
+    const u64 limit = negative ? (u64)INT64_MAX + 1 : (u64)INT64_MAX;
+    u64 n = 0;
+    bool overflow = false;
+
+    for (; i < len; i++) {
+        const u64 digit = (unsigned char)(p[i] - '0');
+
+        if (digit >= (u64)base)
+            return SCAN_INVALID;
+        else if (n > (limit - digit) / base)
+            overflow = true;
+        else
+            n = n * base + digit;
+    }
+
+    if (overflow)
+        return SCAN_RANGE;
+
+    *value = negative ? (i64)-n : (i64)n;
+    return SCAN_NUMBER;
+}
+
+ScanResult next_number(Scanner *scan, i64 *value) {
+    const size_t start = find(scan, scan->pos, false);
+
+    if (start == scan->len)
+        return SCAN_END;
+
+    const size_t end = find(scan, start, true);
+    scan->start = start;
+    scan->pos = end;
+    return parse_number(scan->src + start, end - start, scan->base, value);
+}
+
+// How many numbers there are from pos, without parsing them. One
+// starts wherever something that isn't whitespace follows something
+// that is.
+size_t count_numbers(Scanner *scan) {
+    size_t count = 0;
+    u64 before = 1;
+
+    for (size_t block = scan->pos & ~(size_t)63; block < scan->len; block += 64) {
+        load_block(scan, block);
+
+        // Anything before pos doesn't count.
+        const u64 spaces = scan->spaces | ~(~(u64)0 << (scan->pos > block ? scan->pos - block : 0));
+
+        count += __builtin_popcountll(~spaces & (spaces << 1 | before));
+        before = spaces >> 63;
+    }
+
+    scan->pos = scan->len;
+    return count;
+}
@@ -0,0 +1,44 @@
+#ifndef SCANNER_H
+#define SCANNER_H
+
+#include "vm.h"
+#include <stddef.h>
+#include <stdbool.h>
+
+// Text machine code gets read 64 bytes at a time, so the source
+// needs this much readable past its end. It doesn't matter what.
+#define SCAN_PADDING 64
+
+typedef enum {
+    SCAN_NUMBER,
+    SCAN_END,
+    SCAN_INVALID,
+    SCAN_RANGE
+} ScanResult;
+
+// Reads the numbers of text machine code straight out of the
+// source, finding where they start and end with a bitmask of the
+// whitespace in each block of 64 bytes.
+typedef struct {
+    const char *src;
+    size_t len;
+    size_t pos;
+
+    // Where the last number started.
+    size_t start;
+
+    // 2 or 10, decided once for the whole source.
+    int base;
+
+    // Bit i is set if block + i is whitespace or past the end.
+    size_t block;
+    u64 spaces;
+    u64 (*classify)(const char *p);
+} Scanner;
+
+int scan_base(const char *src, size_t len, bool allow_binary);
+void open_scanner(Scanner *scan, const char *src, size_t len, size_t pos, int base);
+ScanResult next_number(Scanner *scan, i64 *value);
+size_t count_numbers(Scanner *scan);
+
+#endif
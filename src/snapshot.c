@@ -0,0 +1,240 @@
+// Needed for pread() with -std=c11.
+#define _DEFAULT_SOURCE
+
+#include "snapshot.h"
+#include "bytecode.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static u64 align_snapshot(u64 n) {
+    return (n + IMAGE_ALIGN - 1) & ~(u64)(IMAGE_ALIGN - 1);
+}
+
+static void output_le(Output *out, u64 n, int bytes) {
+    for (int i = 0; i < bytes; i++)
+        output_char(out, (char)(n >> i * 8));
+}
+
+static u64 read_le(const uint8_t *p, int bytes) {
+    u64 n = 0;
+
+    for (int i = 0; i < bytes; i++)
+        n |= (u64)p[i] << i * 8;
+
+    return n;
+}
+
+// Zeros up to where the next array starts.
+static void output_padding(Output *out) {
+    const size_t written = out->flushed + out->len;
+    output_fill(out, 0, align_snapshot(written) - written);
+}
+
+// How many slots there are up to the last one that isn't 0.
+static size_t used_slots(const i64 *slots, size_t count) {
+    while (count > 0 && slots[count - 1] == 0)
+        count--;
+
+    return count;
+}
+
+bool save_snapshot(VM *vm, char *filename) {
+    const int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (fd < 0) {
+        fprintf(stderr, "vm: error: failed to write to file '%s'\n", filename);
+        return false;
+    }
+
+    const Input *in = &vm->input;
+    const size_t input_count = in->buffer != NULL ? in->len - in->pos : 0;
+    const size_t data_count = used_slots(vm->data, vm->memory_cap);
+    const size_t stack_count = used_slots(vm->stack, vm->stack_cap);
+    u64 fields[SNAPSHOT_FIELD_COUNT];
+
+    fields[SNAPSHOT_MEMORY_CAP] = vm->memory_cap;
+    fields[SNAPSHOT_STACK_CAP] = vm->stack_cap;
+    fields[SNAPSHOT_OP_COUNT] = vm->op_count;
+    fields[SNAPSHOT_PC] = vm->pc;
+    fields[SNAPSHOT_ACC] = vm->acc;
+    fields[SNAPSHOT_MAR] = vm->mar;
+    fields[SNAPSHOT_CIR] = vm->cir;
+    fields[SNAPSHOT_MDR] = vm->mdr;
+    fields[SNAPSHOT_SP] = vm->sp;
+    fields[SNAPSHOT_FLAGS] = pack_flags(vm);
+    fields[SNAPSHOT_DATA_COUNT] = data_count;
+    fields[SNAPSHOT_STACK_COUNT] = stack_count;
+    fields[SNAPSHOT_INPUT_COUNT] = input_count;
+    fields[SNAPSHOT_INPUT_AT] = SNAPSHOT_HEADER_SIZE;
+    fields[SNAPSHOT_OPCODES_AT] = align_snapshot(SNAPSHOT_HEADER_SIZE + input_count);
+    fields[SNAPSHOT_DATA_AT] = fields[SNAPSHOT_OPCODES_AT] + align_snapshot(vm->op_count * 4);
+    fields[SNAPSHOT_STACK_AT] = fields[SNAPSHOT_DATA_AT] + align_snapshot(data_count * 8);
+
+    Output out = { .cap = 0 };
+    open_output(&out, fd);
+    output_string(&out, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN);
+    output_le(&out, SNAPSHOT_VERSION, 4);
+
+    for (size_t i = 0; i < SNAPSHOT_FIELD_COUNT; i++)
+        output_le(&out, fields[i], 8);
+
+    if (input_count > 0)
+        output_string(&out, in->buffer + in->pos, input_count);
+
+    output_padding(&out);
+
+    for (size_t i = 0; i < vm->op_count; i++)
+        output_le(&out, vm->instructions[i], 4);
+
+    output_padding(&out);
+
+    for (size_t i = 0; i < data_count; i++)
+        output_le(&out, vm->data[i], 8);
+
+    output_padding(&out);
+
+    for (size_t i = 0; i < stack_count; i++)
+        output_le(&out, vm->stack[i], 8);
+
+    output_padding(&out);
+
+    const bool written = close_output(&out);
+
+    if (close(fd) != 0 || !written) {
+        fprintf(stderr, "vm: error: failed to write to file '%s'\n", filename);
+        return false;
+    }
+
+    return true;
+}
+
+static bool read_all(int fd, void *buffer, size_t len, size_t offset) {
+    size_t done = 0;
+
+    while (done < len) {
+        const ssize_t n = pread(fd, (char *)buffer + done, len - done, offset + done);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        else if (n <= 0)
+            return false;
+
+        done += n;
+    }
+
+    return true;
+}
+
+// An array has to be whole, padding and all.
+static bool array_fits(u64 at, u64 bytes, u64 size) {
+    return at % IMAGE_ALIGN == 0 && at <= size && size - at >= align_snapshot(bytes);
+}
+
+static bool check_fields(const u64 *fields, u64 size) {
+    const u64 memory_cap = fields[SNAPSHOT_MEMORY_CAP];
+    const u64 stack_cap = fields[SNAPSHOT_STACK_CAP];
+
+    return memory_cap > 0 && memory_cap <= MAX_CAP && stack_cap > 0 && stack_cap <= MAX_CAP
+           && fields[SNAPSHOT_OP_COUNT] <= memory_cap && fields[SNAPSHOT_DATA_COUNT] <= memory_cap
+           && fields[SNAPSHOT_STACK_COUNT] <= stack_cap && fields[SNAPSHOT_SP] <= stack_cap
+           && fields[SNAPSHOT_PC] <= fields[SNAPSHOT_OP_COUNT] && fields[SNAPSHOT_CIR] < OPCODE_COUNT
+           && fields[SNAPSHOT_INPUT_AT] <= size && size - fields[SNAPSHOT_INPUT_AT] >= fields[SNAPSHOT_INPUT_COUNT]
+           && array_fits(fields[SNAPSHOT_OPCODES_AT], fields[SNAPSHOT_OP_COUNT] * 4, size)
+           && array_fits(fields[SNAPSHOT_DATA_AT], fields[SNAPSHOT_DATA_COUNT] * 8, size)
+           && array_fits(fields[SNAPSHOT_STACK_AT], fields[SNAPSHOT_STACK_COUNT] * 8, size);
+}
+
+// Mapped if it can be, so only the pages the program goes on to
+// touch are ever read.
+static bool load_array(VM *vm, void *region, size_t count, int width, int fd, size_t at) {
+    if (map_file(vm, region, count * width, fd, at))
+        return true;
+
+    uint8_t *bytes = malloc(count * width);
+    const bool read = read_all(fd, bytes, count * width, at);
+
+    for (size_t i = 0; read && i < count; i++) {
+        if (width == 4)
+            ((Opcode *)region)[i] = (Opcode)read_le(bytes + i * 4, 4);
+        else
+            ((i64 *)region)[i] = (i64)read_le(bytes + i * 8, 8);
+    }
+
+    free(bytes);
+    return read;
+}
+
+static bool unpack_snapshot(VM *vm, const u64 *fields, int fd) {
+    // The sizes are part of the state, so they win over any given
+    // on the command line.
+    vm->memory_cap = fields[SNAPSHOT_MEMORY_CAP];
+    vm->stack_cap = fields[SNAPSHOT_STACK_CAP];
+    map_vm(vm);
+
+    if (!load_array(vm, vm->instructions, fields[SNAPSHOT_OP_COUNT], 4, fd, fields[SNAPSHOT_OPCODES_AT])
+        || !load_array(vm, vm->data, fields[SNAPSHOT_DATA_COUNT], 8, fd, fields[SNAPSHOT_DATA_AT])
+        || !load_array(vm, vm->stack, fields[SNAPSHOT_STACK_COUNT], 8, fd, fields[SNAPSHOT_STACK_AT]))
+        return false;
+
+    vm->op_count = fields[SNAPSHOT_OP_COUNT];
+    vm->pc = fields[SNAPSHOT_PC];
+    vm->acc = fields[SNAPSHOT_ACC];
+    vm->mar = fields[SNAPSHOT_MAR];
+    vm->cir = fields[SNAPSHOT_CIR];
+    vm->mdr = fields[SNAPSHOT_MDR];
+    vm->sp = fields[SNAPSHOT_SP];
+    unpack_flags(vm, fields[SNAPSHOT_FLAGS]);
+
+    // What was left to read gets read before anything new.
+    const size_t input_count = fields[SNAPSHOT_INPUT_COUNT];
+
+    if (input_count > 0) {
+        vm->input.cap = input_count > DEFAULT_INPUT_CAP ? input_count : DEFAULT_INPUT_CAP;
+        open_input(&vm->input, NULL);
+        vm->input.len = input_count;
+        return read_all(fd, vm->input.buffer, input_count, fields[SNAPSHOT_INPUT_AT]);
+    }
+
+    return true;
+}
+
+// False if it can't be restored, after saying why.
+bool load_snapshot(VM *vm, char *filename) {
+    const int fd = open(filename, O_RDONLY);
+
+    if (fd < 0) {
+        fprintf(stderr, "loader: error: no such file '%s'\n", filename);
+        return false;
+    }
+
+    struct stat st;
+    uint8_t header[SNAPSHOT_HEADER_SIZE];
+    u64 fields[SNAPSHOT_FIELD_COUNT];
+    bool loaded = fstat(fd, &st) == 0 && read_all(fd, header, sizeof(header), 0)
+                  && memcmp(header, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN) == 0
+                  && read_le(header + SNAPSHOT_MAGIC_LEN, 4) == SNAPSHOT_VERSION;
+
+    for (size_t i = 0; loaded && i < SNAPSHOT_FIELD_COUNT; i++)
+        fields[i] = read_le(header + SNAPSHOT_MAGIC_LEN + 4 + i * 8, 8);
+
+    if (!loaded || !check_fields(fields, st.st_size)) {
+        fprintf(stderr, "loader: error: invalid snapshot in file '%s'\n", filename);
+        close(fd);
+        return false;
+    }
+
+    loaded = unpack_snapshot(vm, fields, fd);
+    close(fd);
+
+    if (!loaded)
+        fprintf(stderr, "loader: error: failed to read file '%s'\n", filename);
+
+    return loaded;
+}
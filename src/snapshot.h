@@ -0,0 +1,55 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "vm.h"
+#include <stdbool.h>
+
+// Everything a stopped VM needs to carry on from where it was,
+// laid out so memory can be mapped straight back in:
+//   magic    "\x7fMSN"
+//   version  SNAPSHOT_VERSION, 4 bytes
+// Then SNAPSHOT_FIELD_COUNT 8 byte little endian numbers, in the
+// order of the enum below. Input that was read but not used yet
+// comes right after them, then the opcodes, the data and the
+// stack as arrays of 4 and 8 byte little endian numbers, each
+// starting at a multiple of IMAGE_ALIGN and padded with zeros to
+// one. Data and stack past the last slot that isn't 0 are left
+// out, they come back as 0 anyway.
+#define SNAPSHOT_MAGIC "\x7fMSN"
+#define SNAPSHOT_MAGIC_LEN 4
+#define SNAPSHOT_VERSION 1
+
+enum {
+    SNAPSHOT_MEMORY_CAP,
+    SNAPSHOT_STACK_CAP,
+    SNAPSHOT_OP_COUNT,
+    SNAPSHOT_PC,
+    SNAPSHOT_ACC,
+    SNAPSHOT_MAR,
+    SNAPSHOT_CIR,
+    SNAPSHOT_MDR,
+    SNAPSHOT_SP,
+
+    // Packed like pack_flags() does.
+    SNAPSHOT_FLAGS,
+
+    // Slots of data and stack, and bytes of input, that are saved.
+    SNAPSHOT_DATA_COUNT,
+    SNAPSHOT_STACK_COUNT,
+    SNAPSHOT_INPUT_COUNT,
+
+    // Where each of them starts in the file.
+    SNAPSHOT_OPCODES_AT,
+    SNAPSHOT_DATA_AT,
+    SNAPSHOT_STACK_AT,
+    SNAPSHOT_INPUT_AT,
+
+    SNAPSHOT_FIELD_COUNT
+};
+
+#define SNAPSHOT_HEADER_SIZE (SNAPSHOT_MAGIC_LEN + 4 + SNAPSHOT_FIELD_COUNT * 8)
+
+bool save_snapshot(VM *vm, char *filename);
+bool load_snapshot(VM *vm, char *filename);
+
+#endif
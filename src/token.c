@@ -1,15 +1,37 @@
 #include "token.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdbool.h>
 #include <assert.h>
+#include <ctype.h>
 
-Token create_token(TokenType type, char *value, size_t ln, size_t col) {
-    return (Token){ .type = type, .value = value, .ln = ln, .col = col };
+Token create_token(TokenType type, const char *value, size_t len, size_t ln, size_t col) {
+    return (Token){ .type = type, .value = value, .len = len, .number = 0, .ln = ln, .col = col };
 }
 
-void delete_token(Token *tok) {
-    free(tok->value);
+// Identifiers aren't case sensitive.
+bool token_is(const Token *tok, const char *id) {
+    if (tok->type != TOK_ID || strlen(id) != tok->len)
+        return false;
+
+    for (size_t i = 0; i < tok->len; i++) {
+        if (tolower(tok->value[i]) != id[i])
+            return false;
+    }
+
+    return true;
+}
+
+// Identifiers come out in lowercase.
+char *copy_token(const Token *tok, Arena *arena) {
+    char *copy = arena_alloc(arena, tok->len + 1);
+
+    for (size_t i = 0; i < tok->len; i++)
+        copy[i] = tok->type == TOK_ID ? tolower(tok->value[i]) : tok->value[i];
+
+    copy[tok->len] = '\0';
+    return copy;
 }
 
 char *tokentype_to_string(TokenType type) {
@@ -28,4 +50,4 @@ char *tokentype_to_string(TokenType type) {
 
     assert(false);
     return "undefined";
-}
\ No newline at end of file
+}
@@ -1,7 +1,10 @@
 #ifndef TOKEN_H
 #define TOKEN_H
 
+#include "arena.h"
 #include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
 
 typedef enum {
     TOK_EOF,
@@ -17,13 +20,23 @@ typedef enum {
 
 typedef struct {
     TokenType type;
-    char *value;
+
+    // Where the token is in the source, not terminated, so it's only
+    // good for as long as the lexer's source is. Strings that had to
+    // be joined together are a terminated copy in the arena instead.
+    const char *value;
+    size_t len;
+
+    // What ints come to, including characters.
+    int64_t number;
+
     size_t ln;
     size_t col;
 } Token;
 
-Token create_token(TokenType type, char *value, size_t ln, size_t col);
-void delete_token(Token *tok);
+Token create_token(TokenType type, const char *value, size_t len, size_t ln, size_t col);
+bool token_is(const Token *tok, const char *id);
+char *copy_token(const Token *tok, Arena *arena);
 char *tokentype_to_string(TokenType type);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,411 @@
+#include "verifier.h"
+#include "vm.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Proves a program can't hit the checks that the decoded engines
+// do on every instruction, so they can run it without them:
+//   - The stack never overflows or underflows. Every instruction
+//     has to be reached with the same stack depth on every path.
+//     Subroutines are checked once, relative to the depth they're
+//     called at, and have to leave the stack how they found it
+//     without writing over their return address.
+//   - Nothing stores into the operand of an instruction, so the
+//     decoded operands never go stale.
+// Along the way it checks what it can about everything else:
+// opcodes, branch targets and memory operands. Computed jumps
+// other than returns from subroutines can't be followed, programs
+// using them keep the checks.
+
+// Subroutine entries that haven't been checked yet, or are being.
+#define UNCHECKED -1
+#define CHECKING -2
+
+typedef struct {
+    VM *vm;
+
+    // Depth of the stack at each instruction, relative to the start
+    // of the subroutine that reached it, and which subroutine that
+    // was as its entry + 1, or 0 if unreached.
+    i64 *depths;
+    size_t *owners;
+
+    // Most a subroutine grows the stack by, at its entry.
+    i64 *growth;
+
+    bool report;
+} Verifier;
+
+static bool reject(Verifier *verifier, size_t address, const char *reason) {
+    if (verifier->report)
+        fprintf(stderr, "vm: note: program not verified: %s at address %zu\n", reason, address);
+
+    return false;
+}
+
+static bool is_memory_form(Opcode opcode) {
+    switch (opcode) {
+        case LDM:
+        case STM:
+        case PRCM:
+        case PRIM:
+        case PRSM:
+        case CPYM:
+        case FILM:
+        case CMBM:
+        case ADDM:
+        case SUBM:
+        case MULM:
+        case DIVM:
+        case MODM:
+        case SHLM:
+        case SHRM:
+        case ANDM:
+        case ORM:
+        case XORM:
+        case NOTM:
+        case NEGM:
+        case RDCM:
+        case RDIM:
+        case LDDM:
+        case CMPM:
+        case INCM:
+        case DECM:
+        case PSHM:
+        case POPM:
+        case SWPM:
+        case SEZM:
+        case SEPM:
+        case SENM:
+        case SEQM:
+        case SNEM:
+        case SLTM:
+        case SLEM:
+        case SGTM:
+        case SGEM:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool is_store(Opcode opcode) {
+    switch (opcode) {
+        case STM:
+        case NOTM:
+        case NEGM:
+        case RDCM:
+        case RDIM:
+        case INCM:
+        case DECM:
+        case POPM:
+        case SWPM:
+        case SEZM:
+        case SEPM:
+        case SENM:
+        case SEQM:
+        case SNEM:
+        case SLTM:
+        case SLEM:
+        case SGTM:
+        case SGEM:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Writes the top of the stack in place.
+static bool is_stack_store(Opcode opcode) {
+    switch (opcode) {
+        case STAS:
+        case NOTS:
+        case NEGS:
+        case RDCS:
+        case RDIS:
+        case INCS:
+        case DECS:
+        case SWPS:
+        case SEZS:
+        case SEPS:
+        case SENS:
+        case SEQS:
+        case SNES:
+        case SLTS:
+        case SLES:
+        case SGTS:
+        case SGES:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool is_conditional(Opcode opcode) {
+    switch (opcode) {
+        case BRZ:
+        case BRP:
+        case BRN:
+        case BEQ:
+        case BNE:
+        case BLT:
+        case BLE:
+        case BGT:
+        case BGE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Stores at constant addresses can only hit data, stores
+// through pointers could hit anything.
+static bool check_stores(Verifier *verifier) {
+    VM *vm = verifier->vm;
+
+    for (size_t i = 0; i < vm->op_count; i++) {
+        const Opcode opcode = vm->instructions[i];
+        const i64 operand = vm->data[i];
+        i64 length = 1;
+
+        if (opcode == STDM || opcode == CPYI || opcode == CPYM || opcode == FILI || opcode == FILM)
+            return reject(verifier, i, "store through a pointer");
+        else if (opcode == IPS)
+            length = 128;
+        else if (!is_store(opcode))
+            continue;
+
+        for (i64 j = operand; j < operand + length; j++) {
+            if (j < 0 || (u64)j >= vm->op_count)
+                continue;
+
+            if (vm->instructions[j] != NOP && vm->instructions[j] != DAT)
+                return reject(verifier, i, "store into the operand of an instruction");
+        }
+    }
+
+    return true;
+}
+
+static i64 check_subroutine(Verifier *verifier, size_t entry);
+
+// Reach address with the stack at depth, from the subroutine owner.
+static bool reach(Verifier *verifier, size_t **worklist, size_t *count, size_t *cap, size_t from, size_t address, i64 depth, size_t owner) {
+    VM *vm = verifier->vm;
+
+    if (address >= vm->op_count)
+        return reject(verifier, from, "runs off the end of the program");
+
+    if (verifier->owners[address] == 0) {
+        verifier->owners[address] = owner;
+        verifier->depths[address] = depth;
+
+        if (*count == *cap) {
+            *cap *= 2;
+            *worklist = realloc(*worklist, *cap * sizeof(size_t));
+        }
+
+        (*worklist)[(*count)++] = address;
+        return true;
+    } else if (verifier->owners[address] != owner)
+        return reject(verifier, address, "code shared between subroutines");
+    else if (verifier->depths[address] != depth)
+        return reject(verifier, address, "stack depth differs between paths");
+
+    return true;
+}
+
+// Follow every path from entry, which is reached with the stack at
+// depth. Returns the deepest the stack gets, or -1 if it can't be
+// proven safe.
+static i64 check_paths(Verifier *verifier, size_t entry, i64 depth) {
+    VM *vm = verifier->vm;
+    const bool subroutine = depth > 0;
+    const size_t owner = entry + 1;
+    const i64 cap = (i64)vm->stack_cap;
+    i64 deepest = depth;
+
+    size_t worklist_cap = 64;
+    size_t count = 0;
+    size_t *worklist = malloc(worklist_cap * sizeof(size_t));
+    bool ok = reach(verifier, &worklist, &count, &worklist_cap, entry, entry, depth, owner);
+
+#define REACH(address, depth) (ok = reach(verifier, &worklist, &count, &worklist_cap, i, (address), (depth), owner))
+#define REJECT(reason) (ok = reject(verifier, i, (reason)))
+
+    while (ok && count > 0) {
+        const size_t i = worklist[--count];
+        const Opcode opcode = vm->instructions[i];
+        const i64 operand = vm->data[i];
+        const i64 d = verifier->depths[i];
+
+        // Subroutines can't touch the return address, except to return.
+        const i64 floor = subroutine ? 1 : 0;
+
+        if ((size_t)opcode >= OPCODE_COUNT) {
+            REJECT("undefined instruction");
+            break;
+        }
+
+        // With only the return address on the stack, the top is it.
+        if (subroutine && d <= floor && is_stack_store(opcode)) {
+            REJECT("store into the return address");
+            break;
+        } else if (subroutine && (opcode == STDS || opcode == LDDS)) {
+            REJECT("stack access through a pointer in a subroutine");
+            break;
+        }
+
+        if (is_memory_form(opcode) && (operand < 0 || (u64)operand >= vm->memory_cap)) {
+            REJECT("memory operand out of range");
+            break;
+        } else if (opcode == IPS && (operand < 0 || (u64)operand + 128 > vm->memory_cap)) {
+            REJECT("string input out of range");
+            break;
+        }
+
+        switch (opcode) {
+            case HLT:
+                break;
+            case PSHI:
+                // The return address of a call, csr is always this pair.
+                if (i + 1 < vm->op_count && vm->instructions[i + 1] == CSR && operand == (i64)i + 2) {
+                    const i64 target = vm->data[i + 1];
+
+                    if (target < 0 || (u64)target >= vm->op_count) {
+                        REJECT("call out of the program");
+                        break;
+                    }
+
+                    const i64 growth = check_subroutine(verifier, target);
+
+                    if (growth < 0) {
+                        ok = false;
+                        break;
+                    } else if (d + growth > cap) {
+                        REJECT("stack overflow");
+                        break;
+                    }
+
+                    if (d + growth > deepest)
+                        deepest = d + growth;
+
+                    REACH(i + 2, d);
+                    break;
+                }
+
+                // fall through
+            case PSHA:
+            case PSHM:
+            case PSHS:
+                if (d + 1 > cap) {
+                    REJECT("stack overflow");
+                    break;
+                }
+
+                if (d + 1 > deepest)
+                    deepest = d + 1;
+
+                REACH(i + 1, d + 1);
+                break;
+            case POPA:
+                // Returning from a subroutine, rsr is always this pair.
+                if (subroutine && d == 1 && i + 1 < vm->op_count && vm->instructions[i + 1] == BRAA)
+                    break;
+
+                // fall through
+            case POPM:
+            case DRP:
+                if (d - 1 < floor) {
+                    REJECT("stack underflow");
+                    break;
+                }
+
+                REACH(i + 1, d - 1);
+                break;
+            case BRA:
+                if (operand < 0 || (u64)operand >= vm->op_count) {
+                    REJECT("branch out of the program");
+                    break;
+                }
+
+                REACH(operand, d);
+                break;
+            case BRAA:
+                REJECT("computed jump");
+                break;
+            case CSR:
+                REJECT("call without a return address");
+                break;
+            default:
+                if (is_conditional(opcode)) {
+                    if (operand < 0 || (u64)operand >= vm->op_count) {
+                        REJECT("branch out of the program");
+                        break;
+                    }
+
+                    REACH(operand, d);
+                }
+
+                if (ok)
+                    REACH(i + 1, d);
+
+                break;
+        }
+    }
+
+#undef REACH
+#undef REJECT
+
+    free(worklist);
+    return ok ? deepest : -1;
+}
+
+// How much a call to the subroutine at entry can grow the stack by,
+// counting the return address, or -1 if it can't be proven safe.
+static i64 check_subroutine(Verifier *verifier, size_t entry) {
+    i64 *growth = &verifier->growth[entry];
+
+    if (*growth == CHECKING) {
+        reject(verifier, entry, "recursive subroutine");
+        return -1;
+    } else if (*growth == UNCHECKED) {
+        *growth = CHECKING;
+        *growth = check_paths(verifier, entry, 1);
+
+        // Don't go through it all again on the next call.
+        if (*growth < 0)
+            return -1;
+    }
+
+    return *growth;
+}
+
+bool verify_vm(VM *vm, bool report) {
+    Verifier verifier = {
+        .vm = vm,
+        .depths = malloc(vm->op_count * sizeof(i64)),
+        .owners = calloc(vm->op_count, sizeof(size_t)),
+        .growth = malloc(vm->op_count * sizeof(i64)),
+        .report = report
+    };
+
+    for (size_t i = 0; i < vm->op_count; i++)
+        verifier.growth[i] = UNCHECKED;
+
+    // Depths are counted from an empty stack, which a restored
+    // snapshot might not start with.
+    const bool verified = vm->op_count > 0 && (vm->sp == 0 || reject(&verifier, vm->pc, "stack in use at the start"))
+                          && check_stores(&verifier) && check_paths(&verifier, vm->pc, 0) >= 0;
+
+    free(verifier.depths);
+    free(verifier.owners);
+    free(verifier.growth);
+
+    if (verified && report)
+        fprintf(stderr, "vm: note: program verified\n");
+
+    return verified;
+}
@@ -0,0 +1,9 @@
+#ifndef VERIFIER_H
+#define VERIFIER_H
+
+#include "vm.h"
+#include <stdbool.h>
+
+bool verify_vm(VM *vm, bool report);
+
+#endif
@@ -1,4 +1,8 @@
+// Needed for MAP_ANONYMOUS and madvise() with -std=c11.
+#define _DEFAULT_SOURCE
+
 #include "vm.h"
+#include "jit.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,32 +10,146 @@
 #include <stdint.h>
 #include <inttypes.h>
 #include <assert.h>
+#include <errno.h>
+
+#include <sys/mman.h>
+#include <unistd.h>
 
-#define TOS vm->stack[vm->sp == 0 ? 0 : vm->sp - 1]
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
+// Regions at least this big are worth backing with transparent
+// huge pages, it's the size of one on x86-64.
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)
 
 VM *create_vm() {
     VM *vm = malloc(sizeof(VM));
     vm->acc = vm->pc = vm->mar = vm->cir = vm->mdr = vm->op_count = 0;
 
-    memset(vm->instructions, NOP, MEMORY_CAP - 1);
-    memset(vm->data, NOP, MEMORY_CAP - 1);
+    vm->instructions = NULL;
+    vm->data = NULL;
+    vm->memory_cap = 0;
+    vm->code = NULL;
+    vm->fusions = ~(u64)0;
+    vm->histogram = NULL;
+
+    vm->cf = vm->zf = vm->nf = false;
+    vm->stack = NULL;
+    vm->stack_cap = 0;
+    vm->sp = 0;
 
+    // Like stdio, a terminal sees every line as it's printed.
+    vm->output = (Output){ .buffer = NULL, .len = 0, .cap = 0, .line = isatty(STDOUT_FILENO) };
+    vm->input = (Input){ .buffer = NULL, .cap = 0 };
+
+    vm->engine = ENGINE_SWITCH;
     vm->running = false;
+    vm->verified = false;
     return vm;
 }
 
 void delete_vm(VM *vm) {
+    if (vm->instructions != NULL)
+        munmap(vm->instructions, vm->memory_cap * sizeof(Opcode));
+
+    if (vm->data != NULL)
+        munmap(vm->data, vm->memory_cap * sizeof(i64));
+
+    if (vm->stack != NULL)
+        munmap(vm->stack, vm->stack_cap * sizeof(i64));
+
+    close_output(&vm->output);
+    close_input(&vm->input);
+    free(vm->code);
+    free(vm->histogram);
     free(vm);
 }
 
 __attribute__((noreturn)) void kill(VM *vm) {
+    flush_output(&vm->output);
     fprintf(stderr, "aborting...\n");
     delete_vm(vm);
     exit(EXIT_FAILURE);
 }
 
+// Anonymous mappings are zeroed and only backed once they're
+// touched, so asking for a lot of memory costs nothing up front.
+// That zero is NOP for the instructions too.
+static void *map_region(VM *vm, size_t size) {
+    void *region = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+    if (region == MAP_FAILED) {
+        fprintf(stderr, "vm: error: failed to map %zu bytes of memory\n", size);
+        kill(vm);
+    }
+
+#ifdef MADV_HUGEPAGE
+    if (size >= HUGE_PAGE_SIZE)
+        madvise(region, size, MADV_HUGEPAGE);
+#endif
+
+    return region;
+}
+
+// Map memory and the stack, with the default size
+// for whichever wasn't picked.
+void map_vm(VM *vm) {
+    if (vm->data != NULL)
+        return;
+
+    if (vm->memory_cap == 0)
+        vm->memory_cap = DEFAULT_MEMORY_CAP;
+
+    if (vm->stack_cap == 0)
+        vm->stack_cap = DEFAULT_STACK_CAP;
+
+    vm->instructions = map_region(vm, vm->memory_cap * sizeof(Opcode));
+    vm->data = map_region(vm, vm->memory_cap * sizeof(i64));
+    vm->stack = map_region(vm, vm->stack_cap * sizeof(i64));
+}
+
+// Maps size bytes at offset into fd over the start of region, one
+// of the memories map_vm() made. They're copy on write, so nothing's
+// read until it's touched, and every process mapping the same file
+// shares its pages. False if it can't be done here and they have to
+// be copied in instead.
+bool map_file(VM *vm, void *region, size_t size, int fd, size_t offset) {
+    const long page = sysconf(_SC_PAGESIZE);
+
+    if (sizeof(Opcode) != 4 || __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__ || page <= 0 || offset % page != 0)
+        return false;
+
+    // The file is padded out to whole pages.
+    const size_t mask = (size_t)page - 1;
+
+    if (size > 0 && mmap(region, (size + mask) & ~mask, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, offset) == MAP_FAILED) {
+        fprintf(stderr, "vm: error: failed to map program image\n");
+        kill(vm);
+    }
+
+    return true;
+}
+
+// Maps a program image's opcodes and operands, at those offsets
+// into fd, over the start of memory. False if the ops have to be
+// copied in instead.
+bool map_image(VM *vm, int fd, size_t opcodes_at, size_t operands_at, u64 op_count) {
+    map_vm(vm);
+
+    // Both are aligned the same, so if one maps the other does.
+    if (op_count > vm->memory_cap || !map_file(vm, vm->instructions, op_count * sizeof(Opcode), fd, opcodes_at)
+        || !map_file(vm, vm->data, op_count * sizeof(i64), fd, operands_at))
+        return false;
+
+    vm->op_count = op_count;
+    return true;
+}
+
+// Past the program there's nothing but NOPs, so
+// running into it is running off the end of memory.
 static void fetch(VM *vm) {
-    if ((size_t)vm->pc >= MEMORY_CAP) {
+    if ((u64)vm->pc >= vm->op_count) {
         fprintf(stderr, "vm: error: reached end of memory\n");
         kill(vm);
     }
@@ -58,7 +176,7 @@ static void set_flags(VM *vm) {
 }
 
 void assert_no_overflow(VM *vm) {
-    if (vm->sp == STACK_CAP) {
+    if ((size_t)vm->sp == vm->stack_cap) {
         fprintf(stderr, "vm: error: stack overflow\n");
         kill(vm);
     }
@@ -71,443 +189,858 @@ void assert_no_underflow(VM *vm) {
     }
 }
 
-// TODO: This is really gross and we should implement
-// tail calling like tuxifan said.
-static void execute(VM *vm) {
-    switch (vm->cir) {
-        case NOP:
-        case DAT: break;
-        case HLT:
-            vm->running = false;
-            break;
-        case LDI:
-            vm->acc = vm->mdr;
-            break;
-        case LDM:
-            vm->acc = vm->data[vm->mdr];
-            break;
-        case LDAS:
-            vm->acc = TOS;
-            break;
-        case STM:
-            vm->data[vm->mdr] = vm->acc;
-            break;
-        case STAS:
-            TOS = vm->acc;
-            break;
-        case PRCI:
-            fputc((char)vm->mdr, stdout);
-            break;
-        case PRCM:
-            fputc((char)vm->data[vm->mdr], stdout);
-            break;
-        case PRCA:
-            fputc((char)vm->acc, stdout);
-            break;
-        case PRCS:
-            fputc((char)TOS, stdout);
-            break;
-        case PRII:
-            fprintf(stdout, "%" PRId64, vm->mdr);
-            break;
-        case PRIM:
-            fprintf(stdout, "%" PRId64, vm->data[vm->mdr]);
-            break;
-        case PRIA:
-            fprintf(stdout, "%" PRId64, vm->acc);
-            break;
-        case PRIS:
-            fprintf(stdout, "%" PRId64, TOS);
-            break;
-        case ADDI:
-            vm->acc += vm->mdr;
-            break;
-        case ADDM:
-            vm->acc += vm->data[vm->mdr];
-            break;
-        case ADDS:
-            vm->acc += TOS;
-            break;
-        case SUBI:
-            vm->acc -= vm->mdr;
-            break;
-        case SUBM:
-            vm->acc -= vm->data[vm->mdr];
-            break;
-        case SUBS:
-            vm->acc -= TOS;
-            break;
-        case MULI:
-            vm->acc *= vm->mdr;
-            break;
-        case MULM:
-            vm->acc *= vm->data[vm->mdr];
-            break;
-        case MULS:
-            vm->acc *= TOS;
-            break;
-        case DIVI:
-            vm->acc /= vm->mdr;
-            break;
-        case DIVM:
-            vm->acc /= vm->data[vm->mdr];
-            break;
-        case DIVS:
-            vm->acc /= TOS;
-            break;
-        case MODI:
-            vm->acc %= vm->mdr;
-            break;
-        case MODM:
-            vm->acc %= vm->data[vm->mdr];
-            break;
-        case MODS:
-            vm->acc %= TOS;
-            break;
-        case SHLI:
-            vm->acc <<= vm->mdr;
-            break;
-        case SHLM:
-            vm->acc <<= vm->data[vm->mdr];
-            break;
-        case SHLS:
-            vm->acc <<= TOS;
-            break;
-        case SHRI:
-            vm->acc >>= vm->mdr;
-            break;
-        case SHRM:
-            vm->acc >>= vm->data[vm->mdr];
-            break;
-        case SHRS:
-            vm->acc >>= TOS;
-            break;
-        case ANDI:
-            vm->acc &= vm->mdr;
-            break;
-        case ANDM:
-            vm->acc &= vm->data[vm->mdr];
-            break;
-        case ANDS:
-            vm->acc &= TOS;
-            break;
-        case ORI:
-            vm->acc |= vm->mdr;
-            break;
-        case ORM:
-            vm->acc |= vm->data[vm->mdr];
-            break;
-        case ORS:
-            vm->acc |= TOS;
-            break;
-        case XORI:
-            vm->acc ^= vm->mdr;
-            break;
-        case XORM:
-            vm->acc ^= vm->data[vm->mdr];
-            break;
-        case XORS:
-            vm->acc ^= TOS;
-            break;
-        case NOT:
-            vm->acc = !vm->acc;
-            break;
-        case NOTM:
-            vm->data[vm->mdr] = !vm->data[vm->mdr];
-            break;
-        case NOTS:
-            TOS = !TOS;
-            break;
-        case NEG:
-            vm->acc = -vm->acc;
-            break;
-        case NEGM:
-            vm->data[vm->mdr] = -vm->data[vm->mdr];
-            break;
-        case NEGS:
-            TOS = -TOS;
-            break;
-        case CSR:
-        case BRA:
-            vm->pc = vm->mdr;
-            break;
-        case BRAA:
-            vm->pc = vm->acc;
-            break;
-        case BRZ:
-            if (vm->acc == 0)
-                vm->pc = vm->mdr;
-            break;
-        case BRP:
-            if (vm->acc >= 0)
-                vm->pc = vm->mdr;
-            break;
-        case BRN:
-            if (vm->acc < 0)
-                vm->pc = vm->mdr;
-            break;
-        case RDCA: {
-            char buffer[4];
-            fgets(buffer, 3, stdin);
-            buffer[strlen(buffer) - 1] = '\0'; // Remove newline.
-            vm->acc = buffer[0];
-            break;
-        }
-        case RDCM: {
-            char buffer[4];
-            fgets(buffer, 3, stdin);
-            buffer[strlen(buffer) - 1] = '\0'; // Remove newline.
-            vm->data[vm->mdr] = buffer[0];
-            break;
-        }
-        case RDCS: {
-            char buffer[4];
-            fgets(buffer, 3, stdin);
-            buffer[strlen(buffer) - 1] = '\0'; // Remove newline.
-            TOS = buffer[0];
-            break;
-        }
-        case RDIA: {
-            char buffer[32];
-            fgets(buffer, 31, stdin);
-            buffer[strlen(buffer) - 1] = '\0'; // Remove newline.
+static inline u64 flags_of(i64 acc) {
+    return acc > 0 ? FLAG_CF : acc == 0 ? FLAG_ZF : FLAG_NF;
+}
 
-            vm->acc = atoi(buffer);
-            break;
-        }
-        case RDIM: {
-            char buffer[32];
-            fgets(buffer, 31, stdin);
-            buffer[strlen(buffer) - 1] = '\0'; // Remove newline.
+u64 pack_flags(VM *vm) {
+    return (vm->cf ? FLAG_CF : 0) | (vm->zf ? FLAG_ZF : 0) | (vm->nf ? FLAG_NF : 0);
+}
 
-            vm->data[vm->mdr] = atoi(buffer);
-            break;
-        }
-        case RDIS: {
-            char buffer[32];
-            fgets(buffer, 31, stdin);
-            buffer[strlen(buffer) - 1] = '\0'; // Remove newline.
+void unpack_flags(VM *vm, u64 flags) {
+    vm->cf = flags & FLAG_CF;
+    vm->zf = flags & FLAG_ZF;
+    vm->nf = flags & FLAG_NF;
+}
 
-            TOS = atoi(buffer);
-            break;
-        }
-        case REFM:
-            vm->acc = vm->mdr;
-            break;
-        case REFS:
-            vm->acc = TOS;
-            break;
-        case LDDA:
-            vm->acc = vm->data[vm->acc];
-            break;
-        case LDDM:
-            vm->acc = vm->data[vm->data[vm->mdr]];
-            break;
-        case LDDS:
-            vm->acc = vm->stack[TOS];
-            break;
-        case STDM:
-            vm->data[vm->data[vm->mdr]] = vm->acc;
-            break;
-        case STDS:
-            vm->stack[TOS] = vm->acc;
-            break;
-        case CMPI:
-            vm->acc = llabs(vm->acc) - llabs(vm->mdr);
-            set_flags(vm);
-            break;
-        case CMPM:
-            vm->acc = llabs(vm->acc) - llabs(vm->data[vm->mdr]);
-            set_flags(vm);
-            break;
-        case CMPS:
-            vm->acc = llabs(vm->acc) - llabs(TOS);
-            set_flags(vm);
-            break;
-        case BEQ:
-            if (vm->zf)
-                vm->pc = vm->mdr;
-            break;
-        case BNE:
-            if (!vm->zf)
-                vm->pc = vm->mdr;
-            break;
-        case BLT:
-            if (vm->nf)
-                vm->pc = vm->mdr;
-            break;
-        case BLE:
-            if (vm->nf || vm->zf)
-                vm->pc = vm->mdr;
-            break;
-        case BGT:
-            if (vm->cf)
-                vm->pc = vm->mdr;
-            break;
-        case BGE:
-            if (vm->cf || vm->zf)
-                vm->pc = vm->mdr;
-            break;
-        case INCA:
-            vm->acc++;
-            break;
-        case INCM:
-            vm->data[vm->mdr] += 1;
-            break;
-        case INCS:
-            TOS += 1;
-            break;
-        case DECA:
-            vm->acc--;
-            break;
-        case DECM:
-            vm->data[vm->mdr] -= 1;
-            break;
-        case DECS:
-            TOS -= 1;
-            break;
-        case PSHA:
-            assert_no_overflow(vm);
-            vm->stack[vm->sp++] = vm->acc;
-            break;
-        case PSHI:
-            assert_no_overflow(vm);
-            vm->stack[vm->sp++] = vm->mdr;
-            break;
-        case PSHM:
-            assert_no_overflow(vm);
-            vm->stack[vm->sp++] = vm->data[vm->mdr];
-            break;
-        case PSHS:
-            assert_no_overflow(vm);
-            vm->stack[vm->sp] = TOS;
-            vm->sp++;
-            break;
-        case POPA:
-            assert_no_underflow(vm);
-            vm->acc = vm->stack[--vm->sp];
-            break;
-        case POPM:
-            assert_no_underflow(vm);
-            vm->data[vm->mdr] = vm->stack[--vm->sp];
-            break;
-        case DRP:
-            vm->sp--;
-            break;
-        case SWPM: {
-            i64 temp = vm->acc;
-            vm->acc = vm->data[vm->mdr];
-            vm->data[vm->mdr] = temp;
+// Decoded instruction record, what the threaded engines run
+// instead of going through MAR, CIR and MDR every cycle.
+typedef int (*Handler)(VM *vm, const Insn *ip, i64 acc, i64 sp, u64 flags);
+
+struct Insn {
+    union {
+        const void *label;
+        Handler fn;
+    } handler;
+
+    i64 operand;
+};
+
+// The decoded operands are a cache of data[], so any write has
+// to go to both or stores into operand slots would be missed.
+static void store(VM *vm, i64 address, i64 value) {
+    vm->data[address] = value;
+
+    if (vm->code != NULL && (u64)address < vm->op_count)
+        vm->code[address].operand = value;
+}
+
+static char read_char(VM *vm) {
+    return input_char(&vm->input);
+}
+
+static i64 read_int(VM *vm) {
+    i64 value;
+
+    if (!input_int(&vm->input, &value)) {
+        fprintf(stderr, "vm: error: integer input out of range\n");
+        kill(vm);
+    }
+
+    return value;
+}
+
+// At most 126 characters and the terminator, so
+// it's never more than 127 slots of memory.
+static void read_string(VM *vm, i64 address) {
+    char buffer[126];
+    const size_t len = input_line(&vm->input, buffer, sizeof(buffer));
+
+    for (size_t i = 0; i < len; i++)
+        store(vm, address + i, buffer[i]);
+
+    store(vm, address + len, '\0');
+}
+
+// Strings are one character per slot, starting at address.
+static void print_string(VM *vm, i64 address, i64 length) {
+    if (length <= 0)
+        return;
+
+    if (address < 0 || (u64)address > vm->memory_cap || (u64)length > vm->memory_cap - address) {
+        fprintf(stderr, "vm: error: string out of bounds\n");
+        kill(vm);
+    }
+
+    output_cells(&vm->output, vm->data + address, length);
+}
+
+// Up to the first 0, or the end of memory.
+static void print_terminated(VM *vm, i64 address) {
+    if (address < 0 || (u64)address >= vm->memory_cap) {
+        fprintf(stderr, "vm: error: string out of bounds\n");
+        kill(vm);
+    }
+
+    const i64 *start = vm->data + address;
+    const i64 *end = vm->data + vm->memory_cap;
+    const i64 *p = start;
+
+    while (p != end && *p != 0)
+        p++;
+
+    output_cells(&vm->output, start, p - start);
+}
+
+// Block instructions, over count slots of memory from address. The
+// fill and compare kernels are picked once the CPU is known, copies
+// are left to memmove() which libc already picks a kernel for.
+typedef void (*FillKernel)(i64 *dst, i64 value, size_t count);
+typedef size_t (*CompareKernel)(const i64 *a, const i64 *b, size_t count);
+
+static void fill_scalar(i64 *dst, i64 value, size_t count) {
+    for (size_t i = 0; i < count; i++)
+        dst[i] = value;
+}
+
+// Index of the first slot that differs, or count.
+static size_t compare_scalar(const i64 *a, const i64 *b, size_t count) {
+    size_t i = 0;
+
+    while (i < count && a[i] == b[i])
+        i++;
+
+    return i;
+}
+
+#ifdef __x86_64__
+static void fill_sse2(i64 *dst, i64 value, size_t count) {
+    const __m128i v = _mm_set1_epi64x(value);
+    size_t i = 0;
+
+    for (; i + 2 <= count; i += 2)
+        _mm_storeu_si128((__m128i *)(dst + i), v);
+
+    fill_scalar(dst + i, value, count - i);
+}
+
+// SSE2 can't compare 64 bits at a time, but equal
+// halves are just as good for finding a difference.
+static size_t compare_sse2(const i64 *a, const i64 *b, size_t count) {
+    size_t i = 0;
+
+    for (; i + 2 <= count; i += 2) {
+        const __m128i x = _mm_loadu_si128((const __m128i *)(a + i));
+        const __m128i y = _mm_loadu_si128((const __m128i *)(b + i));
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(x, y)) != 0xFFFF)
             break;
-        }
-        case SWPS: {
-            i64 temp = vm->acc;
-            vm->acc = TOS;
-            TOS = temp;
+    }
+
+    return i + compare_scalar(a + i, b + i, count - i);
+}
+
+__attribute__((target("avx2"))) static void fill_avx2(i64 *dst, i64 value, size_t count) {
+    const __m256i v = _mm256_set1_epi64x(value);
+    size_t i = 0;
+
+    for (; i + 4 <= count; i += 4)
+        _mm256_storeu_si256((__m256i *)(dst + i), v);
+
+    fill_scalar(dst + i, value, count - i);
+}
+
+__attribute__((target("avx2"))) static size_t compare_avx2(const i64 *a, const i64 *b, size_t count) {
+    size_t i = 0;
+
+    for (; i + 4 <= count; i += 4) {
+        const __m256i x = _mm256_loadu_si256((const __m256i *)(a + i));
+        const __m256i y = _mm256_loadu_si256((const __m256i *)(b + i));
+
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi64(x, y)) != -1)
             break;
+    }
+
+    return i + compare_scalar(a + i, b + i, count - i);
+}
+#endif
+
+static FillKernel fill_kernel;
+static CompareKernel compare_kernel;
+
+static void pick_kernels() {
+    fill_kernel = fill_scalar;
+    compare_kernel = compare_scalar;
+
+#ifdef __x86_64__
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2")) {
+        fill_kernel = fill_avx2;
+        compare_kernel = compare_avx2;
+    } else {
+        fill_kernel = fill_sse2;
+        compare_kernel = compare_sse2;
+    }
+#endif
+}
+
+// Whether count slots from address are all in memory, nothing
+// happens for counts of 0 or less.
+static bool check_block(VM *vm, i64 address, i64 count) {
+    if (count <= 0)
+        return false;
+
+    if (address < 0 || (u64)address > vm->memory_cap || (u64)count > vm->memory_cap - address) {
+        fprintf(stderr, "vm: error: block out of bounds\n");
+        kill(vm);
+    }
+
+    return true;
+}
+
+// Block stores go around STORE(), so the decoded operands
+// they cover have to be brought up to date here.
+static void sync_code(VM *vm, i64 address, i64 count) {
+    if (vm->code == NULL || (u64)address >= vm->op_count)
+        return;
+
+    const u64 end = (u64)(address + count) < vm->op_count ? (u64)(address + count) : vm->op_count;
+
+    for (u64 i = address; i < end; i++)
+        vm->code[i].operand = vm->data[i];
+}
+
+static void copy_block(VM *vm, i64 dst, i64 src, i64 count) {
+    if (!check_block(vm, dst, count) || !check_block(vm, src, count))
+        return;
+
+    memmove(vm->data + dst, vm->data + src, count * sizeof(i64));
+    sync_code(vm, dst, count);
+}
+
+static void fill_block(VM *vm, i64 dst, i64 value, i64 count) {
+    if (!check_block(vm, dst, count))
+        return;
+
+    fill_kernel(vm->data + dst, value, count);
+    sync_code(vm, dst, count);
+}
+
+// Like cmp, 1, 0 or -1 for whether the first block is greater,
+// equal or less, going by the first slots that differ.
+static i64 compare_blocks(VM *vm, i64 a, i64 b, i64 count) {
+    if (!check_block(vm, a, count) || !check_block(vm, b, count))
+        return 0;
+
+    const size_t i = compare_kernel(vm->data + a, vm->data + b, count);
+
+    if (i == (size_t)count)
+        return 0;
+
+    return vm->data[a + i] > vm->data[b + i] ? 1 : -1;
+}
+
+__attribute__((noreturn)) static void undefined_instruction(VM *vm) {
+    fprintf(stderr, "vm: error: undefined instruction %" PRIu64 "\n", (u64)vm->cir);
+    kill(vm);
+}
+
+__attribute__((noreturn)) static void end_of_memory(VM *vm) {
+    vm->pc = vm->memory_cap;
+    fprintf(stderr, "vm: error: reached end of memory\n");
+    kill(vm);
+}
+
+// Translate the program into decoded records, the handlers are
+// filled in by the engine since they differ between them. The
+// extra record at the end catches running off the end of the
+// program, the rest of memory is only NOPs.
+static Insn *create_code(VM *vm) {
+    free(vm->code);
+    vm->code = malloc((vm->op_count + 1) * sizeof(Insn));
+
+    for (size_t i = 0; i < vm->op_count; i++)
+        vm->code[i].operand = vm->data[i];
+
+    vm->code[vm->op_count].operand = 0;
+    return vm->code;
+}
+
+static inline bool is_opcode(Opcode opcode) {
+    return (size_t)opcode < OPCODE_COUNT;
+}
+
+typedef struct {
+    Opcode fused;
+    Opcode sequence[3];
+    size_t length;
+} Fusion;
+
+// Longer sequences go first so they win over their prefixes.
+static const Fusion fusions[] = {
+    { LDM_ADDM_STM, { LDM, ADDM, STM }, 3 },
+    { LDM_CMPI_BEQ, { LDM, CMPI, BEQ }, 3 },
+    { INCM_DECM_BRA, { INCM, DECM, BRA }, 3 },
+    { LDM_BRZ, { LDM, BRZ }, 2 },
+    { DECM_BRA, { DECM, BRA }, 2 },
+    { PSHI_CSR, { PSHI, CSR }, 2 },
+    { POPA_BRAA, { POPA, BRAA }, 2 }
+};
+
+#define FUSION_COUNT (sizeof(fusions) / sizeof(fusions[0]))
+
+// Pick the handler for the record at address, HANDLER_COUNT
+// means the instruction is undefined.
+static Opcode decoded_opcode(VM *vm, size_t address) {
+    if (!is_opcode(vm->instructions[address]))
+        return HANDLER_COUNT;
+
+    for (size_t i = 0; i < FUSION_COUNT; i++) {
+        const Fusion *fusion = &fusions[i];
+
+        if (!(vm->fusions & ((u64)1 << i)) || address + fusion->length > vm->op_count)
+            continue;
+
+        size_t j = 0;
+
+        while (j < fusion->length && vm->instructions[address + j] == fusion->sequence[j])
+            j++;
+
+        if (j == fusion->length)
+            return fusion->fused;
+    }
+
+    return vm->instructions[address];
+}
+
+static inline const Insn *jump_target(const VM *vm, i64 target) {
+    return &vm->code[(u64)target < vm->op_count ? (u64)target : vm->op_count];
+}
+
+// The threaded engines only keep track of where they are in the
+// decoded stream, materialize the architectural registers from it
+// for anyone who wants to look at them.
+static void sync_registers(VM *vm, const Insn *ip) {
+    vm->pc = ip - vm->code;
+    vm->mar = vm->pc - 1;
+    vm->cir = vm->instructions[vm->mar];
+    vm->mdr = vm->data[vm->mar];
+}
+
+#define FOR_EACH_OPCODE(X) \
+    X(NOP) X(HLT) X(LDI) X(LDM) X(LDAS) X(STM) X(STAS) X(PRCI) \
+    X(PRCM) X(PRCA) X(PRCS) X(PRII) X(PRIM) X(PRIA) X(PRIS) X(ADDI) \
+    X(ADDM) X(ADDS) X(SUBI) X(SUBM) X(SUBS) X(MULI) X(MULM) X(MULS) \
+    X(DIVI) X(DIVM) X(DIVS) X(MODI) X(MODM) X(MODS) X(SHLI) X(SHLM) \
+    X(SHLS) X(SHRI) X(SHRM) X(SHRS) X(ANDI) X(ANDM) X(ANDS) X(ORI) \
+    X(ORM) X(ORS) X(XORI) X(XORM) X(XORS) X(NOT) X(NOTM) X(NOTS) \
+    X(NEG) X(NEGM) X(NEGS) X(BRA) X(BRAA) X(BRZ) X(BRP) X(BRN) \
+    X(RDCA) X(RDCM) X(RDCS) X(RDIA) X(RDIM) X(RDIS) X(REFM) X(REFS) \
+    X(LDDA) X(LDDM) X(LDDS) X(STDM) X(STDS) X(DAT) X(CMPI) X(CMPM) \
+    X(CMPS) X(BEQ) X(BNE) X(BLT) X(BLE) X(BGT) X(BGE) X(CSR) \
+    X(INCA) X(INCM) X(INCS) X(DECA) X(DECM) X(DECS) X(PSHA) X(PSHI) \
+    X(PSHM) X(PSHS) X(POPA) X(POPM) X(DRP) X(SWPM) X(SWPS) X(SEZA) \
+    X(SEZM) X(SEZS) X(SEPA) X(SEPM) X(SEPS) X(SENA) X(SENM) X(SENS) \
+    X(SEQA) X(SEQM) X(SEQS) X(SNEA) X(SNEM) X(SNES) X(SLTA) X(SLTM) \
+    X(SLTS) X(SLEA) X(SLEM) X(SLES) X(SGTA) X(SGTM) X(SGTS) X(SGEA) \
+    X(SGEM) X(SGES) X(IPS) X(PRSI) X(PRSM) X(PRSA) \
+    X(CPYI) X(CPYM) X(FILI) X(FILM) X(CMBI) X(CMBM) \
+    X(LDM_ADDM_STM) X(LDM_CMPI_BEQ) X(INCM_DECM_BRA) X(LDM_BRZ) \
+    X(DECM_BRA) X(PSHI_CSR) X(POPA_BRAA)
+
+// The switch engine, one big switch that every instruction
+// goes through. Slowest but it's the reference implementation
+// and is what cycle_vm() single steps with.
+static void execute(VM *vm) {
+#define ACC vm->acc
+#define OPERAND vm->mdr
+#define SP vm->sp
+#define ZF vm->zf
+#define CF vm->cf
+#define NF vm->nf
+#define MEM(i) vm->data[i]
+#define STACK(i) vm->stack[i]
+#define TOS STACK(SP == 0 ? 0 : SP - 1)
+#define STORE(i, value) (vm->data[i] = (value))
+#define OPERAND_AT(n) vm->data[vm->mar + (n)]
+#define SKIP(n) (vm->pc += (n))
+#define SET_FLAGS() set_flags(vm)
+#define CHECK_OVERFLOW() assert_no_overflow(vm)
+#define CHECK_UNDERFLOW() assert_no_underflow(vm)
+#define OPCODE(op) case op:
+#define NEXT() return
+#define JUMP(target) do { vm->pc = (target); return; } while (0)
+#define HALT() do { vm->running = false; return; } while (0)
+
+    // Superinstructions have handlers here too, but they're not
+    // valid in machine code.
+    if (is_opcode(vm->cir)) {
+        switch (vm->cir) {
+#include "opcodes.def"
         }
-        case SEZA:
-        case SEQA:
-            vm->acc = vm->zf ? 1 : 0;
-            break;
-        case SEZM:
-        case SEQM:
-            vm->data[vm->mdr] = vm->zf ? 1 : 0;
-            break;
-        case SEQS:
-        case SEZS:
-            TOS = vm->zf ? 1 : 0;
-            break;
-        case SNEA:
-            vm->acc = vm->zf ? 0 : 1;
-            break;
-        case SNEM:
-            vm->data[vm->mdr] = vm->zf ? 0 : 1;
-            break;
-        case SNES:
-            TOS = vm->zf ? 0 : 1;
-            break;
-        case SEPA:
-        case SLTA:
-            vm->acc = vm->cf ? 1 : 0;
-            break;
-        case SEPM:
-        case SLTM:
-            vm->data[vm->mdr] = vm->cf ? 1 : 0;
-            break;
-        case SEPS:
-        case SLTS:
-            TOS = vm->cf ? 1 : 0;
-            break;
-        case SENA:
-        case SGTA:
-            vm->acc = vm->nf ? 1 : 0;
-            break;
-        case SENM:
-        case SGTM:
-            vm->data[vm->mdr] = vm->nf ? 1 : 0;
+    }
+
+#undef ACC
+#undef OPERAND
+#undef SP
+#undef ZF
+#undef CF
+#undef NF
+#undef MEM
+#undef STACK
+#undef TOS
+#undef STORE
+#undef OPERAND_AT
+#undef SKIP
+#undef SET_FLAGS
+#undef CHECK_OVERFLOW
+#undef CHECK_UNDERFLOW
+#undef OPCODE
+#undef NEXT
+#undef JUMP
+#undef HALT
+
+    undefined_instruction(vm);
+}
+
+// The decoded engines keep a pointer to the record after the one
+// being executed, just like the PC, and the accumulator, stack
+// pointer and flags in locals so they can live in registers for
+// the whole run. They're only written back to the VM when the run
+// stops, be it from a halt or an error.
+//
+// Every handler is included twice, the second time with CHECKED
+// set to 0 for programs that passed the verifier, which leaves out
+// the stack checks and keeping the decoded operands in step with
+// memory.
+#define ACC acc
+#define OPERAND ip[-1].operand
+#define SP sp
+#define ZF (flags & FLAG_ZF)
+#define CF (flags & FLAG_CF)
+#define NF (flags & FLAG_NF)
+#define MEM(i) vm->data[i]
+#define STACK(i) vm->stack[i]
+#define TOS STACK(SP == 0 ? 0 : SP - 1)
+#define STORE(i, value) do { \
+        const i64 address_ = (i); \
+        const i64 value_ = (value); \
+        vm->data[address_] = value_; \
+        if (CHECKED && (u64)address_ < vm->op_count) \
+            vm->code[address_].operand = value_; \
+    } while (0)
+#define OPERAND_AT(n) ip[(n) - 1].operand
+#define SKIP(n) (ip += (n))
+#define SET_FLAGS() (flags = flags_of(acc))
+#define SPILL() do { \
+        sync_registers(vm, ip); \
+        vm->acc = acc; \
+        vm->sp = sp; \
+        unpack_flags(vm, flags); \
+    } while (0)
+#define CHECK_OVERFLOW() do { \
+        if (CHECKED && (size_t)sp == vm->stack_cap) { \
+            SPILL(); \
+            assert_no_overflow(vm); \
+        } \
+    } while (0)
+#define CHECK_UNDERFLOW() do { \
+        if (CHECKED && sp == 0) { \
+            SPILL(); \
+            assert_no_underflow(vm); \
+        } \
+    } while (0)
+
+// The computed goto engine, the decoded stream holds the address
+// of each handler and every handler jumps straight to the next one
+// through its own indirect branch instead of all of them sharing
+// the one at the top of the switch, which gives the branch
+// predictor a lot more to work with.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+
+static void run_goto(VM *vm) {
+#define LABEL_ADDRESS(op) [op] = &&op_##op,
+    static const void *const checked_labels[HANDLER_COUNT] = { FOR_EACH_OPCODE(LABEL_ADDRESS) };
+#undef LABEL_ADDRESS
+#define LABEL_ADDRESS(op) [op] = &&unchecked_##op,
+    static const void *const unchecked_labels[HANDLER_COUNT] = { FOR_EACH_OPCODE(LABEL_ADDRESS) };
+#undef LABEL_ADDRESS
+
+    const void *const *const labels = vm->verified ? unchecked_labels : checked_labels;
+    Insn *const code = create_code(vm);
+
+    for (size_t i = 0; i < vm->op_count; i++) {
+        const Opcode opcode = decoded_opcode(vm, i);
+        code[i].handler.label = opcode < HANDLER_COUNT ? labels[opcode] : &&undefined;
+    }
+
+    code[vm->op_count].handler.label = &&end;
+
+    const Insn *ip = jump_target(vm, vm->pc);
+    i64 acc = vm->acc;
+    i64 sp = vm->sp;
+    u64 flags = pack_flags(vm);
+
+#define OPCODE(op) op_##op:
+#define NEXT() goto *(ip++)->handler.label
+#define JUMP(target) do { ip = jump_target(vm, (target)); NEXT(); } while (0)
+#define HALT() do { SPILL(); vm->running = false; return; } while (0)
+
+    NEXT();
+
+#define CHECKED 1
+#include "opcodes.def"
+#undef CHECKED
+#undef OPCODE
+
+#define OPCODE(op) unchecked_##op:
+#define CHECKED 0
+#include "opcodes.def"
+#undef CHECKED
+
+undefined:
+    SPILL();
+    undefined_instruction(vm);
+end:
+    end_of_memory(vm);
+
+#undef OPCODE
+#undef NEXT
+#undef JUMP
+#undef HALT
+}
+
+#pragma GCC diagnostic pop
+
+// The tail calling engine, every opcode gets its own function
+// which tail calls the handler of the next record with the
+// registers as arguments, so they stay in machine registers
+// across the calls. Without musttail we rely on the optimizer to
+// turn the calls into jumps, otherwise the native stack grows
+// every instruction.
+#if defined(__has_attribute)
+#if __has_attribute(musttail)
+#define MUSTTAIL __attribute__((musttail))
+#endif
+#endif
+
+#ifndef MUSTTAIL
+#define MUSTTAIL
+
+#ifndef __OPTIMIZE__
+#define NO_TAIL_CALLS
+#endif
+#endif
+
+#define HANDLER_PARAMS VM *vm, const Insn *ip, i64 acc, i64 sp, u64 flags
+
+#define DECLARE_HANDLER(op) static int tail_##op(HANDLER_PARAMS); static int unchecked_##op(HANDLER_PARAMS);
+FOR_EACH_OPCODE(DECLARE_HANDLER)
+#undef DECLARE_HANDLER
+
+#define HANDLER_ADDRESS(op) [op] = tail_##op,
+static const Handler checked_handlers[HANDLER_COUNT] = { FOR_EACH_OPCODE(HANDLER_ADDRESS) };
+#undef HANDLER_ADDRESS
+#define HANDLER_ADDRESS(op) [op] = unchecked_##op,
+static const Handler unchecked_handlers[HANDLER_COUNT] = { FOR_EACH_OPCODE(HANDLER_ADDRESS) };
+#undef HANDLER_ADDRESS
+
+static int tail_undefined(HANDLER_PARAMS) {
+    SPILL();
+    undefined_instruction(vm);
+}
+
+static int tail_end(HANDLER_PARAMS) {
+    SPILL();
+    end_of_memory(vm);
+}
+
+#define OPCODE(op) static int tail_##op(HANDLER_PARAMS)
+#define NEXT() do { MUSTTAIL return ip->handler.fn(vm, ip + 1, acc, sp, flags); } while (0)
+#define JUMP(target) do { ip = jump_target(vm, (target)); NEXT(); } while (0)
+#define HALT() do { SPILL(); vm->running = false; return EXIT_SUCCESS; } while (0)
+
+#define CHECKED 1
+#include "opcodes.def"
+#undef CHECKED
+#undef OPCODE
+
+#define OPCODE(op) static int unchecked_##op(HANDLER_PARAMS)
+#define CHECKED 0
+#include "opcodes.def"
+#undef CHECKED
+
+#undef OPCODE
+#undef NEXT
+#undef JUMP
+#undef HALT
+
+static void run_tail(VM *vm) {
+    const Handler *const handlers = vm->verified ? unchecked_handlers : checked_handlers;
+    Insn *const code = create_code(vm);
+
+    for (size_t i = 0; i < vm->op_count; i++) {
+        const Opcode opcode = decoded_opcode(vm, i);
+        code[i].handler.fn = opcode < HANDLER_COUNT ? handlers[opcode] : tail_undefined;
+    }
+
+    code[vm->op_count].handler.fn = tail_end;
+
+    const Insn *ip = jump_target(vm, vm->pc);
+    ip->handler.fn(vm, ip + 1, vm->acc, vm->sp, pack_flags(vm));
+}
+
+#undef HANDLER_PARAMS
+#undef ACC
+#undef OPERAND
+#undef SP
+#undef ZF
+#undef CF
+#undef NF
+#undef MEM
+#undef STACK
+#undef TOS
+#undef STORE
+#undef OPERAND_AT
+#undef SKIP
+#undef SET_FLAGS
+#undef SPILL
+#undef CHECK_OVERFLOW
+#undef CHECK_UNDERFLOW
+
+bool engine_from_string(const char *name, Engine *engine) {
+    if (strcmp(name, "switch") == 0)
+        *engine = ENGINE_SWITCH;
+    else if (strcmp(name, "goto") == 0)
+        *engine = ENGINE_GOTO;
+    else if (strcmp(name, "tail") == 0)
+        *engine = ENGINE_TAIL;
+    else if (strcmp(name, "jit") == 0)
+        *engine = ENGINE_JIT;
+    else if (strcmp(name, "trace") == 0)
+        *engine = ENGINE_TRACE;
+    else
+        return false;
+
+    return true;
+}
+
+// A number of slots, with an optional k, m or g suffix
+// for multiples of 1024.
+bool size_from_string(const char *str, size_t *size) {
+    char *endptr;
+    errno = 0;
+    const unsigned long long value = strtoull(str, &endptr, 10);
+    size_t scale = 1;
+
+    if (endptr == str || str[0] == '-' || errno == ERANGE)
+        return false;
+
+    switch (*endptr) {
+        case '\0':
             break;
-        case SENS:
-        case SGTS:
-            TOS = vm->nf ? 1 : 0;
+        case 'k':
+        case 'K':
+            scale = (size_t)1 << 10;
+            endptr++;
             break;
-        case SLEA:
-            vm->acc = vm->cf || vm->zf ? 1 : 0;
+        case 'm':
+        case 'M':
+            scale = (size_t)1 << 20;
+            endptr++;
             break;
-        case SLEM:
-            vm->data[vm->mdr] = vm->cf || vm->zf ? 1 : 0;
+        case 'g':
+        case 'G':
+            scale = (size_t)1 << 30;
+            endptr++;
             break;
-        case SLES:
-            TOS = vm->cf || vm->zf ? 1 : 0;
+        default:
+            return false;
+    }
+
+    if (*endptr != '\0' || value == 0 || value > MAX_CAP / scale)
+        return false;
+
+    *size = value * scale;
+    return true;
+}
+
+static inline void step(VM *vm) {
+    fetch(vm);
+    decode(vm);
+    execute(vm);
+}
+
+// Like step(), counting the pair of instructions. Only pairs the
+// decoder could fuse count, so the second instruction has to
+// directly follow the first in memory.
+static void step_recording(VM *vm) {
+    const i64 last_address = vm->mar;
+    const Opcode last = vm->cir;
+
+    fetch(vm);
+    decode(vm);
+
+    if (vm->mar == last_address + 1 && is_opcode(last) && is_opcode(vm->cir))
+        vm->histogram[last * OPCODE_COUNT + vm->cir]++;
+
+    execute(vm);
+}
+
+static void open_vm(VM *vm) {
+    map_vm(vm);
+    open_output(&vm->output, STDOUT_FILENO);
+    open_input(&vm->input, &vm->output);
+    pick_kernels();
+    vm->running = true;
+}
+
+void start_vm(VM *vm) {
+    open_vm(vm);
+
+    // Only the switch engine sees every instruction.
+    if (vm->histogram != NULL)
+        vm->engine = ENGINE_SWITCH;
+
+#ifdef NO_TAIL_CALLS
+    if (vm->engine == ENGINE_TAIL) {
+        fprintf(stderr, "vm: warning: tail calling engine needs optimizations, using the switch engine\n");
+        vm->engine = ENGINE_SWITCH;
+    }
+#endif
+
+    switch (vm->engine) {
+        case ENGINE_GOTO:
+            run_goto(vm);
             break;
-        case SGEA:
-            vm->acc = vm->nf || vm->zf ? 1 : 0;
+        case ENGINE_TAIL:
+            run_tail(vm);
             break;
-        case SGEM:
-            vm->data[vm->mdr] = vm->nf || vm->zf ? 1 : 0;
+        case ENGINE_JIT:
+            // Whatever the JIT can't run, the goto
+            // engine picks up from where it left off.
+            if (!run_jit(vm) || vm->running)
+                run_goto(vm);
             break;
-        case SGES:
-            TOS = vm->nf || vm->zf ? 1 : 0;
+        case ENGINE_TRACE:
+            if (!run_trace(vm) || vm->running)
+                run_goto(vm);
             break;
-        case IPS: {
-            char buffer[128];
-            fgets(buffer, 127, stdin);
-            const size_t len = strlen(buffer);
-            size_t i;
-
-            for (i = 0; i < len && i < 127; i++) {
-                const char c = buffer[i];
-
-                if (c == '\n')
-                    break;
-
-                vm->data[vm->mdr + i] = c;
+        default:
+            // Recording gets a loop of its own so running without
+            // it doesn't check for it on every instruction.
+            if (vm->histogram != NULL) {
+                while (vm->running)
+                    step_recording(vm);
+            } else {
+                while (vm->running)
+                    step(vm);
             }
 
-            vm->data[vm->mdr + i] = '\0';
             break;
-        }
-        default:
-            fprintf(stderr, "vm: error: undefined instruction %" PRIu64 "\n", (u64)vm->cir);
-            kill(vm);
     }
+
+    flush_output(&vm->output);
 }
 
-void start_vm(VM *vm) {
-    vm->running = true;
+// Runs the program through the switch engine until it's about to
+// execute the instruction at address, and leaves it there for a
+// snapshot to be taken. False if it halted first.
+bool run_until(VM *vm, i64 address) {
+    open_vm(vm);
 
-    while (vm->running)
+    while (vm->running && vm->pc != address)
         cycle_vm(vm);
+
+    flush_output(&vm->output);
+    return vm->running;
 }
 
 void cycle_vm(VM *vm) {
-    fetch(vm);
-    decode(vm);
-    execute(vm);
+    if (vm->histogram != NULL)
+        step_recording(vm);
+    else
+        step(vm);
+}
+
+// Run the single instruction at address through the switch engine.
+void execute_at(VM *vm, i64 address) {
+    vm->pc = address;
+    cycle_vm(vm);
+}
+
+void record_histogram(VM *vm) {
+    free(vm->histogram);
+    vm->histogram = calloc(OPCODE_COUNT * OPCODE_COUNT, sizeof(u64));
+}
+
+// One pair per line: count, first opcode, second opcode.
+bool save_histogram(VM *vm, char *filename) {
+    FILE *f = fopen(filename, "w");
+
+    if (f == NULL) {
+        fprintf(stderr, "vm: error: failed to write to file '%s'\n", filename);
+        return false;
+    }
+
+    for (size_t i = 0; i < OPCODE_COUNT * OPCODE_COUNT; i++) {
+        if (vm->histogram[i] > 0)
+            fprintf(f, "%" PRIu64 " %zu %zu\n", vm->histogram[i], i / OPCODE_COUNT, i % OPCODE_COUNT);
+    }
+
+    fclose(f);
+    return true;
+}
+
+// Enable only the superinstructions whose pairs all made up
+// at least 0.1% of the pairs recorded in a histogram file.
+bool load_fusions(VM *vm, char *filename) {
+    FILE *f = fopen(filename, "r");
+
+    if (f == NULL) {
+        fprintf(stderr, "vm: error: no such file '%s'\n", filename);
+        return false;
+    }
+
+    u64 *counts = calloc(OPCODE_COUNT * OPCODE_COUNT, sizeof(u64));
+    u64 total = 0;
+    u64 count;
+    size_t first;
+    size_t second;
+    int matched;
+
+    while ((matched = fscanf(f, "%" SCNu64 " %zu %zu", &count, &first, &second)) == 3) {
+        if (first >= OPCODE_COUNT || second >= OPCODE_COUNT) {
+            fprintf(stderr, "vm: error: invalid opcode pair in histogram '%s'\n", filename);
+            fclose(f);
+            free(counts);
+            return false;
+        }
+
+        counts[first * OPCODE_COUNT + second] += count;
+        total += count;
+    }
+
+    // Anything but the end of the file is a line that didn't parse.
+    if (matched != EOF || ferror(f)) {
+        fprintf(stderr, "vm: error: invalid histogram file '%s'\n", filename);
+        fclose(f);
+        free(counts);
+        return false;
+    }
+
+    fclose(f);
+    vm->fusions = 0;
+
+    for (size_t i = 0; i < FUSION_COUNT; i++) {
+        const Fusion *fusion = &fusions[i];
+        bool hot = true;
+
+        for (size_t j = 0; j + 1 < fusion->length && hot; j++)
+            hot = counts[fusion->sequence[j] * OPCODE_COUNT + fusion->sequence[j + 1]] * 1000 >= total;
+
+        if (hot && total > 0)
+            vm->fusions |= (u64)1 << i;
+    }
+
+    free(counts);
+    return true;
 }
 
 void push_op(VM *vm, Opcode opcode, i64 operand) {
-    if (vm->op_count >= MEMORY_CAP) {
+    if (vm->op_count >= vm->memory_cap) {
         fprintf(stderr, "memory overflow\n");
         kill(vm);
     }
@@ -641,6 +1174,22 @@ char *opcode_to_string(Opcode opcode) {
         case SGEM:
         case SGES: return "sge";
         case IPS: return "ips";
+        case PRSI:
+        case PRSM:
+        case PRSA: return "ops";
+        case CPYI:
+        case CPYM: return "cpy";
+        case FILI:
+        case FILM: return "fil";
+        case CMBI:
+        case CMBM: return "cmb";
+        case LDM_ADDM_STM: return "lda+add+sta";
+        case LDM_CMPI_BEQ: return "lda+cmp+beq";
+        case INCM_DECM_BRA: return "inc+dec+jmp";
+        case LDM_BRZ: return "lda+brz";
+        case DECM_BRA: return "dec+jmp";
+        case PSHI_CSR: return "csr";
+        case POPA_BRAA: return "rsr";
     }
 
     printf(">>>>%u\n", opcode);
@@ -1,16 +1,22 @@
 #ifndef VM_H
 #define VM_H
 
+#include "input.h"
+#include "output.h"
 #include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
 
-// 1024 available slots, * 8 due to being int64_t,
+// 1024 available slots by default, * 8 due to being int64_t,
 // * 2 due to 2 separate memories, so really it's 16KiB.
-#define MEMORY_CAP (size_t)1024
+#define DEFAULT_MEMORY_CAP (size_t)1024
 
 // 128 * 8 due to int64_t = 1024
-#define STACK_CAP (size_t)128
+#define DEFAULT_STACK_CAP (size_t)128
+
+// Programs and the command line can ask for more, up to 2^40
+// slots which is 8TiB of address space per memory.
+#define MAX_CAP ((size_t)1 << 40)
 
 typedef enum {
     NOP,
@@ -135,12 +141,51 @@ typedef enum {
     SGEA,
     SGEM,
     SGES,
-    IPS
+    IPS,
+    PRSI,
+    PRSM,
+    PRSA,
+    CPYI,
+    CPYM,
+    FILI,
+    FILM,
+    CMBI,
+    CMBM,
+
+    // Superinstructions, only ever created by the decoder in place
+    // of the first instruction of a sequence, never valid in
+    // machine code.
+    LDM_ADDM_STM,
+    LDM_CMPI_BEQ,
+    INCM_DECM_BRA,
+    LDM_BRZ,
+    DECM_BRA,
+    PSHI_CSR,
+    POPA_BRAA
 } Opcode;
 
+#define OPCODE_COUNT (CMBM + 1)
+#define HANDLER_COUNT (POPA_BRAA + 1)
+
+typedef enum {
+    ENGINE_SWITCH,
+    ENGINE_GOTO,
+    ENGINE_TAIL,
+    ENGINE_JIT,
+    ENGINE_TRACE
+} Engine;
+
 typedef int64_t i64;
 typedef uint64_t u64;
 
+typedef struct Insn Insn;
+
+// The flags packed into one word, how the decoded
+// engines and the JIT keep them in a register.
+#define FLAG_CF (u64)1
+#define FLAG_ZF (u64)2
+#define FLAG_NF (u64)4
+
 typedef struct {
     i64 acc;
     i64 pc;
@@ -148,18 +193,43 @@ typedef struct {
     Opcode cir;
     i64 mdr;
 
-    Opcode instructions[MEMORY_CAP];
-    i64 data[MEMORY_CAP];
+    // Mapped by map_vm() once the sizes are known, zero
+    // sizes until then mean nobody has asked for one.
+    Opcode *instructions;
+    i64 *data;
+    size_t memory_cap;
     u64 op_count;
 
+    // Decoded copy of instructions and data that the
+    // threaded engines run, built when they start.
+    Insn *code;
+
+    // Bitmask of the superinstructions the decoder may use.
+    u64 fusions;
+
+    // Counts of instructions falling through to the next one,
+    // indexed by [first * OPCODE_COUNT + second], if recording.
+    u64 *histogram;
+
     bool cf;
     bool zf;
     bool nf;
 
-    i64 stack[STACK_CAP];
+    i64 *stack;
+    size_t stack_cap;
     i64 sp;
 
+    // Everything the program prints and reads, opened when it starts.
+    Output output;
+    Input input;
+
+    Engine engine;
     bool running;
+
+    // Set when the verifier proved the program can't overflow or
+    // underflow the stack or store into an operand, so the engines
+    // can leave those checks out.
+    bool verified;
 } VM;
 
 typedef struct {
@@ -169,10 +239,22 @@ typedef struct {
 
 VM *create_vm();
 void delete_vm(VM *vm);
+void map_vm(VM *vm);
+bool map_file(VM *vm, void *region, size_t size, int fd, size_t offset);
+bool map_image(VM *vm, int fd, size_t opcodes_at, size_t operands_at, u64 op_count);
 void start_vm(VM *vm);
+bool run_until(VM *vm, i64 address);
 void cycle_vm(VM *vm);
+void execute_at(VM *vm, i64 address);
+u64 pack_flags(VM *vm);
+void unpack_flags(VM *vm, u64 flags);
 void push_op(VM *vm, Opcode opcode, i64 operand);
 __attribute__((noreturn)) void kill(VM *vm);
+bool engine_from_string(const char *name, Engine *engine);
+bool size_from_string(const char *str, size_t *size);
+void record_histogram(VM *vm);
+bool save_histogram(VM *vm, char *filename);
+bool load_fusions(VM *vm, char *filename);
 char *opcode_to_string(Opcode opcode);
 
 #endif
\ No newline at end of file